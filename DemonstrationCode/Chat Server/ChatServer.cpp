@@ -1,8 +1,7 @@
 #include "ChatServer.h"
 
 //declare variables in global scope
-ClientNode *headPtr = NULL;
-ClientNode *lastPtr = NULL;
+ConnectionTable connections(NUM_CONNECTIONS);
 bool serverRunning = true;
 int numCurrentConnections=0;
 //init an epoll instance which has a queue NUM_CONNECTIONS long
@@ -19,177 +18,64 @@ void debug(string str)
 //return true if given username is found currently connected
 bool checkForUsername(const string usr)
 {   
-    ClientNode *wkgPtr = headPtr;
-
-    while(wkgPtr != NULL)
-    {
-        if (wkgPtr->username == usr)
-        {
-            return true;
-        }
-        wkgPtr = wkgPtr->nextPtr;
-    }
-    return false;
+    return connections.findByName(usr) != NULL;
 }
 
-//returns the node associated with given id, otherwise returns null
-ClientNode *getClientNodeById(const int searchId)
+//frees sockets and other resources of every client
+void freeClientNodes()
 {
-    ClientNode *wkgPtr = headPtr;
-
-    while (wkgPtr != NULL)
+    connections.forEach([](Socket &conn)
     {
-        if (wkgPtr->conn->socketId == searchId)
-        {
-            return wkgPtr;
-        }
-        wkgPtr = wkgPtr->nextPtr;
-    }
-    return NULL;
+        freeClientNode(conn.socketId);
+    });
 }
 
-//frees sockets and other resources in client linked list
-ClientNode *freeClientNodes()
-{
-    ClientNode *wkgPtr = headPtr;
-    ClientNode *wkgPtr2;
-    
-    //loop through the list
-    while (wkgPtr != NULL)
-    {
-        //save location of next node
-        wkgPtr2 = wkgPtr->nextPtr;
-
-        //remove the fd from the epoll monitoring
-        epoll_ctl(epollFD, EPOLL_CTL_DEL, wkgPtr->conn->socketId, NULL);
-
-        //delete the socket itself
-        delete wkgPtr->conn;
-
-        //free mem allocated to the node
-        free(wkgPtr);
-
-        //iterate to next node
-        wkgPtr = wkgPtr2;
-    }
-    //return empty list
-    return headPtr;
-}
-
-//free single node with given id, maintain linked list integrity
+//free the client with given id, its socket is closed along with it
 bool freeClientNode(const int searchId)
 {
-    ClientNode *wkgPtr = headPtr;
-    
-    if (headPtr == NULL)
+    if (connections.find(searchId) == NULL)
     {
         return false;
     }
-    //we found the socket at the head of the linked list
-    else if (headPtr->conn->socketId == searchId)
-    {
-        headPtr = headPtr->nextPtr;
 
-        //remove the fd from the epoll monitoring
-        epoll_ctl(epollFD, EPOLL_CTL_DEL, wkgPtr->conn->socketId, NULL);
+    //remove the fd from the epoll monitoring
+    epoll_ctl(epollFD, EPOLL_CTL_DEL, searchId, NULL);
 
-        //delete the socket itself
-        delete wkgPtr->conn;
-
-        //free mem allocated to the node
-        free(wkgPtr);
-        return true;
-    }
-
-    ClientNode *wkgPtr2 = wkgPtr;
-    wkgPtr = wkgPtr->nextPtr;
-    
-    //loop through the list
-    while (wkgPtr != NULL)
-    {
-        //we found the socket in the middle of linked list or at the end
-        if (wkgPtr->conn->socketId == searchId)
-        {
-            wkgPtr2->nextPtr = wkgPtr->nextPtr;
-            
-            //remove the fd from the epoll monitoring
-            epoll_ctl(epollFD, EPOLL_CTL_DEL, wkgPtr->conn->socketId, NULL);
-
-            //delete the socket itself
-            delete wkgPtr->conn;
-
-            //free mem allocated to the node
-            free(wkgPtr);
-
-            return true;
-        }
-
-        wkgPtr2 = wkgPtr;
-        wkgPtr = wkgPtr->nextPtr;
-    }
-
-    return false;
+    //delete the socket itself, which closes it
+    return connections.remove(searchId);
 }
 
 //sends a message to all connected clients on behalf of the sending client
-void forwardMessage(const ClientNode *sender, const string message, const bool systemMessage)
+void forwardMessage(const Socket *sender, const string message, const bool systemMessage)
 {
-    ClientNode *wkgPtr = headPtr;
-
-    if (headPtr == NULL)
+    if (connections.size() == 0)
     {
         debug("forwardMessage() called with no active connections, returning");
     }
 
-    int i = 0;
+    string_view senderName = (sender != NULL) ? connections.getName(sender->socketId) : "";
     
     //loop through all members
-    while (wkgPtr != NULL)
+    connections.forEach([&](Socket &conn)
     {
-        //debug("entered the forwarding loop");
-
-        if (wkgPtr != sender)
+        if (&conn != sender)
         {
             if (systemMessage)
             {
-                //send msg to current user
-                wkgPtr->conn->sendString("------- " +message+" -------");
-                debug("message forwarded to " + wkgPtr->username + " from system");
+                //send msg to current user, the pieces go out in one writev without building a new string
+                conn.sendv({"------- ", message, " -------"});
+                debug("message forwarded to " + string(connections.getName(conn.socketId)) + " from system");
             }
             else
             {
                 //send message from sender to current user
-                wkgPtr->conn->sendString(sender->username + " : " + message);
-                debug("message forwarded to " + wkgPtr->username + " from " + sender->username);
+                conn.sendv({senderName, " : ", message});
+                debug("message forwarded to " + string(connections.getName(conn.socketId)) + " from " + string(senderName));
             }
         }
+    });
 
-        wkgPtr = wkgPtr->nextPtr;
-        i++;
-    }
-
-    debug(to_string(i) + " active connections.");
-}
-
-//allocate new client node to ll
-void addClientNode(const string username, Server *conn )
-{
-    ClientNode *newNode = new ClientNode;
-
-    newNode->username = username;
-    newNode->conn = conn;
-    newNode->nextPtr = NULL;
-
-    if (headPtr == NULL)
-    {
-        headPtr = newNode;
-        lastPtr = newNode;
-    }
-    else
-    {
-        lastPtr->nextPtr = newNode;
-        lastPtr = newNode;
-    }
+    debug(to_string(connections.size()) + " active connections.");
 }
 
 int main(int argc, char** argv) 
@@ -198,8 +84,7 @@ int main(int argc, char** argv)
     int clientSocket;
     string tmpStr;
     string receivedString;
-    Server *tmpConn;
-    ClientNode *wkgPtr;
+    Socket *tmpConn;
 
     // Set signal handler for SIGPIPE
     signal(SIGPIPE, SIG_IGN);
@@ -209,9 +94,10 @@ int main(int argc, char** argv)
 
     cout << "Now listening for client connections on port: " << PORT << endl << endl;
 
-    //set our server socket to be the fd we monitor for incoming events
+    //set our server socket to be the fd we monitor for incoming events, clients carry their
+    //socket in data.ptr so the server socket is the one without one
     struct epoll_event listenEvent;
-    listenEvent.data.fd = server.socketId; // Set the file descriptor to monitor
+    listenEvent.data.ptr = NULL;
     listenEvent.events = EPOLLIN; // Specify the event(s) to monitor for
 
     // Add the server socket to the epoll instance
@@ -230,7 +116,7 @@ int main(int argc, char** argv)
         for (int i=0; i<numEvents; i++)
         {
             //check for new connection requests
-            if (events[i].data.fd == server.socketId)
+            if (events[i].data.ptr == NULL)
             {
                 //accept client and check if fail
                 if (!server.acceptConnection(&clientSocket))
@@ -242,16 +128,18 @@ int main(int argc, char** argv)
                 {
                     cout << "New client\n";
 
-                    // Create an epoll event structure for the accepted client socket
-                    struct epoll_event event;
-                    event.data.fd = clientSocket; // Associate the client socket with the event
-                    event.events = EPOLLIN; // | EPOLLOUTMonitor both read and write events
-
-                    // Add the client socket to the epoll instance to begin monitoring
-                    epoll_ctl(epollFD, EPOLL_CTL_ADD, clientSocket, &event);
-
-                    //create tmp conn to get username
-                    tmpConn = new Server(clientSocket, false);
+                    //create conn to get username, it comes out of the connection table's pool. The key
+                    //exchange runs in there and throws if the client hangs up, the fd is still ours then
+                    try
+                    {
+                        tmpConn = connections.add(clientSocket);
+                    }
+                    catch (const std::exception &e)
+                    {
+                        cout << "Key exchange with new client failed\n";
+                        close(clientSocket);
+                        continue;
+                    }
                     
                     //get username form client
                     if (!tmpConn->getString(receivedString))
@@ -259,7 +147,7 @@ int main(int argc, char** argv)
                         cout << "Client failed to send username\n";
                         
                         //client failed to send username, close conn
-                        delete tmpConn;
+                        connections.remove(clientSocket);
                     }
                     //otherwise client sent username, check if it is already connected
                     else if (checkForUsername(receivedString))
@@ -268,7 +156,7 @@ int main(int argc, char** argv)
                         
                         //client is already connected, reject second conn
                         tmpConn->sendString("The username " + receivedString + " is already connected. Closing connection..");
-                        delete tmpConn;
+                        connections.remove(clientSocket);
                     }
                     //otherwise this is unique user
                     else
@@ -283,66 +171,69 @@ int main(int argc, char** argv)
                         //enable non-blocking mode on socket
                         //fcntl(clientSocket, F_SETFL, O_NONBLOCK);
                         
-                       //add new connection to list
-                       addClientNode(receivedString, tmpConn);
+                        //remember the username so it can be checked without a search
+                        connections.setName(clientSocket, receivedString);
+
+                        // Monitor the client with its socket attached, its events then lead straight
+                        // to it instead of searching for it by fd
+                        struct epoll_event event;
+                        event.data.ptr = tmpConn;
+                        event.events = EPOLLIN;
+                        epoll_ctl(epollFD, EPOLL_CTL_ADD, clientSocket, &event);
 
                         //notify members of new arrival
-                        tmpStr =  lastPtr->username + " joined the chat!";
-                        forwardMessage(lastPtr, tmpStr, true);
+                        tmpStr = receivedString + " joined the chat!";
+                        forwardMessage(tmpConn, tmpStr, true);
                     }
                 }
             }
             //otherwise handle event from existing client
             else
             {
-                //get client socket corresponding to current event
-                clientSocket = events[i].data.fd;
-
-                //get node associated with clientSocket
-                wkgPtr=getClientNodeById(clientSocket);
+                //get socket corresponding to current event
+                tmpConn = (Socket*)events[i].data.ptr;
+                clientSocket = tmpConn->socketId;
 
-                //handle empty case
-                if (wkgPtr == NULL)
+                //one read can take in several messages and epoll does not report the rest again,
+                //so every buffered message is handled before waiting
+                do
                 {
-                    debug("Error: event triggered by nonexistent client!");
-
-                    //remove the client socket from epoll monitoring
-                    epoll_ctl(epollFD, EPOLL_CTL_DEL, clientSocket, NULL);
-                }
-                //get data from client, check for error, check for manual disconnect from client
-                else if (!wkgPtr->conn->getString(receivedString) || receivedString == "LEAVE" || receivedString == "SHUTDOWN")
-                {                    
-                    //remove the client socket from epoll monitoring
-                    epoll_ctl(epollFD, EPOLL_CTL_DEL, clientSocket, NULL);
-                    
-                    //close client socket
-                    close(clientSocket);
+                    //get data from client, check for error, check for manual disconnect from client
+                    if (!tmpConn->getString(receivedString) || receivedString == "LEAVE" || receivedString == "SHUTDOWN")
+                    {                    
+                        //get name of participant that left
+                        tmpStr = connections.getName(clientSocket);
+                        
+                        //stop monitoring and close the client socket
+                        freeClientNode(clientSocket);
 
-                    //get name of participant that left
-                    tmpStr = wkgPtr->username;
-                    
-                    //delete client node
-                    freeClientNode(clientSocket);
+                        //alert other members
+                        forwardMessage(NULL, tmpStr + " left the chat.", true);
 
-                    //alert other members
-                    forwardMessage(NULL, tmpStr + " left the chat.", true);
+                        //print disconnect message
+                        cout << "Client socket " + std::to_string(clientSocket) + " disconnected.\n\n";
+                        break;
+                    }
+                    //otherwise data successfully taken, check for shutdown server command
+                    else if (receivedString == "SHUTDOWN ALL")
+                    {
+                        forwardMessage(NULL, "SERVER IS BEING CLOSED", true);
+                        serverRunning = false;
+                        freeClientNodes();
+                        break;
+                    }
+                    //otherwise this is a simple message to all members
+                    else
+                    {
+                        forwardMessage(tmpConn, receivedString, false);
+                    }
+                } while (tmpConn->hasBufferedMessage());
 
-                    //print disconnect message
-                    cout << "Client socket " + std::to_string(clientSocket) + " disconnected.\n\n";
-                }
-                //otherwise data successfully taken, check for shutdown server command
-                else if (receivedString == "SHUTDOWN ALL")
+                //every client was let go, stop handling this round of events
+                if (!serverRunning)
                 {
-                    forwardMessage(NULL, "SERVER IS BEING CLOSED", true);
-                    serverRunning = false;
-                    freeClientNodes();
                     break;
                 }
-                //otherwise this is a simple message to all members
-                else
-                {
-                    forwardMessage(wkgPtr, receivedString, false);
-                }
             }
         }
     }
@@ -35,20 +35,12 @@ using namespace std;
  * Structures
  ************************************************************************/
 
-struct ClientNode {
-    Server *conn;
-    string username;
-    ClientNode *nextPtr;
-};
-
 /************************************************************************
  * Function prototype declarations
  ************************************************************************/ 
-ClientNode *freeClientNodes();
+void freeClientNodes();
 bool checkForUsername(const string usr);
-ClientNode *getClientNodeById(const int searchId);
 bool freeClientNode(const int searchId);
-void forwardMessage(const ClientNode *sender, const string message, const bool systemMessage);
-void addClientNode(const string username, Server *conn );
+void forwardMessage(const Socket *sender, const string message, const bool systemMessage);
 
 #endif /* CHAT_SERVER_H */
@@ -2,9 +2,11 @@
 
 //declare variables in global scope
 bool serverRunning = true;
-ClientNode *headPtr = NULL;
-ClientNode *lastPtr = NULL;
+ConnectionTable *connections = NULL;
 EventManager *eventManager = NULL;
+TaskExecutor *executor = NULL;
+vector<ReplyOrder> replyOrders; //indexed by fd
+int numClients = 0;
 
 //prints string when debug macro is enabled
 void debug(string str)
@@ -14,134 +16,14 @@ void debug(string str)
     #endif
 }
 
-//returns the node associated with given id, otherwise returns null
-ClientNode *getClientNodeById(const int searchId)
-{
-    ClientNode *wkgPtr = headPtr;
-
-    while (wkgPtr != NULL)
-    {
-        if (wkgPtr->conn->socketId == searchId)
-        {
-            return wkgPtr;
-        }
-        wkgPtr = wkgPtr->nextPtr;
-    }
-    return NULL;
-}
-
-//frees sockets and other resources in client linked list
-ClientNode *freeClientNodes()
-{
-    //connMutex.lock();
-    ClientNode *wkgPtr = headPtr;
-    ClientNode *wkgPtr2;
-    
-    //loop through the list
-    while (wkgPtr != NULL)
-    {
-        //save location of next node
-        wkgPtr2 = wkgPtr->nextPtr;
-
-        if (eventManager != NULL)
-        {
-            eventManager->stopMonitoring(wkgPtr->conn->socketId);
-        }
-
-        //delete the socket itself
-        delete wkgPtr->conn;
-
-        //free mem allocated to the node
-        free(wkgPtr);
-
-        //iterate to next node
-        wkgPtr = wkgPtr2;
-    }
-    //return empty list
-    return headPtr;
-}
-
-//free single node with given id, maintain linked list integrity
-bool freeClientNode( const int searchId)
-{
-    ClientNode *wkgPtr = headPtr;
-    
-    if (headPtr == NULL)
-    {
-        return false;
-    }
-    //we found the socket at the head of the linked list
-    else if (headPtr->conn->socketId == searchId)
-    {
-        headPtr = headPtr->nextPtr;
-
-        eventManager->stopMonitoring(wkgPtr->conn->socketId);
-
-        //delete the socket itself
-        delete wkgPtr->conn;
-
-        //free mem allocated to the node
-        free(wkgPtr);
-        return true;
-    }
-
-    ClientNode *wkgPtr2 = wkgPtr;
-    wkgPtr = wkgPtr->nextPtr;
-    
-    //loop through the list
-    while (wkgPtr != NULL)
-    {
-        //we found the socket in the middle of linked list or at the end
-        if (wkgPtr->conn->socketId == searchId)
-        {
-            wkgPtr2->nextPtr = wkgPtr->nextPtr;
-            
-            eventManager->stopMonitoring(wkgPtr->conn->socketId);
-
-            //delete the socket itself
-            delete wkgPtr->conn;
-
-            //free mem allocated to the node
-            free(wkgPtr);
-
-            return true;
-        }
-
-        wkgPtr2 = wkgPtr;
-        wkgPtr = wkgPtr->nextPtr;
-    }
-
-    return false;
-}
-
-//allocate new client node to ll
-void addClientNode( Socket *conn )
-{
-    ClientNode *newNode = new ClientNode;
-
-    newNode->conn = conn;
-    newNode->nextPtr = NULL;
-
-    if (headPtr == NULL)
-    {
-        headPtr = newNode;
-        lastPtr = newNode;
-    }
-    else
-    {
-        lastPtr->nextPtr = newNode;
-        lastPtr = newNode;
-    }
-}
-
+//stops monitoring the client and closes its socket
 void forget(int clientSocket)
 {
-    if (eventManager != NULL)
-    {
-        eventManager->stopMonitoring(clientSocket); 
-    }         
-    close(clientSocket);
-    freeClientNode(clientSocket);
+    eventManager->stopMonitoring(clientSocket);
+
+    //the Socket destructor closes the fd
+    connections->remove(clientSocket);
+    numClients--;
     debug("Client socket " + std::to_string(clientSocket) + " disconnected.\n");
 }
 
@@ -183,110 +65,198 @@ int getOperationResult(int userInput)
     return i;
 }
 
+//computes the result on a worker thread and sends it from the event loop, the connection may
+//be gone by the time the result is ready. Replies keep the order of the requests (see ReplyOrder)
+void submitOperation(Socket *conn, int userInput)
+{
+    int clientSocket = conn->socketId;
+    uint64_t id = connections->getId(clientSocket);
+    uint64_t sequence = replyOrders[clientSocket].nextRequest++;
+
+    executor->submit([clientSocket, id, sequence, userInput]()
+    {
+        int result = getOperationResult(userInput);
+
+        eventManager->post([clientSocket, id, sequence, result]()
+        {
+            //the id tells the connection apart from a newer one with the same fd and pooled socket
+            Socket *conn = connections->find(clientSocket, id);
+
+            if (conn == NULL)
+            {
+                return;
+            }
+
+            //wait for the results of earlier requests, then send everything that is next in line
+            ReplyOrder &order = replyOrders[clientSocket];
+            order.finished[sequence] = result;
+            if (!sendFinishedReplies(conn, order))
+            {
+                forget(clientSocket);
+            }
+        });
+    });
+}
+
+//sends the finished results that no earlier request is still waiting for, false if the connection failed
+bool sendFinishedReplies(Socket *conn, ReplyOrder &order)
+{
+    while (!order.finished.empty() && order.finished.begin()->first == order.nextReply)
+    {
+        int result = order.finished.begin()->second;
+        order.finished.erase(order.finished.begin());
+        order.nextReply++;
+
+        //return result to client, check for fail
+        if (!conn->sendString(to_string(result)))
+        {
+            return false;
+        }
+
+        debug("result sent to client " + to_string(conn->socketId) + ": " + to_string(result));
+    }
+    return true;
+}
+
+//called by the event manager when conn has data, reads everything the client sent so far and
+//handles each complete message
+void handleClient(Socket *conn)
+{
+    string receivedString;
+    bool connected = conn->receiveAvailable();
+
+    while (conn->hasBufferedMessage())
+    {
+        //get data from client, check for error
+        if (!conn->getString(receivedString))
+        {
+            connected = false;
+            break;
+        }
+
+        //calculate 3A+1 result off the event loop, the reply is sent once it is done
+        submitOperation(conn, atoi(receivedString.c_str()));
+    }
+
+    //client left or the connection failed, free everything associated with it
+    if (!connected)
+    {
+        forget(conn->socketId);
+    }
+    //edge triggered, data left over by the read budget is only reported again on request
+    else if (conn->moreToReceive())
+    {
+        eventManager->requeue(conn->socketId);
+    }
+}
+
+//the client's handshake is done, welcomes it and starts handling its messages
+void admitClient(Socket *conn)
+{
+    int clientSocket = conn->socketId;
+
+    //send welcome msg check for fail
+    if (!conn->sendString(WELCOME_MSG))
+    {
+        debug("Client connection failed to be established.");
+        
+        //client failed to send username, close conn
+        connections->remove(clientSocket);
+        return;
+    }
+
+    //a fresh reply order, whatever is left belongs to an earlier client with this fd
+    if (replyOrders.size() <= (size_t)clientSocket)
+    {
+        replyOrders.resize(clientSocket + 1);
+    }
+    replyOrders[clientSocket] = ReplyOrder();
+
+    //client officially connected, setup event listener for incoming messages from client, they
+    //are handed to handleClient() with the connection so there is nothing to look up
+    eventManager->monitorClient(clientSocket, [conn](int, uint32_t)
+    {
+        handleClient(conn);
+    });
+
+    //collect the replies of each loop iteration and send them in one go
+    eventManager->autoFlush(conn);
+
+    numClients++;
+
+    debug("Number of connections: " + to_string(numClients));
+}
+
 int main(int argc, char** argv) 
 {
     //init vars
-    int clientSocket, result;
-    string receivedString;
+    int clientSocket;
     Socket *tmpConn;
-    ClientNode *wkgPtr;
-    int numClients=0;
+    vector<Server::AcceptedClient> accepted;
 
-    snitch();
-    
     //startup our server
     Server server(PORT, NUM_CONNECTIONS, true, true);
 
     //start event manager for server 
     eventManager = new EventManager(server.socketId, NUM_CONNECTIONS);
+    eventManager->snitch();
+
+    //only wake up for new data where the backend supports it, each wakeup reads everything that arrived
+    eventManager->setEdgeTriggered(true);
+
+    //sockets for accepted clients come out of a pool and are found by fd without a search
+    connections = new ConnectionTable(NUM_CONNECTIONS);
+
+    //results computed by the worker threads are posted back to the event loop
+    executor = new TaskExecutor();
 
     debug("Now listening for client connections on port: " + to_string(PORT) + "\n");
     
     //run server execution loop
     while (serverRunning)
     {
-        //wait for event
+        //wait for a connection request
         clientSocket = eventManager->waitForEvent();
 
         //check for new connection requests
         if (clientSocket == CONN_ATTEMPT)
         {
-            //accept client and check if fail
-            if (!server.acceptConnection(&clientSocket))
+            //accept every client that is waiting, not just one per wakeup. The queue is drained
+            //completely, so a wakeup that finds it empty is normal and only real failures are reported
+            accepted.clear();
+            if (server.acceptPending(accepted) == 0 && errno != EAGAIN && errno != EWOULDBLOCK)
             {
                 debug("Error accepting client");
             }
-            //success accepting client
-            else
+
+            //set up each accepted client
+            for (const Server::AcceptedClient &client : accepted)
             {
+                clientSocket = client.socket;
                 debug("New client on socket: " + to_string(clientSocket));
 
-                tmpConn = new Socket(clientSocket, false);
-                
-                //send welcome msg check for fail
-                if (!tmpConn->sendString(WELCOME_MSG))
-                {
-                    debug("Client connection failed to be established.");
-                    
-                    //client failed to send username, close conn
-                    delete tmpConn;
-                }
-                //otherwise client officially connected
-                else
-                {
-                    //setup event listener for incoming messages from client
-                    eventManager->monitorClient(clientSocket);
-                    
-                    //add new connection to list
-                    addClientNode(tmpConn);
-
-                    numClients++;
-
-                    debug("Number of connections: " + to_string(numClients));
-                }
-            }
-        }
-        //otherwise handle event from existing client
-        else
-        {
-            //get node associated with clientSocket
-            wkgPtr=getClientNodeById(clientSocket);
-
-            //handle empty case
-            if (wkgPtr == NULL)
-            {
-                debug("Error: event triggered by nonexistent client!");
-                forget(clientSocket);
-                numClients--;
-            }
-            //get data from client, check for error
-            else if (!wkgPtr->conn->getString(receivedString))
-            {                    
-                //free everything associated with client
-                forget(clientSocket);
-                numClients--;
-            }
-            //otherwise input successfully taken from client
-            else
-            {               
-                //calculate 3A+1 result
-                result = getOperationResult(atoi(receivedString.c_str()));
-
-                //return result to client, check for fail
-                if(!wkgPtr->conn->sendString(to_string(result)))
-                {
-                    forget(clientSocket);
-                    numClients--;
-                }
-                else
+                //the key exchange is driven by the event manager, a slow client holds up nobody else
+                //and its Kyber computation runs on the worker threads
+                tmpConn = connections->add(clientSocket, false, true);
+                eventManager->handshake(tmpConn, [tmpConn, clientSocket](bool ok)
                 {
-                    debug("result sent to client " + to_string(clientSocket) + ": " + to_string(result));
-                }
+                    if (!ok)
+                    {
+                        debug("Client failed the handshake.");
+                        connections->remove(clientSocket);
+                        return;
+                    }
+                    admitClient(tmpConn);
+                }, executor);
             }
         }
+        //events from existing clients never get here, handleClient() already ran for them
     }
 
-    freeClientNodes();
+    //finish the queued computations before the sockets they refer to go away
+    delete executor;
+    delete connections;
+    delete eventManager;
 
     return 0;
 }
\ No newline at end of file
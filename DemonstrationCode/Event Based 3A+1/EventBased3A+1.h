@@ -10,6 +10,7 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <string>
+#include <map>
 
 using namespace std;
 
@@ -37,20 +38,22 @@ using namespace std;
  * Structures
  ************************************************************************/
 
-struct ClientNode {
-    Socket *conn;
-    string username;
-    ClientNode *nextPtr;
+//the workers may finish a client's requests in any order, its replies still go out in the order
+//the requests came in. Kept per fd and reset when a new client gets the fd
+struct ReplyOrder {
+    uint64_t nextRequest = 0;       //sequence number of the client's next request
+    uint64_t nextReply = 0;         //sequence number of the next reply to send
+    map<uint64_t, int> finished;    //results that finished ahead of an earlier request
 };
 
 /************************************************************************
  * Function prototype declarations
  ************************************************************************/ 
-ClientNode *freeClientNodes();
-ClientNode *getClientNodeById(const int searchId);
-bool freeClientNode(const int searchId);
-void addClientNode(Socket *conn );
 int getOperationResult(int userInput);
 void forget(int clientSocket);
+void submitOperation(Socket *conn, int userInput);
+bool sendFinishedReplies(Socket *conn, ReplyOrder &order);
+void handleClient(Socket *conn);
+void admitClient(Socket *conn);
 
 #endif /* CHAT_SERVER_H */
@@ -49,21 +49,28 @@
 //true = debugging information will be printed to terminal
 #define VERBOSE false
 
+//true = sendString()/getString() travel inside length-prefixed frames (see Frame format below)
+//false = legacy '\0' terminated strings, only needed to talk to peers built before the frame format
+#define FRAMED_PROTOCOL true
+
 //toggle compilation of event based support classes (only available on linux)
 #define EVENT_BASED true
-//select event based architecture (0 for epoll, 1 for poll, 2 for select)
+//default event based architecture (0 for epoll, 1 for poll, 2 for select, 3 for io_uring).
+//Every backend is compiled in, EventManager can also be given one at runtime (see EventBackend)
 #define EVENT_BASED_ARCHITECTURE 2
 
 #if EVENT_BASED_ARCHITECTURE == 0
     #define archType "EPOLL IS IN USE"
 #elif EVENT_BASED_ARCHITECTURE ==1
     #define archType "POLL IS IN USE"
+#elif EVENT_BASED_ARCHITECTURE == 3
+    #define archType "IO_URING IS IN USE"
 #else
     #define archType "SELECT IS IN USE"
 #endif
 #if EVENT_BASED
 #include <iostream>
-void snitch()
+inline void snitch()
 {
     std::cout << std::endl<< archType << std::endl;
 }
@@ -74,6 +81,20 @@ void snitch()
 
 #include <iostream>
 #include <string>
+#include <vector>
+#include <span>
+#include <string_view>
+#include <cstdint>
+#include <climits>
+#include <algorithm>
+#include <memory>
+#include <deque>
+#include <functional>
+#include <optional>
+#include <coroutine>
+#include <utility>
+#include <bit>
+#include <chrono>
 
 // read/write/close
 #include <sys/types.h>
@@ -81,25 +102,45 @@ void snitch()
 
 #if CRYPTOGRAPHY
 #include "kyber/kyber1024_kem.hpp"
-#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <ctime>
 #include <openssl/aes.h>
 #include <openssl/evp.h>   // For EVP functions (EVP_CIPHER_CTX_new, EVP_EncryptInit_ex, EVP_DecryptInit_ex, etc.)
 #include <openssl/rand.h>  // For RAND_bytes function used for generating random bytes
 #include <openssl/err.h>
+#if defined(__linux__)
+#include <sys/mman.h>      //TicketKeys can keep its keys in a memory mapped file
+#endif
 #endif
 
 #if EVENT_BASED && defined(__linux__)
-#if EVENT_BASED_ARCHITECTURE == 0
 #include <sys/epoll.h>
-#include <fcntl.h>
-#elif EVENT_BASED_ARCHITECTURE == 1
 #include <poll.h>
-#include <vector>
-#else
-#include <vector>
 #include <sys/select.h>
+#include <sys/eventfd.h>
+#include <linux/filter.h>
+#include <sched.h>
+#include <variant>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+//the io_uring backend needs the kernel headers of linux 6.0 or later (multishot recv)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_RECV_MULTISHOT
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define HAS_IO_URING true
+#endif
 #endif
 #endif
+#ifndef HAS_IO_URING
+#define HAS_IO_URING false
+#endif
 
 #ifdef _WIN32
     #include <Winsock2.h>
@@ -113,6 +154,10 @@ void snitch()
     #include <netdb.h>//getaddrinfo()
     #include <sys/uio.h>
     #include <unistd.h>
+    #include <poll.h>
+    #include <fcntl.h>
+    #include <linux/errqueue.h> //MSG_ZEROCOPY completion notifications
+    #include <netinet/tcp.h>    //TCP_INFO, accept queue length of a listener
 #endif
 
 using namespace std;
@@ -125,16 +170,204 @@ using namespace std;
 #define SOCKET_ERROR -1
 #endif
 
+//frame format constants (see Frame format section below)
+constexpr uint8_t FRAME_VERSION = 1;
+constexpr size_t FRAME_HEADER_LEN = 8;
+constexpr uint32_t MAX_FRAME_LEN = 16 * 1024 * 1024; //frames claiming to be larger are treated as a broken stream
+
+//default size of the per-connection receive buffer (see Socket::setReceiveBufferSize())
+constexpr size_t DEFAULT_RECV_BUFFER_LEN = 16 * 1024;
+
+//Socket::receiveAvailable() reads about this much per call at most, so a peer that sends faster
+//than the loop drains it cannot keep the loop to itself or make it buffer far ahead
+constexpr size_t RECEIVE_BUDGET_LEN = 256 * 1024;
+
+//the receive buffer of a non-blocking read never grows past this. A peer whose next message
+//(a frame, or a string without FRAMED_PROTOCOL) does not fit in it is treated as a broken stream
+constexpr size_t MAX_RECV_BUFFER_LEN = FRAME_HEADER_LEN + MAX_FRAME_LEN;
+
+//corked sockets flush early once this many bytes are waiting (see Socket::setCorkFlushThreshold())
+constexpr size_t DEFAULT_CORK_FLUSH_LEN = 64 * 1024;
+
+//sockets flushed by an event loop refuse new messages while more than this is still waiting for
+//a peer that does not read (see Socket::setSendHighWater())
+constexpr size_t DEFAULT_SEND_HIGH_WATER_LEN = 4 * 1024 * 1024;
+
+//payloads at least this large are sent with MSG_ZEROCOPY once enabled (see Socket::enableZeroCopy()).
+//Below a few hundred KB the page pinning and notification costs outweigh the saved copy
+constexpr size_t DEFAULT_ZEROCOPY_THRESHOLD = 256 * 1024;
+
+//listen backlog of a Server unless given (see Server::setBacklog()). The kernel caps it at
+//net.core.somaxconn, which is 4096 on current kernels
+constexpr int DEFAULT_LISTEN_BACKLOG = 4096;
+
+//slots a ConnectionTable allocates up front (see ConnectionTable)
+constexpr size_t DEFAULT_CONNECTION_POOL = 64;
+
+//how long a closing socket waits for the kernel to release outstanding zero copy buffers
+constexpr int ZEROCOPY_CLOSE_WAIT_MS = 1000;
+
+enum FrameType : uint8_t {
+    FRAME_STRING = 1,   //payload is a string sent with sendString()
+    FRAME_BINARY = 2    //payload is arbitrary bytes sent with sendBytes()
+};
+
+enum FrameFlags : uint16_t {
+    FRAME_ENCRYPTED = 0x0001    //payload is AES256 ciphertext and must be decrypted by the receiver
+};
+
+//progress of a connection's handshake (see Socket::continueHandshake())
+enum HandshakeStatus {
+    HANDSHAKE_DONE,         //the connection is ready, right away without CRYPTOGRAPHY
+    HANDSHAKE_WANT_READ,    //waiting for the peer, call again once the socket is readable
+    HANDSHAKE_WANT_WRITE,   //the kernel took only part of our message, call again once writable
+    HANDSHAKE_WANT_COMPUTE, //the Kyber computation of the next step is due (see getHandshakeComputation())
+    HANDSHAKE_FAILED        //the peer closed the connection or the key exchange failed
+};
+
 #if EVENT_BASED 
 const int CONN_ATTEMPT = -100;
-const int MAX_FDS = 100;
+const int DEFAULT_EVENT_BATCH = 100; //most events returned by one wait, can be set per EventManager
+
+//one ready fd returned by EventManager::waitForEvents(). The server socket is reported as
+//CONN_ATTEMPT and events holds the poll()/epoll bits (POLLIN, POLLERR, POLLHUP). An entry whose
+//fd was passed to stopMonitoring() after the wait has events cleared to 0 and should be skipped
+struct ReadyEvent {
+    int fd;
+    uint32_t events;
+};
+
+//backends an EventManager can run on, numbered like EVENT_BASED_ARCHITECTURE
+enum EventBackend {
+    BACKEND_EPOLL = 0,
+    BACKEND_POLL = 1,
+    BACKEND_SELECT = 2,
+    BACKEND_IO_URING = 3
+};
+#endif
+
+#if EVENT_BASED
+const size_t EXECUTOR_GROW_DEPTH = 4;      //queued tasks per worker before the executor adds a worker
+const int EXECUTOR_IDLE_MS = 2000;         //workers above the minimum exit after idling this long
+#endif
+
+#if EVENT_BASED && HAS_IO_URING
+const unsigned URING_ENTRIES = 256;          //submission queue size (the completion queue is twice as big)
+const unsigned URING_RECV_BUFFERS = 512;     //buffers provided to multishot recv, must be a power of 2
+const unsigned URING_RECV_BUFFER_LEN = 4096; //size of each provided buffer
 #endif
 
 #if CRYPTOGRAPHY
 constexpr size_t SEED_LEN = 32;
 constexpr size_t KEY_LEN = 32;
+
+//a KeypairPool is refilled once fewer keypairs than the low watermark are left, up to the high one
+constexpr size_t DEFAULT_KEYPAIR_POOL_LOW = 16;
+constexpr size_t DEFAULT_KEYPAIR_POOL_HIGH = 64;
+
+//session resumption (see TicketKeys and SessionCache). A ticket is keyId(4) || nonce(12) ||
+//AES-256-GCM of the resumption secret and the time it was issued(40) || tag(16)
+constexpr size_t TICKET_LEN = 72;
+constexpr size_t RESUMPTION_SECRET_LEN = 32;
+constexpr size_t RESUMPTION_NONCE_LEN = 32;
+constexpr int DEFAULT_TICKET_ROTATION_SECONDS = 3600;  //a ticket is accepted for two rotations
+constexpr size_t DEFAULT_SESSION_CACHE_LEN = 1024;
+
+//the client's first message is its public key unless it starts with HELLO_MARKER and one of the
+//hello types. The first two bytes of a public key hold a coefficient below 3329 in their low 12
+//bits, 0xFF 0xFD to 0xFF 0xFF would be 3583 to 4095, so an old client can never send them
+constexpr size_t HELLO_LEN = 2;
+constexpr uint8_t HELLO_MARKER = 0xFF;
+constexpr uint8_t HELLO_EARLY_CIPHER = 0xFD;      //a cipher to the server's long-term key follows (see ServerKeypair)
+constexpr uint8_t HELLO_REQUEST_TICKET = 0xFE;    //a public key follows, send a ticket with the cipher
+constexpr uint8_t HELLO_RESUME = 0xFF;            //a ticket and the client's nonce follow
+#endif
+
+/************************************************************************
+ * Frame format
+ *
+ * Every frame starts with a fixed 8 byte header, multi-byte fields are in
+ * network byte order:
+ *   byte 0    : protocol version (FRAME_VERSION)
+ *   byte 1    : frame type (FrameType)
+ *   bytes 2-3 : flags (FrameFlags)
+ *   bytes 4-7 : payload length in bytes
+ * The payload follows directly after the header. Because the receiver knows
+ * the exact payload size up front, binary data (including ciphertext
+ * containing 0x00 bytes) can be sent safely.
+ ************************************************************************/
+
+struct FrameHeader {
+    uint8_t version;
+    uint8_t type;
+    uint16_t flags;
+    uint32_t length;
+};
+
+//writes header into the first FRAME_HEADER_LEN bytes of out
+inline void packFrameHeader(const FrameHeader& header, uint8_t* out)
+{
+    uint16_t flags = htons(header.flags);
+    uint32_t length = htonl(header.length);
+
+    out[0] = header.version;
+    out[1] = header.type;
+    memcpy(out + 2, &flags, sizeof(flags));
+    memcpy(out + 4, &length, sizeof(length));
+}
+
+//reads a header from the first FRAME_HEADER_LEN bytes of in, returns false if the header is not valid
+inline bool unpackFrameHeader(const uint8_t* in, FrameHeader& header)
+{
+    uint16_t flags;
+    uint32_t length;
+
+    memcpy(&flags, in + 2, sizeof(flags));
+    memcpy(&length, in + 4, sizeof(length));
+
+    header.version = in[0];
+    header.type = in[1];
+    header.flags = ntohs(flags);
+    header.length = ntohl(length);
+
+    //reject frames from other protocol versions or with impossible lengths
+    return header.version == FRAME_VERSION && header.length <= MAX_FRAME_LEN;
+}
+
+/************************************************************************
+ * Flush queue declaration
+ ************************************************************************/
+
+class Socket;
+#if CRYPTOGRAPHY
+class KeypairPool;
+class TicketKeys;
+class SessionCache;
+class ServerKeypair;
 #endif
 
+//list of corked sockets holding unsent data. An EventManager owns one and flushes every socket
+//on it once per loop iteration, so replies produced while handling a batch of events leave in
+//one syscall per connection. Shared with the sockets so either side may be destroyed first.
+//Flushing never blocks the loop: a socket whose peer reads slower than it is written to keeps
+//the rest queued and is watched for POLLOUT through watchWritable until it drained
+class FlushQueue {
+public:
+    void schedule(Socket *socket);
+    void cancel(Socket *socket);
+    void relocate(Socket *from, Socket *to);
+
+    //with wait the sockets are flushed completely, blocking if need be (for shutting down)
+    void flushAll(bool wait = false);
+
+    //called with true once a socket's output is stuck behind a full kernel buffer and with false
+    //once it drained, set by the EventManager that owns the queue
+    std::function<void(int clientSocket, bool writable)> watchWritable;
+
+private:
+    std::vector<Socket*> pending;
+};
+
 /************************************************************************
  * Socket class declaration
  ************************************************************************/
@@ -144,8 +377,11 @@ constexpr size_t KEY_LEN = 32;
 //accepting client connections and passing them to threads... other than that its self explanitory (call server for server, client for client)
 class Socket {
 public:
-    //Use this socket constructor when you want to interact with an established socket using class functionality
-    Socket( const int socket, const bool autoPrint)
+    //Use this socket constructor when you want to interact with an established socket using class functionality.
+    //The key exchange (CRYPTOGRAPHY) runs to completion in here and throws if it fails, the fd is
+    //then still the caller's. With deferHandshake the constructor returns right away and the
+    //handshake is driven by continueHandshake() instead (see EventManager::handshake())
+    Socket( const int socket, const bool autoPrint, [[maybe_unused]] const bool deferHandshake = false)
     {
         socketId = socket;
         autoPrintResponses = autoPrint;
@@ -158,28 +394,31 @@ public:
         #if CRYPTOGRAPHY
         initiator = true;
         applyCryptography = true;
-        
+
         //collaborate with connected party to get shared encryption key
-        setupEncryption();
+        beginHandshake();
+        if (!deferHandshake && !setupEncryption())
+        {
+            socketId = -1;
+            throw runtime_error("Key exchange with client failed");
+        }
         #endif
     }
 
     //this destructor is inherited for server and client subclasses
     ~Socket() 
     {
-        #if CRYPTOGRAPHY
-        freeEncryptionContext();
-        #endif
-
-        //free socket
-        #ifdef _WIN32
-        closesocket(socketId);
-        WSACleanup();
-        #else
-        close(socketId);
-        #endif
+        release();
     }
 
+    //sockets are move-only. The fd, buffers and encryption state move to the new object and the
+    //old one is left closed (socketId -1), so the fd is closed exactly once and connections can
+    //be kept by value in vectors and tables. Pointers to the old object do not follow the move
+    Socket(Socket &&other) noexcept;
+    Socket& operator=(Socket &&other) noexcept;
+    Socket(const Socket&) = delete;
+    Socket& operator=(const Socket&) = delete;
+
 protected:
     //Socket sub-classes will inherit this constructor, then run their own specialized constructors
     Socket()
@@ -196,8 +435,8 @@ protected:
     #if CRYPTOGRAPHY
     // Define the encryption context structure
     struct CryptographyContext {
-        EVP_CIPHER_CTX *encrypt_ctx;
-        EVP_CIPHER_CTX *decrypt_ctx;
+        EVP_CIPHER_CTX *encrypt_ctx = nullptr;
+        EVP_CIPHER_CTX *decrypt_ctx = nullptr;
         std::vector<uint8_t> sharedKey;
         unsigned char iv[AES_BLOCK_SIZE];
     };
@@ -207,26 +446,237 @@ protected:
 
     // Define the encryption context structure
     CryptographyContext encryptionContext;
+
+    //a key exchange that has not finished yet. Every message of it has a fixed size, so each
+    //step knows exactly how many bytes it waits for and never reads into what follows the handshake.
+    //Shared with a worker thread while that runs the step's Kyber computation
+    struct Handshake {
+        enum Step {
+            SEND_PUBLIC_KEY,        //client: our public key, after a hello if we want a ticket
+            RECEIVE_CIPHER,         //client: the encapsulated key followed by the IV (and the ticket)
+            SEND_TICKET,            //client: the resume hello, the ticket and our nonce
+            RECEIVE_RESUMPTION,     //client: whether the ticket was accepted, the server's nonce and the next ticket
+            RECEIVE_HELLO,          //server: the first two bytes, either a hello or the start of a public key
+            RECEIVE_PUBLIC_KEY,     //server: the client's public key
+            SEND_CIPHER,            //server: the encapsulated key and the IV (and the ticket) in one write
+            RECEIVE_TICKET,         //server: the client's ticket and nonce
+            SEND_RESUMPTION,        //server: the answer to RECEIVE_TICKET in one write
+            RECEIVE_EARLY_CIPHER    //server: a cipher to our long-term key, nothing is sent back
+        };
+        Step step;
+        std::vector<uint8_t> message;       //being sent or received
+        size_t transferred = 0;             //bytes of message sent or received so far
+        std::vector<uint8_t> secretKey;     //client: kept until the cipher arrives
+
+        //session resumption (see TicketKeys and SessionCache)
+        std::shared_ptr<TicketKeys> ticketKeys;     //server: seals and opens tickets, NULL accepts none
+        bool ticketRequested = false;               //the client wants a ticket for its next connection
+        bool resumed = false;                       //server: the ticket was accepted
+        std::vector<uint8_t> resumptionSecret;      //what the ticket carries, from the KEM's KDF
+        std::vector<uint8_t> clientNonce;           //client: kept until the server's nonce arrives
+
+        std::shared_ptr<ServerKeypair> serverKeypair;   //server: decapsulates 0-RTT ciphers, NULL refuses them
+
+        //result of computeHandshakeStep() for the step whose message just completed
+        bool computed = false;
+        bool computeFailed = false;
+        std::vector<uint8_t> reply;         //server: the cipher and the IV
+        std::vector<uint8_t> sharedKey;
+        unsigned char iv[AES_BLOCK_SIZE];
+    };
+    std::shared_ptr<Handshake> handshake;   //NULL once the handshake is done
+    inline static std::shared_ptr<KeypairPool> keypairPool;
+    inline static std::shared_ptr<TicketKeys> ticketKeys;
+    inline static std::shared_ptr<SessionCache> sessionCache;
+    inline static std::shared_ptr<ServerKeypair> serverKeypair;
+    string sessionName;                     //client: the server's "ip:port" in the session cache
+
+    void beginHandshake();
+    void sendPublicKey();
+    void receiveHello();
+    bool sendEarlyCipher(std::span<const uint8_t> serverKey);
+    static void deriveResumedKeys(Handshake &state, std::span<const uint8_t> serverNonce);
+    bool acceptTicket();
+    static void computeHandshakeStep(Handshake &state);
+    bool finishHandshakeStep();
     bool initAES();
-    bool sendKeyData(const uint8_t* data, size_t dataSize);
-    bool getKeyData(uint8_t* data, size_t dataSize);
     bool encrypt(string& str);
     bool decrypt(string& str);
-    void setupEncryption();
+    bool encryptBytes(std::span<const uint8_t> plainText, std::vector<uint8_t>& cipherText);
+    bool encryptPieces(std::span<const std::string_view> pieces, std::vector<uint8_t>& cipherText);
+    bool decryptBytes(std::span<const uint8_t> cipherText, std::vector<uint8_t>& plainText);
+    bool setupEncryption();
     void freeEncryptionContext();
     #if VERBOSE
     void printHex(string str);
     #endif //verbose
     #endif //cryptography
 
+    //per-connection receive buffer. It is filled with large recv calls and drained one message
+    //at a time, so every message that arrived together costs a single syscall
+    std::vector<char> recvBuffer;
+    size_t recvBufferSize = DEFAULT_RECV_BUFFER_LEN;
+    size_t recvStart = 0; //first unread byte in recvBuffer
+    size_t recvEnd = 0;   //one past the last received byte in recvBuffer
+    int fillReceiveBuffer(bool wait = true);
+    bool retryAfterWouldBlock(short events);
+    bool receiveBudgetUsed = false;     //the last receiveAvailable() left data in the kernel
+
+    //per-connection output buffer used while corked (see setCorked())
+    std::vector<char> sendBuffer;
+    size_t sendStart = 0; //first unsent byte in sendBuffer, the sent ones are dropped now and then
+    bool corked = false;
+    size_t corkFlushThreshold = DEFAULT_CORK_FLUSH_LEN;
+    size_t sendHighWater = DEFAULT_SEND_HIGH_WATER_LEN;
+    std::shared_ptr<FlushQueue> flushQueue;
+    bool flushScheduled = false;
+    bool flushBlocked = false;  //the flush queue is waiting for the kernel to take more
+    friend class FlushQueue;
+
+    #if defined(__linux__)
+    //a zero copy payload whose pages the kernel may still be reading from
+    struct ZeroCopySend {
+        uint32_t firstId;                   //notification id of the first sendmsg call carrying the payload
+        uint32_t calls;                     //number of zero copy sendmsg calls carrying the payload
+        uint32_t remaining;                 //calls not yet reported complete
+        std::function<void()> onRelease;    //tells the caller its buffer may be reused
+        std::vector<uint8_t> header;        //frame header, pinned by the kernel just like the payload
+        std::vector<uint8_t> ownedBuffer;   //ciphertext we sent on the caller's behalf
+    };
+    std::deque<ZeroCopySend> zeroCopyPending;
+
+    size_t zeroCopyThreshold = 0;           //0 while zero copy is disabled
+    uint32_t zeroCopyNextId = 0;            //the kernel numbers zero copy sendmsg calls from 0
+    size_t zeroCopyFallbacks = 0;
+    bool sendPiecesZeroCopy(std::span<const std::string_view> pieces, uint32_t *firstId, uint32_t *calls);
+    #endif
+
+    //flushes and closes the socket, takeOver() moves everything from other into this one
+    void release();
+    void takeOver(Socket &other);
+
+    //low level helpers shared by the string and byte interfaces
+    bool sendAll(const char* data, size_t dataSize);
+    bool sendPieces(std::span<const std::string_view> pieces);
+    bool recvAll(char* data, size_t dataSize);
+    bool sendFrame(uint8_t type, std::span<const std::string_view> pieces);
+    bool getFrame(FrameHeader& header, std::vector<uint8_t>& payload);
+
 public:
     int socketId;
     bool autoPrintResponses;
 
+    //a read can take in more than the one message returned. Callers woken by level triggered
+    //readiness must keep calling while hasBufferedMessage() is true, the rest is not reported again
     bool getString(string& str);
     bool sendString(string str);
+
+    //send several buffers (e.g. header, prefix and body) as one message with a single writev
+    //instead of joining them first. The receiver gets their concatenation from one getString()
+    bool sendv(std::span<const std::string_view> pieces);
+    bool sendv(std::initializer_list<std::string_view> pieces);
+
+    //send/receive arbitrary binary data as a single frame (see Frame format above)
+    bool sendBytes(std::span<const uint8_t> data);
+    bool getBytes(std::vector<uint8_t>& data);
+    bool getBytes(std::span<uint8_t> buffer, size_t *bytesReceived);
+
+    //true if a complete message is already waiting in the receive buffer, i.e. the next
+    //getString()/getBytes() call will not touch the kernel. Event loops should keep reading
+    //while this is true because the socket will not be reported readable again for it
+    bool hasBufferedMessage();
+    void setReceiveBufferSize(size_t size);
+
+    //reads everything the kernel holds for this socket into the receive buffer without blocking,
+    //which is what edge triggered loops must do on every wakeup. Afterwards complete messages are
+    //taken out while hasBufferedMessage() is true. Returns false once the peer closed the
+    //connection or it failed, messages that arrived before that are still buffered. A call reads
+    //at most about RECEIVE_BUDGET_LEN bytes, moreToReceive() then says the kernel may hold more
+    bool receiveAvailable();
+
+    //true if the last receiveAvailable() stopped at its budget instead of draining the socket.
+    //Level triggered loops get the socket reported again anyway, edge triggered ones have to
+    //ask for it with EventManager::requeue() or the rest is never read
+    bool moreToReceive();
+
+    //switches the socket between blocking and non-blocking mode. Blocking style calls keep working
+    //on a non-blocking socket, they wait for it inside the call when the kernel is not ready
+    bool setNonBlocking(bool nonBlocking);
+
+    //moves a deferred handshake along as far as it gets without blocking and says what it waits
+    //for next. Call it again once the socket is ready for that, until it is done or failed. A
+    //slow peer only delays its own connection. Messages can be sent and received once it is done.
+    //With offloadComputation the Kyber math of a step is left to the caller: HANDSHAKE_WANT_COMPUTE
+    //is returned instead and getHandshakeComputation() gives the work to run, on any thread. Once it
+    //has run, continueHandshake() goes on with the result. The socket must be left alone meanwhile
+    HandshakeStatus continueHandshake(bool offloadComputation = false);
+    bool handshakePending();
+
+    //the computation HANDSHAKE_WANT_COMPUTE waits for, NULL if there is none. It only touches the
+    //handshake's own state and keeps that alive, so it may still run after the socket is closed
+    std::function<void()> getHandshakeComputation();
+
+    //while corked, outgoing messages collect in a per-connection buffer and go out together in
+    //one syscall on flush(), once corkFlushThreshold bytes are waiting, or when the socket is
+    //uncorked. Send calls then only report failures of the flushes they trigger themselves
+    void setCorked(bool cork);
+    void setCorkFlushThreshold(size_t bytes);
+    bool flush();
+
+    //sends as much of the output buffer as the kernel takes right now without blocking, the rest
+    //stays buffered for the next call. Returns false if the connection failed
+    bool flushAvailable();
+    size_t pendingSendBytes();
+
+    //an event loop's socket never blocks on a peer that stops reading, its output piles up
+    //instead. Once more than bytes are waiting, sends fail without buffering the message, which
+    //is how handlers learn to drop or slow down such a peer
+    void setSendHighWater(size_t bytes);
+
+    //corks the socket and lets the given queue flush it (see EventManager::autoFlush())
+    void setFlushQueue(std::shared_ptr<FlushQueue> queue);
+
+    //zero copy sends for bulk payloads (linux only, other platforms always copy). After
+    //enableZeroCopy(), sendBytesZeroCopy() hands payloads of at least threshold bytes to the
+    //kernel with MSG_ZEROCOPY instead of copying them. The caller's buffer must stay untouched
+    //until onRelease runs, which happens from reapZeroCopyCompletions() once the kernel reports
+    //it is done with the pages. Smaller payloads use a normal send and are released right away.
+    //Closing a blocking socket waits up to ZEROCOPY_CLOSE_WAIT_MS for outstanding payloads, one
+    //served by an event loop does not wait. Whatever is still unfinished then is dropped: the
+    //connection is reset instead of sending it and every remaining onRelease runs after the close.
+    //A socket flushed by an event loop never blocks here: a frame that finds it backed up, or the
+    //part the kernel does not take, is copied and queued like a corked send.
+    //On loopback the kernel copies anyway but still reports completions (see getZeroCopyFallbacks())
+    bool enableZeroCopy(size_t threshold);
+    bool sendBytesZeroCopy(std::span<const uint8_t> data, std::function<void()> onRelease);
+    int reapZeroCopyCompletions();
+    bool waitForZeroCopyCompletions(int timeoutMs);
+    size_t pendingZeroCopySends();
+    size_t getZeroCopyFallbacks();
     #if CRYPTOGRAPHY
     void setCryptography(bool cryptography);
+
+    //handshakes of the responding side (clients) take their Kyber keypair from pool instead of
+    //generating it while connecting, they only fall back to keygen when the pool has run dry.
+    //NULL (the default) always generates. Set it before connecting, it is shared by every socket
+    static void setKeypairPool(std::shared_ptr<KeypairPool> pool);
+
+    //session resumption. A server given keys hands a ticket to every client that asks for one
+    //with its cipher. A client with a cache asks for one and reconnects to the same "ip:port" with
+    //it, which takes one round trip and no Kyber math: both sides derive new keys from the secret
+    //the ticket carries and fresh nonces. Every ticket is accepted once. A rejected ticket falls
+    //back to the full handshake on the same connection. Clients with a cache need servers that know the hello (see HELLO_MARKER).
+    //NULL (the default) turns it off. Set them before accepting/connecting, they are shared by every socket
+    static void setTicketKeys(std::shared_ptr<TicketKeys> keys);
+    static void setSessionCache(std::shared_ptr<SessionCache> cache);
+
+    //0-RTT handshakes. A server given a long-term keypair accepts clients that encapsulate to its
+    //public key right away: a client whose session cache knows that key (see SessionCache::setServerKey())
+    //sends the cipher in the same write as its first message and never waits for the server. The
+    //server decapsulates with the expanded secret key and sends nothing back. Such sessions have no
+    //forward secrecy and a recorded first flight can be replayed to the server, so the first
+    //message should be safe to process twice. NULL (the default) refuses 0-RTT clients
+    static void setServerKeypair(std::shared_ptr<ServerKeypair> keypair);
     #endif
 };
 
@@ -280,6 +730,7 @@ public:
                 cerr << "Unable to connect to server: " << WSAGetLastError() << endl;
                 closesocket(socketId);
                 WSACleanup();
+                socketId = -1;  //already closed, the Socket destructor must not close it again
                 throw runtime_error("Failed to connect to server");
             }
 
@@ -308,6 +759,7 @@ public:
             {
                 cerr << "Unable to connect to server: " << strerror(errno) << endl;
                 close(socketId);
+                socketId = -1;  //already closed, the Socket destructor must not close it again
                 throw runtime_error("Failed to connect to server");
             }
         #endif
@@ -317,16 +769,28 @@ public:
 
         applyCryptography = true;
 
+        //the session cache knows the server by address
+        sessionName = serverIp + ":" + std::to_string(port);
+
         //collaborate with connected party to get shared encryption key
-        setupEncryption();
+        beginHandshake();
+        if (!setupEncryption())
+        {
+            #ifdef _WIN32
+            closesocket(socketId);
+            WSACleanup();
+            #else
+            close(socketId);
+            #endif
+            socketId = -1;
+            throw runtime_error("Key exchange with server failed");
+        }
         #endif
     }
 
-    // Destructor for the Client class
-    ~Client() {
-        // Call the Socket destructor explicitly
-        Socket::~Socket();
-    }
+    // The Socket destructor releases the socket, moving a Client moves the connection
+    Client(Client &&other) = default;
+    Client& operator=(Client &&other) = default;
 };
 
 /************************************************************************
@@ -336,7 +800,13 @@ public:
 class Server : public Socket {
 public:
     // Constructor, creates socket, binds to port, then listens for incoming connections. 
-    Server(const int port, const int numServerThreads, bool autoPrint, bool portReuse)
+    // portSharing lets several servers listen on the same port, the kernel spreads new
+    // connections over them (SO_REUSEPORT, linux only). backlog is how many connections may
+    // wait to be accepted, it no longer follows numServerThreads: a short queue overflows
+    // during connection bursts no matter how many threads accept from it. numServerThreads
+    // is unused and only kept so existing callers still compile
+    Server(const int port, [[maybe_unused]] const int numServerThreads, bool autoPrint, bool portReuse, bool portSharing = false,
+           int backlog = DEFAULT_LISTEN_BACKLOG)
     : Socket()
     {   
         autoPrintResponses = autoPrint;
@@ -372,6 +842,7 @@ public:
         server_address.sin_port = htons(port); // Port to listen on
 
         if (portReuse) {allowPortReuse();}
+        if (portSharing) {allowPortSharing();}
 
         // Bind to port
         if (bind(socketId, (struct sockaddr *)&server_address, sizeof(server_address)) == -1) {
@@ -381,438 +852,6651 @@ public:
             #else
             close(socketId);
             #endif
+            socketId = -1;
             throw std::runtime_error("Error binding socket");
         }
 
         // Listen for client connections (pending connections get put into a queue)
-        if (listen(socketId, numServerThreads) == -1) {
+        if (listen(socketId, backlog) == -1) {
             #ifdef _WIN32
             closesocket(socketId);
             WSACleanup();
             #else
             close(socketId);
             #endif
+            socketId = -1;
             throw std::runtime_error("Error listening on socket");
         }
     }
 
-    // Destructor for the Server class
-    ~Server() {
-        // Call the Socket destructor explicitly
-        Socket::~Socket();
-    }
+    // The Socket destructor releases the socket, moving a Server moves the listening socket
+    Server(Server &&other) = default;
+    Server& operator=(Server &&other) = default;
 
     void allowPortReuse();
+    void allowPortSharing();
     bool acceptConnection(int *client_socket);
+
+    //a connection taken off the accept queue by acceptPending()
+    struct AcceptedClient {
+        int socket;
+        sockaddr_storage peer;      //only filled in when acceptPending() is asked for peers
+        socklen_t peerLength;
+    };
+
+    //takes every connection waiting in the accept queue (at most maxClients) and appends them
+    //to clients, returns how many were taken. One wakeup of the listener drains the whole
+    //queue instead of accepting one connection per wakeup. The listener is switched to
+    //non-blocking mode, the new sockets are non-blocking and close-on-exec without extra
+    //syscalls (accept4 on linux). withPeers also records each client's address. Like the other
+    //calls on a Socket, one thread at a time
+    size_t acceptPending(std::vector<AcceptedClient> &clients, bool withPeers = false, size_t maxClients = SIZE_MAX);
+
+    //changes the listen backlog of the running server
+    bool setBacklog(int backlog);
+
+    struct AcceptStats {
+        uint64_t accepted;          //connections taken by acceptPending()
+        uint64_t drains;            //acceptPending() calls that took at least one
+        uint32_t queued;            //connections waiting in the accept queue right now
+        uint32_t backlog;           //the queue's limit as the kernel applies it
+        uint64_t listenOverflows;   //system wide, connections dropped because an accept queue was full
+        uint64_t listenDrops;       //system wide, connections dropped by listening sockets for any reason
+    };
+
+    //queue and overflow counters, the kernel side ones are only available on linux (0 elsewhere)
+    AcceptStats getAcceptStats();
+
+private:
+    bool listenerNonBlocking = false;
+    uint64_t acceptedCount = 0;
+    uint64_t acceptDrains = 0;
 };
 
 /************************************************************************
  * Socket Methods (available to both Client and Server subclasses)
  ************************************************************************/
 
-//waits for string from connected socket. Incoming string must be followed by '\0' (as done in sendString())
-inline bool Socket::getString(string& str) {
-    // Clear string before using it
-    str.clear();
-    bool result = true;
-    char currentChar;
-    
-    //receive string character by character until null char is received
-    while(recv(socketId, &currentChar, sizeof(currentChar), 0) > 0)
+inline Socket::Socket(Socket &&other) noexcept
+{
+    takeOver(other);
+}
+
+inline Socket& Socket::operator=(Socket &&other) noexcept
+{
+    if (this != &other)
     {
-        //break if null char
-        if (currentChar == '\0')
-        {
-            break;
-        }
-        //append char to string
-        str += currentChar;
+        release();
+        takeOver(other);
     }
+    return *this;
+}
 
-    if (str.length() == 0)
+//sends what is still corked, waits for zero copy sends and closes the fd. A moved from socket
+//(or one whose constructor failed) has nothing left to release
+inline void Socket::release()
+{
+    if (socketId < 0)
     {
-        return false;
+        return;
+    }
+
+    //send anything still corked and make sure the flush queue forgets us. An event loop's socket
+    //only gets what the kernel takes right away, a peer that stopped reading must not block the loop
+    if (flushQueue)
+    {
+        flushAvailable();
+    }
+    else
+    {
+        flush();
+    }
+    if (flushQueue && flushScheduled)
+    {
+        flushQueue->cancel(this);
+    }
+
+    #if defined(__linux__)
+    //give the kernel a chance to finish with buffers still pinned by zero copy sends. A socket
+    //served by an event loop only takes what already completed, waiting would stall the loop
+    bool unfinished;
+    if (flushQueue || (fcntl(socketId, F_GETFL, 0) & O_NONBLOCK))
+    {
+        reapZeroCopyCompletions();
+        unfinished = !zeroCopyPending.empty();
+    }
+    else
+    {
+        unfinished = !waitForZeroCopyCompletions(ZEROCOPY_CLOSE_WAIT_MS);
+    }
+
+    //no notifications arrive after closing, so the rest is released below. Resetting the
+    //connection keeps the kernel from still sending out of those buffers. It holds its own
+    //references to the pinned pages, which keeps freeing them safe
+    if (unfinished)
+    {
+        linger abort = {1, 0};
+        setsockopt(socketId, SOL_SOCKET, SO_LINGER, &abort, sizeof(abort));
     }
-    
-    #if VERBOSE
-        cout << "String received: " << str << endl << endl;
     #endif
-    
+
     #if CRYPTOGRAPHY
-    // Decrypt the message
-    result = decrypt(str);
+    freeEncryptionContext();
     #endif
 
-    // Print if autoPrintResponses is true
-    if (autoPrintResponses) {
-        cout << str << endl;
-    }
+    //free socket
+    #ifdef _WIN32
+    closesocket(socketId);
+    WSACleanup();
+    #else
+    close(socketId);
+    #endif
+    socketId = -1;
 
-    return result;
+    #if defined(__linux__)
+    for (ZeroCopySend& pending : zeroCopyPending)
+    {
+        if (pending.onRelease)
+        {
+            pending.onRelease();
+        }
+    }
+    zeroCopyPending.clear();
+    #endif
 }
 
-//send given string to connected socket (terminate transmission with \0)
-inline bool Socket::sendString(string str) 
+inline void Socket::takeOver(Socket &other)
 {
-    bool result = true;
+    socketId = std::exchange(other.socketId, -1);
+    autoPrintResponses = other.autoPrintResponses;
 
     #if CRYPTOGRAPHY
-    // Encrypt the string
-    result = encrypt(str);
+    initiator = other.initiator;
+    applyCryptography = other.applyCryptography;
+    encryptionContext.encrypt_ctx = std::exchange(other.encryptionContext.encrypt_ctx, nullptr);
+    encryptionContext.decrypt_ctx = std::exchange(other.encryptionContext.decrypt_ctx, nullptr);
+    encryptionContext.sharedKey = std::move(other.encryptionContext.sharedKey);
+    memcpy(encryptionContext.iv, other.encryptionContext.iv, sizeof(encryptionContext.iv));
+    handshake = std::move(other.handshake);
+    sessionName = std::move(other.sessionName);
     #endif
 
-    #if VERBOSE
-        cout << "String to send: " << str << " with length :" << str.length() << endl << endl;
+    recvBuffer = std::move(other.recvBuffer);
+    recvBufferSize = other.recvBufferSize;
+    recvStart = std::exchange(other.recvStart, 0);
+    recvEnd = std::exchange(other.recvEnd, 0);
+    receiveBudgetUsed = std::exchange(other.receiveBudgetUsed, false);
+
+    sendBuffer = std::move(other.sendBuffer);
+    other.sendBuffer.clear();
+    sendStart = std::exchange(other.sendStart, 0);
+    corked = std::exchange(other.corked, false);
+    corkFlushThreshold = other.corkFlushThreshold;
+    sendHighWater = other.sendHighWater;
+
+    //the flush queue knows the socket by address
+    flushQueue = std::move(other.flushQueue);
+    flushScheduled = std::exchange(other.flushScheduled, false);
+    flushBlocked = std::exchange(other.flushBlocked, false);
+    if (flushScheduled)
+    {
+        flushQueue->relocate(&other, this);
+    }
+
+    #if defined(__linux__)
+    zeroCopyPending = std::move(other.zeroCopyPending);
+    other.zeroCopyPending.clear();
+    zeroCopyThreshold = std::exchange(other.zeroCopyThreshold, 0);
+    zeroCopyNextId = std::exchange(other.zeroCopyNextId, 0);
+    zeroCopyFallbacks = std::exchange(other.zeroCopyFallbacks, 0);
     #endif
+}
 
-    int transmissionLen = str.length() +1;
-    
-    // Send the data
-    int sendResult = send(socketId, str.c_str(), transmissionLen, 0);
-    if (sendResult != transmissionLen) {
-        return false; // Error in sending data
+//sends exactly dataSize bytes, retrying after partial sends. Returns false if the connection fails
+inline bool Socket::sendAll(const char* data, size_t dataSize)
+{
+    while (dataSize > 0)
+    {
+        int bytesSent = send(socketId, data, dataSize, 0);
+        if (bytesSent < 0 && retryAfterWouldBlock(POLLOUT))
+        {
+            continue;
+        }
+        if (bytesSent <= 0)
+        {
+            return false;
+        }
+        data += bytesSent;
+        dataSize -= bytesSent;
     }
-
-    return result;
+    return true;
 }
 
-/************************************************************************
- * Server Class Methods
- ************************************************************************/
-//prevent wait time after restarting server on the same port
-void Server::allowPortReuse() 
+//called after a socket call failed. If it failed only because a non-blocking socket was not
+//ready, waits until it is (events is POLLIN or POLLOUT) and returns true so the call gets retried
+inline bool Socket::retryAfterWouldBlock(short events)
 {
-    int reuse = 1;
     #ifdef _WIN32
-    if (setsockopt(socketId, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse)) == SOCKET_ERROR) {
-        perror("setsockopt(SO_REUSEADDR) failed");
+    if (WSAGetLastError() != WSAEWOULDBLOCK)
+    {
+        return false;
     }
+    WSAPOLLFD pollFd = {(SOCKET)socketId, events, 0};
+    return WSAPoll(&pollFd, 1, -1) > 0;
     #else
-    if (setsockopt(socketId, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
-        perror("setsockopt(SO_REUSEADDR) failed");
+    if (errno == EINTR)
+    {
+        return true;
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+        return false;
     }
-    #endif
-}
 
-//wait for client to connect, make a client_socket when they do. If fail to connect, return false
-bool Server::acceptConnection(int *client_socket)
-{
-    //check for failed client connection
-    if ((*client_socket = accept(socketId, NULL, NULL)) == -1) 
+    pollfd pollFd = {socketId, events, 0};
+    while (poll(&pollFd, 1, -1) < 0)
+    {
+        if (errno != EINTR)
         {
             return false;
-        } 
+        }
+    }
     return true;
+    #endif
 }
 
-/************************************************************************
- * Event Manager Classes (Can be declared and used alongside server to create
- * an event based server)
- ************************************************************************/
+//reads as much as fits into the receive buffer with a single recv call, returns the recv result.
+//Without wait a socket that has nothing to read fails with EAGAIN instead of blocking, and the
+//buffer grows up to MAX_RECV_BUFFER_LEN for a message that needs it. It fails with EMSGSIZE once
+//it is full and cannot grow
+inline int Socket::fillReceiveBuffer(bool wait)
+{
+    //a 0-RTT hello waits for the first message, but the peer may be waiting for it to speak first
+    if (!corked && !sendBuffer.empty() && !flush())
+    {
+        return SOCKET_ERROR;
+    }
 
-#if EVENT_BASED && defined(__linux__)
+    if (recvBuffer.size() < recvBufferSize)
+    {
+        recvBuffer.resize(recvBufferSize);
+    }
 
-/************************************************************************
- * Epoll implementation
- ************************************************************************/
+    //reuse the whole buffer once everything has been handed out, one grown for a large message
+    //goes back to its normal size
+    if (recvStart == recvEnd)
+    {
+        recvStart = recvEnd = 0;
+        if (recvBuffer.size() > recvBufferSize)
+        {
+            recvBuffer.resize(recvBufferSize);
+            recvBuffer.shrink_to_fit();
+        }
+    }
+    //out of room at the back, move the unread bytes to the front or grow if there are no read bytes to drop
+    else if (recvEnd == recvBuffer.size())
+    {
+        if (recvStart > 0)
+        {
+            memmove(recvBuffer.data(), recvBuffer.data() + recvStart, recvEnd - recvStart);
+            recvEnd -= recvStart;
+            recvStart = 0;
+        }
+        else if (wait && recvBuffer.size() < MAX_FRAME_LEN)
+        {
+            recvBuffer.resize(std::min(recvBuffer.size() * 2, MAX_RECV_BUFFER_LEN));
+        }
+        //without wait the buffer only grows for a first message that does not fit yet, never to
+        //read further ahead. A frame header says how far that is
+        else if (!wait && !hasBufferedMessage() && recvBuffer.size() < MAX_RECV_BUFFER_LEN)
+        {
+            size_t grown = std::min(recvBuffer.size() * 2, MAX_RECV_BUFFER_LEN);
+            #if FRAMED_PROTOCOL
+            FrameHeader header;
+            if (unpackFrameHeader(reinterpret_cast<const uint8_t*>(recvBuffer.data()), header))
+            {
+                grown = std::min(grown, FRAME_HEADER_LEN + header.length);
+            }
+            #endif
+            recvBuffer.resize(grown);
+        }
+        else
+        {
+            #ifdef _WIN32
+            WSASetLastError(WSAEMSGSIZE);
+            #else
+            errno = EMSGSIZE;
+            #endif
+            return SOCKET_ERROR;
+        }
+    }
 
-#if EVENT_BASED_ARCHITECTURE == 0
-class EventManager {
+    int bytesReceived;
+    do
+    {
+        #ifdef _WIN32
+        //windows has no per call non-blocking flag, check that something is there instead
+        u_long available = 0;
+        if (!wait && (ioctlsocket(socketId, FIONREAD, &available) != 0 || available == 0))
+        {
+            WSASetLastError(WSAEWOULDBLOCK);
+            return SOCKET_ERROR;
+        }
+        bytesReceived = recv(socketId, recvBuffer.data() + recvEnd, recvBuffer.size() - recvEnd, 0);
+        #else
+        bytesReceived = recv(socketId, recvBuffer.data() + recvEnd, recvBuffer.size() - recvEnd, wait ? 0 : MSG_DONTWAIT);
+        #endif
+    } while (bytesReceived < 0 && wait && retryAfterWouldBlock(POLLIN));
 
-public:
-    //declare vars
-    struct epoll_event newConnectionEvent;
-    struct epoll_event *events;
-    int epollFD;
-    int serverSocket;
-    int pendingEvents;
+    if (bytesReceived > 0)
+    {
+        recvEnd += bytesReceived;
+    }
+    return bytesReceived;
+}
 
-    //wait for event and return the type of event that occurred   
-    int waitForEvent();
+//drains the socket until the kernel has nothing left or the budget is used up, see the declaration
+inline bool Socket::receiveAvailable()
+{
+    size_t received = 0;
+
+    receiveBudgetUsed = false;
+    while (true)
+    {
+        //leave the rest for the next wakeup, nothing is handed out until this returns
+        if (received >= RECEIVE_BUDGET_LEN)
+        {
+            receiveBudgetUsed = true;
+            return true;
+        }
+
+        //a full buffer only grows for a message that does not fit, complete ones are taken out first
+        if (recvStart == 0 && recvEnd == recvBuffer.size() && hasBufferedMessage())
+        {
+            receiveBudgetUsed = true;
+            return true;
+        }
+
+        int bytesReceived = fillReceiveBuffer(false);
+        if (bytesReceived > 0)
+        {
+            received += bytesReceived;
+            continue;
+        }
+        if (bytesReceived == 0)
+        {
+            return false;
+        }
+
+        #ifdef _WIN32
+        return WSAGetLastError() == WSAEWOULDBLOCK;
+        #else
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+        #endif
+    }
+}
+
+inline bool Socket::moreToReceive()
+{
+    return receiveBudgetUsed;
+}
+
+inline bool Socket::setNonBlocking(bool nonBlocking)
+{
+    #ifdef _WIN32
+    u_long mode = nonBlocking ? 1 : 0;
+    return ioctlsocket(socketId, FIONBIO, &mode) == 0;
+    #else
+    int flags = fcntl(socketId, F_GETFL, 0);
+    if (flags < 0)
+    {
+        return false;
+    }
+    flags = nonBlocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    return fcntl(socketId, F_SETFL, flags) == 0;
+    #endif
+}
+
+//see the declaration. Windows has no per call non-blocking flag, the socket must be non-blocking there
+inline HandshakeStatus Socket::continueHandshake([[maybe_unused]] bool offloadComputation)
+{
+    #if CRYPTOGRAPHY
+    while (handshake)
+    {
+        Handshake &state = *handshake;
+        bool sending = state.step == Handshake::SEND_PUBLIC_KEY || state.step == Handshake::SEND_CIPHER ||
+                       state.step == Handshake::SEND_TICKET || state.step == Handshake::SEND_RESUMPTION;
+
+        //move the rest of the current message, exactly as many bytes as it has
+        while (state.transferred < state.message.size())
+        {
+            char *data = reinterpret_cast<char*>(state.message.data()) + state.transferred;
+            size_t remaining = state.message.size() - state.transferred;
+
+            #ifdef _WIN32
+            int bytes = sending ? send(socketId, data, remaining, 0) : recv(socketId, data, remaining, 0);
+            if (bytes < 0 && WSAGetLastError() == WSAEWOULDBLOCK)
+            {
+                return sending ? HANDSHAKE_WANT_WRITE : HANDSHAKE_WANT_READ;
+            }
+            #else
+            int bytes = sending ? send(socketId, data, remaining, MSG_DONTWAIT) : recv(socketId, data, remaining, MSG_DONTWAIT);
+            if (bytes < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                return sending ? HANDSHAKE_WANT_WRITE : HANDSHAKE_WANT_READ;
+            }
+            #endif
+            if (bytes <= 0)
+            {
+                handshake.reset();
+                return HANDSHAKE_FAILED;
+            }
+            state.transferred += bytes;
+        }
+
+        //the received message is complete, its Kyber computation comes next
+        bool receiving = state.step == Handshake::RECEIVE_PUBLIC_KEY || state.step == Handshake::RECEIVE_CIPHER ||
+                         state.step == Handshake::RECEIVE_EARLY_CIPHER;
+        if (receiving && !state.computed)
+        {
+            if (offloadComputation)
+            {
+                return HANDSHAKE_WANT_COMPUTE;
+            }
+            computeHandshakeStep(state);
+        }
+
+        if (!finishHandshakeStep())
+        {
+            handshake.reset();
+            return HANDSHAKE_FAILED;
+        }
+    }
+    #endif
+    return HANDSHAKE_DONE;
+}
+
+inline bool Socket::handshakePending()
+{
+    #if CRYPTOGRAPHY
+    return handshake != nullptr;
+    #else
+    return false;
+    #endif
+}
+
+inline std::function<void()> Socket::getHandshakeComputation()
+{
+    #if CRYPTOGRAPHY
+    if (handshake && !handshake->computed)
+    {
+        std::shared_ptr<Handshake> state = handshake;
+        return [state]() { computeHandshakeStep(*state); };
+    }
+    #endif
+    return nullptr;
+}
+
+//receives exactly dataSize bytes, buffered bytes are used first. Returns false if the connection closes or fails first
+inline bool Socket::recvAll(char* data, size_t dataSize)
+{
+    while (dataSize > 0)
+    {
+        size_t buffered = std::min(dataSize, recvEnd - recvStart);
+
+        if (buffered > 0)
+        {
+            memcpy(data, recvBuffer.data() + recvStart, buffered);
+            recvStart += buffered;
+            data += buffered;
+            dataSize -= buffered;
+        }
+        //large reads skip the buffer and go straight into the destination
+        else if (dataSize >= recvBufferSize)
+        {
+            int bytesReceived = recv(socketId, data, dataSize, 0);
+            if (bytesReceived < 0 && retryAfterWouldBlock(POLLIN))
+            {
+                continue;
+            }
+            if (bytesReceived <= 0)
+            {
+                return false;
+            }
+            data += bytesReceived;
+            dataSize -= bytesReceived;
+        }
+        //small reads refill the buffer so that any messages behind this one arrive in the same call
+        else if (fillReceiveBuffer() <= 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+//returns true if a complete message is sitting in the receive buffer
+inline bool Socket::hasBufferedMessage()
+{
+    size_t buffered = recvEnd - recvStart;
+
+    #if FRAMED_PROTOCOL
+    FrameHeader header;
+
+    if (buffered < FRAME_HEADER_LEN)
+    {
+        return false;
+    }
+    //a broken header counts as ready so the next read reports the error
+    if (!unpackFrameHeader(reinterpret_cast<const uint8_t*>(recvBuffer.data() + recvStart), header))
+    {
+        return true;
+    }
+    return buffered >= FRAME_HEADER_LEN + header.length;
+    #else
+    return buffered > 0 && memchr(recvBuffer.data() + recvStart, '\0', buffered) != NULL;
+    #endif
+}
+
+//sets the size of the receive buffer used for this connection. Messages larger than the buffer
+//still work but need more than one recv call
+inline void Socket::setReceiveBufferSize(size_t size)
+{
+    //keep unread bytes at the front so shrinking never loses data
+    if (recvStart > 0)
+    {
+        memmove(recvBuffer.data(), recvBuffer.data() + recvStart, recvEnd - recvStart);
+        recvEnd -= recvStart;
+        recvStart = 0;
+    }
+
+    recvBufferSize = std::max(size, FRAME_HEADER_LEN);
+    recvBuffer.resize(std::max(recvBufferSize, recvEnd));
+}
+
+//turns write coalescing on or off, turning it off sends anything still buffered
+inline void Socket::setCorked(bool cork)
+{
+    corked = cork;
+    if (!corked)
+    {
+        flush();
+    }
+}
+
+//corked sockets flush as soon as this many bytes are waiting
+inline void Socket::setCorkFlushThreshold(size_t bytes)
+{
+    corkFlushThreshold = bytes;
+    if (pendingSendBytes() >= corkFlushThreshold)
+    {
+        flush();
+    }
+}
+
+//sends everything in the output buffer with a single syscall (more only if the kernel takes it partially)
+inline bool Socket::flush()
+{
+    bool result = true;
+
+    if (!sendBuffer.empty())
+    {
+        result = sendAll(sendBuffer.data() + sendStart, pendingSendBytes());
+
+        //on failure the data is dropped, the connection is broken anyway
+        sendBuffer.clear();
+        sendStart = 0;
+    }
+    return result;
+}
+
+//see the declaration
+inline bool Socket::flushAvailable()
+{
+    bool result = true;
+
+    while (!sendBuffer.empty())
+    {
+        #ifdef _WIN32
+        int bytesSent = send(socketId, sendBuffer.data() + sendStart, pendingSendBytes(), 0);
+        if (bytesSent < 0)
+        {
+            result = WSAGetLastError() == WSAEWOULDBLOCK;
+            break;
+        }
+        #else
+        int bytesSent = send(socketId, sendBuffer.data() + sendStart, pendingSendBytes(), MSG_DONTWAIT);
+        if (bytesSent < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            result = errno == EAGAIN || errno == EWOULDBLOCK;
+            break;
+        }
+        #endif
+
+        sendStart += bytesSent;
+        if (sendStart == sendBuffer.size())
+        {
+            sendBuffer.clear();
+            sendStart = 0;
+        }
+    }
+
+    //drop the sent bytes once they outweigh the unsent ones, so draining a large backlog in
+    //small pieces stays linear instead of moving the whole rest after every send
+    if (sendStart > pendingSendBytes())
+    {
+        sendBuffer.erase(sendBuffer.begin(), sendBuffer.begin() + sendStart);
+        sendStart = 0;
+    }
+    return result;
+}
+
+inline size_t Socket::pendingSendBytes()
+{
+    return sendBuffer.size() - sendStart;
+}
+
+inline void Socket::setSendHighWater(size_t bytes)
+{
+    sendHighWater = bytes;
+}
+
+inline void Socket::setFlushQueue(std::shared_ptr<FlushQueue> queue)
+{
+    if (flushQueue && flushScheduled)
+    {
+        flushQueue->cancel(this);
+        flushScheduled = false;
+    }
+
+    flushQueue = queue;
+    corked = true;
+    if (flushQueue && !sendBuffer.empty())
+    {
+        flushQueue->schedule(this);
+    }
+}
+
+//sends every piece back to back, retrying after partial sends. On linux the pieces go out
+//with writev so they never need to be copied into one buffer
+inline bool Socket::sendPieces(std::span<const std::string_view> pieces)
+{
+    //while corked the pieces only get appended to the output buffer
+    if (corked)
+    {
+        //a peer that stops reading must not make an event loop buffer for it without end
+        if (flushQueue && pendingSendBytes() > sendHighWater)
+        {
+            return false;
+        }
+
+        for (std::string_view piece : pieces)
+        {
+            sendBuffer.insert(sendBuffer.end(), piece.begin(), piece.end());
+        }
+
+        if (pendingSendBytes() >= corkFlushThreshold)
+        {
+            //an event loop's socket must not block it, the queue sends the rest once it is writable
+            if (!flushQueue)
+            {
+                return flush();
+            }
+            if (!flushBlocked && !flushAvailable())
+            {
+                return false;
+            }
+        }
+        if (flushQueue && !flushScheduled && !sendBuffer.empty())
+        {
+            flushQueue->schedule(this);
+        }
+        return true;
+    }
+
+    //bytes left in the output buffer while uncorked (a 0-RTT hello, see Socket::sendEarlyCipher())
+    //go out in the same write, ahead of the pieces
+    if (!sendBuffer.empty())
+    {
+        std::vector<char> pending = std::move(sendBuffer);
+        size_t pendingStart = std::exchange(sendStart, 0);
+        sendBuffer.clear();
+
+        std::vector<std::string_view> joined = {std::string_view(pending.data() + pendingStart, pending.size() - pendingStart)};
+        joined.insert(joined.end(), pieces.begin(), pieces.end());
+        return sendPieces(joined);
+    }
+
+    #if defined(__linux__)
+    std::vector<iovec> iov(pieces.size());
+    size_t first = 0;
+
+    for (size_t i = 0; i < pieces.size(); i++)
+    {
+        iov[i].iov_base = const_cast<char*>(pieces[i].data());
+        iov[i].iov_len = pieces[i].size();
+    }
+
+    while (first < iov.size())
+    {
+        ssize_t bytesSent = writev(socketId, iov.data() + first, std::min<size_t>(iov.size() - first, IOV_MAX));
+        if (bytesSent < 0)
+        {
+            if (retryAfterWouldBlock(POLLOUT))
+            {
+                continue;
+            }
+            return false;
+        }
+
+        //skip the pieces that went out completely, then trim the one that went out partially
+        while (first < iov.size() && (size_t)bytesSent >= iov[first].iov_len)
+        {
+            bytesSent -= iov[first].iov_len;
+            first++;
+        }
+        if (first < iov.size())
+        {
+            iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + bytesSent;
+            iov[first].iov_len -= bytesSent;
+        }
+    }
+    return true;
+    #else
+    string joined;
+
+    for (std::string_view piece : pieces)
+    {
+        joined.append(piece);
+    }
+    return sendAll(joined.data(), joined.size());
+    #endif
+}
+
+//encrypts the pieces if cryptography is on, then sends header and payload as a single frame
+inline bool Socket::sendFrame(uint8_t type, std::span<const std::string_view> pieces)
+{
+    FrameHeader header = {FRAME_VERSION, type, 0, 0};
+    uint8_t rawHeader[FRAME_HEADER_LEN];
+    std::vector<std::string_view> wirePieces;
+    size_t payloadSize = 0;
+
+    //header goes first, its contents are filled in once the payload size is known
+    wirePieces.reserve(pieces.size() + 1);
+    wirePieces.emplace_back(reinterpret_cast<const char*>(rawHeader), FRAME_HEADER_LEN);
+
+    #if CRYPTOGRAPHY
+    std::vector<uint8_t> cipherText;
+    if (applyCryptography)
+    {
+        //the pieces are encrypted in order, so the ciphertext matches that of the joined payload
+        if (!encryptPieces(pieces, cipherText))
+        {
+            return false;
+        }
+        wirePieces.emplace_back(reinterpret_cast<const char*>(cipherText.data()), cipherText.size());
+        payloadSize = cipherText.size();
+        header.flags |= FRAME_ENCRYPTED;
+    }
+    else
+    #endif
+    {
+        for (std::string_view piece : pieces)
+        {
+            wirePieces.push_back(piece);
+            payloadSize += piece.size();
+        }
+    }
+
+    if (payloadSize > MAX_FRAME_LEN)
+    {
+        return false;
+    }
+    header.length = payloadSize;
+    packFrameHeader(header, rawHeader);
+
+    //header and payload go out together so the receiver can read them in one or two recv calls
+    return sendPieces(wirePieces);
+}
+
+//receives one frame, the payload is decrypted if the sender marked it as encrypted
+inline bool Socket::getFrame(FrameHeader& header, std::vector<uint8_t>& payload)
+{
+    //wait for the whole header, nothing is consumed if the connection stops before it arrives
+    while (recvEnd - recvStart < FRAME_HEADER_LEN)
+    {
+        if (fillReceiveBuffer() <= 0)
+        {
+            return false;
+        }
+    }
+
+    //the header tells us exactly how much payload follows
+    if (!unpackFrameHeader(reinterpret_cast<const uint8_t*>(recvBuffer.data() + recvStart), header))
+    {
+        return false;
+    }
+
+    //frames that fit in the buffer are only consumed once they are complete, this keeps
+    //partial frames intact on non-blocking sockets
+    if (FRAME_HEADER_LEN + header.length <= recvBuffer.size())
+    {
+        while (recvEnd - recvStart < FRAME_HEADER_LEN + header.length)
+        {
+            if (fillReceiveBuffer() <= 0)
+            {
+                return false;
+            }
+        }
+    }
+    recvStart += FRAME_HEADER_LEN;
+
+    payload.resize(header.length);
+    if (!recvAll(reinterpret_cast<char*>(payload.data()), header.length))
+    {
+        return false;
+    }
+
+    if (header.flags & FRAME_ENCRYPTED)
+    {
+        #if CRYPTOGRAPHY
+        std::vector<uint8_t> plainText;
+        if (!decryptBytes(payload, plainText))
+        {
+            return false;
+        }
+        payload.swap(plainText);
+        #else
+        //we have no way to decrypt this payload
+        return false;
+        #endif
+    }
+
+    return true;
+}
+
+//waits for string from connected socket. With FRAMED_PROTOCOL the string arrives as a frame,
+//otherwise the incoming string must be followed by '\0' (as done in sendString())
+inline bool Socket::getString(string& str) {
+    // Clear string before using it
+    str.clear();
+    bool result = true;
+
+    #if FRAMED_PROTOCOL
+    FrameHeader header;
+    std::vector<uint8_t> payload;
+
+    if (!getFrame(header, payload))
+    {
+        return false;
+    }
+    str.assign(reinterpret_cast<const char*>(payload.data()), payload.size());
+
+    #if VERBOSE
+        cout << "String received: " << str << endl << endl;
+    #endif
+    #else
+    size_t scanned = 0;
+    char *terminator;
+
+    //search the buffered bytes for the terminating null char, fetching more until it shows up.
+    //memchr is vectorized so this stays cheap even for long strings
+    while ((terminator = (char*)memchr(recvBuffer.data() + recvStart + scanned, '\0', recvEnd - recvStart - scanned)) == NULL)
+    {
+        //remember how far we searched, fillReceiveBuffer() may move the unread bytes
+        scanned = recvEnd - recvStart;
+
+        //the partial string stays buffered so a later call can finish it
+        if (fillReceiveBuffer() <= 0)
+        {
+            return false;
+        }
+    }
+
+    str.assign(recvBuffer.data() + recvStart, terminator);
+    recvStart = terminator - recvBuffer.data() + 1;
+
+    if (str.length() == 0)
+    {
+        return false;
+    }
+    
+    #if VERBOSE
+        cout << "String received: " << str << endl << endl;
+    #endif
+    
+    #if CRYPTOGRAPHY
+    // Decrypt the message
+    result = decrypt(str);
+    #endif
+    #endif //FRAMED_PROTOCOL
+
+    // Print if autoPrintResponses is true
+    if (autoPrintResponses) {
+        cout << str << endl;
+    }
+
+    return result;
+}
+
+//send given string to connected socket (as a frame, or terminated with \0 without FRAMED_PROTOCOL)
+inline bool Socket::sendString(string str) 
+{
+    #if VERBOSE
+        cout << "String to send: " << str << " with length :" << str.length() << endl << endl;
+    #endif
+
+    #if FRAMED_PROTOCOL
+    std::string_view piece(str);
+    return sendFrame(FRAME_STRING, std::span<const std::string_view>(&piece, 1));
+    #else
+    bool result = true;
+
+    #if CRYPTOGRAPHY
+    // Encrypt the string
+    result = encrypt(str);
+    #endif
+
+    // Send the data, including the terminating null char
+    std::string_view piece(str.c_str(), str.length() + 1);
+    if (!sendPieces(std::span<const std::string_view>(&piece, 1))) {
+        return false; // Error in sending data
+    }
+
+    return result;
+    #endif
+}
+
+//sends the pieces as a single string message (framed, or followed by '\0' without FRAMED_PROTOCOL)
+inline bool Socket::sendv(std::span<const std::string_view> pieces)
+{
+    #if FRAMED_PROTOCOL
+    return sendFrame(FRAME_STRING, pieces);
+    #else
+    std::vector<std::string_view> wirePieces;
+    bool encrypted = false;
+
+    #if CRYPTOGRAPHY
+    std::vector<uint8_t> cipherText;
+    if (applyCryptography)
+    {
+        if (!encryptPieces(pieces, cipherText))
+        {
+            return false;
+        }
+        wirePieces.emplace_back(reinterpret_cast<const char*>(cipherText.data()), cipherText.size());
+        encrypted = true;
+    }
+    #endif
+
+    if (!encrypted)
+    {
+        wirePieces.assign(pieces.begin(), pieces.end());
+    }
+    wirePieces.emplace_back("\0", 1);
+
+    return sendPieces(wirePieces);
+    #endif
+}
+
+inline bool Socket::sendv(std::initializer_list<std::string_view> pieces)
+{
+    return sendv(std::span<const std::string_view>(pieces.begin(), pieces.size()));
+}
+
+//send arbitrary bytes to connected socket as a single frame
+inline bool Socket::sendBytes(std::span<const uint8_t> data)
+{
+    std::string_view piece(reinterpret_cast<const char*>(data.data()), data.size());
+    return sendFrame(FRAME_BINARY, std::span<const std::string_view>(&piece, 1));
+}
+
+//waits for a frame from connected socket and stores its payload in data
+inline bool Socket::getBytes(std::vector<uint8_t>& data)
+{
+    FrameHeader header;
+    return getFrame(header, data);
+}
+
+//waits for a frame from connected socket and copies its payload into buffer. If the payload
+//does not fit, the frame is dropped and false is returned
+inline bool Socket::getBytes(std::span<uint8_t> buffer, size_t *bytesReceived)
+{
+    FrameHeader header;
+    std::vector<uint8_t> payload;
+
+    *bytesReceived = 0;
+    if (!getFrame(header, payload) || payload.size() > buffer.size())
+    {
+        return false;
+    }
+
+    memcpy(buffer.data(), payload.data(), payload.size());
+    *bytesReceived = payload.size();
+    return true;
+}
+
+/************************************************************************
+ * Zero Copy Send Methods
+ ************************************************************************/
+
+//turns on SO_ZEROCOPY for this socket. Returns false if the platform or kernel does not support it,
+//in which case sendBytesZeroCopy() keeps working but always copies
+inline bool Socket::enableZeroCopy(size_t threshold)
+{
+    #if defined(__linux__) && defined(SO_ZEROCOPY)
+    int enable = 1;
+    if (setsockopt(socketId, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) < 0)
+    {
+        perror("setsockopt(SO_ZEROCOPY) failed");
+        return false;
+    }
+    zeroCopyThreshold = std::max<size_t>(threshold, 1);
+    return true;
+    #else
+    return false;
+    #endif
+}
+
+#if defined(__linux__)
+//sends the pieces with MSG_ZEROCOPY, retrying after partial sends. Every successful sendmsg call
+//gets its own notification id, firstId and calls report which ids belong to these pieces
+inline bool Socket::sendPiecesZeroCopy(std::span<const std::string_view> pieces, uint32_t *firstId, uint32_t *calls)
+{
+    std::vector<iovec> iov(pieces.size());
+    size_t first = 0;
+    int flags = MSG_ZEROCOPY;
+    int waitFlags = flushQueue ? MSG_DONTWAIT : 0;
+
+    *firstId = zeroCopyNextId;
+    *calls = 0;
+
+    for (size_t i = 0; i < pieces.size(); i++)
+    {
+        iov[i].iov_base = const_cast<char*>(pieces[i].data());
+        iov[i].iov_len = pieces[i].size();
+    }
+
+    while (first < iov.size())
+    {
+        msghdr msg = {};
+        msg.msg_iov = iov.data() + first;
+        msg.msg_iovlen = std::min<size_t>(iov.size() - first, IOV_MAX);
+
+        ssize_t bytesSent = sendmsg(socketId, &msg, flags | waitFlags);
+        if (bytesSent < 0)
+        {
+            //out of option memory for pinned pages, copy the rest the normal way
+            if (errno == ENOBUFS && flags != 0)
+            {
+                flags = 0;
+                continue;
+            }
+            //an event loop's socket never waits, the rest is copied and its flush queue sends it
+            //once the kernel takes more
+            if (flushQueue && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                for (; first < iov.size(); first++)
+                {
+                    const char *base = static_cast<const char*>(iov[first].iov_base);
+                    sendBuffer.insert(sendBuffer.end(), base, base + iov[first].iov_len);
+                }
+                if (!flushScheduled)
+                {
+                    flushQueue->schedule(this);
+                }
+                return true;
+            }
+            if (retryAfterWouldBlock(POLLOUT))
+            {
+                continue;
+            }
+            return false;
+        }
+        if (flags == MSG_ZEROCOPY)
+        {
+            zeroCopyNextId++;
+            (*calls)++;
+        }
+
+        //skip the pieces that went out completely, then trim the one that went out partially
+        while (first < iov.size() && (size_t)bytesSent >= iov[first].iov_len)
+        {
+            bytesSent -= iov[first].iov_len;
+            first++;
+        }
+        if (first < iov.size())
+        {
+            iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + bytesSent;
+            iov[first].iov_len -= bytesSent;
+        }
+    }
+    return true;
+}
+#endif
+
+//sends data as a single frame, large payloads without copying them into the kernel
+inline bool Socket::sendBytesZeroCopy(std::span<const uint8_t> data, std::function<void()> onRelease)
+{
+    #if defined(__linux__)
+    if (zeroCopyThreshold > 0 && data.size() >= zeroCopyThreshold)
+    {
+        FrameHeader header = {FRAME_VERSION, FRAME_BINARY, 0, 0};
+        ZeroCopySend pending;
+        uint32_t calls;
+
+        pending.onRelease = onRelease;
+
+        #if CRYPTOGRAPHY
+        if (applyCryptography)
+        {
+            //the kernel reads our ciphertext, not the caller's buffer, so theirs is free right away
+            if (!encryptBytes(data, pending.ownedBuffer))
+            {
+                return false;
+            }
+            data = pending.ownedBuffer;
+            header.flags |= FRAME_ENCRYPTED;
+            if (pending.onRelease)
+            {
+                pending.onRelease();
+                pending.onRelease = nullptr;
+            }
+        }
+        #endif
+
+        if (data.size() > MAX_FRAME_LEN)
+        {
+            return false;
+        }
+        header.length = data.size();
+
+        //the header is sent zero copy too, so it lives on the heap with the pending send (moving
+        //the record keeps the vector's storage where the kernel expects it)
+        pending.header.resize(FRAME_HEADER_LEN);
+        packFrameHeader(header, pending.header.data());
+
+        std::string_view pieces[2] = {
+            std::string_view(reinterpret_cast<const char*>(pending.header.data()), FRAME_HEADER_LEN),
+            std::string_view(reinterpret_cast<const char*>(data.data()), data.size())
+        };
+
+        //anything corked was queued first and has to reach the wire first. An event loop's
+        //socket must not block on that, while it is backed up the frame is copied and queued
+        //behind the rest like any other send
+        if (flushQueue)
+        {
+            if (!flushAvailable())
+            {
+                return false;
+            }
+            if (!sendBuffer.empty())
+            {
+                bool result = sendPieces(pieces);
+                if (pending.onRelease)
+                {
+                    pending.onRelease();
+                }
+                return result;
+            }
+        }
+        else if (!flush())
+        {
+            return false;
+        }
+
+        bool result = sendPiecesZeroCopy(pieces, &pending.firstId, &calls);
+
+        //the kernel only holds the buffer if at least one call went out zero copy
+        pending.calls = calls;
+        pending.remaining = calls;
+        if (calls > 0)
+        {
+            zeroCopyPending.push_back(std::move(pending));
+        }
+        else if (pending.onRelease)
+        {
+            pending.onRelease();
+        }
+        return result;
+    }
+    #endif
+
+    //small payloads are copied, so the caller's buffer is free as soon as send returns
+    bool result = sendBytes(data);
+    if (onRelease)
+    {
+        onRelease();
+    }
+    return result;
+}
+
+//reads completion notifications from the socket error queue without blocking and releases every
+//payload the kernel is done with. Returns the number of payloads released
+inline int Socket::reapZeroCopyCompletions()
+{
+    int released = 0;
+
+    #if defined(__linux__)
+    char control[CMSG_SPACE(sizeof(sock_extended_err)) + CMSG_SPACE(sizeof(sockaddr_in6))];
+    msghdr msg;
+
+    while (!zeroCopyPending.empty())
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(socketId, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        {
+            break;
+        }
+
+        for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                  (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)))
+            {
+                continue;
+            }
+
+            sock_extended_err *err = reinterpret_cast<sock_extended_err*>(CMSG_DATA(cmsg));
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+            {
+                continue;
+            }
+
+            //the kernel fell back to copying (always the case on loopback)
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+            {
+                zeroCopyFallbacks++;
+            }
+
+            //one notification covers the inclusive id range [ee_info, ee_data] and every id is
+            //reported exactly once. Ids wrap around, so positions are measured from the range start
+            uint32_t rangeLast = err->ee_data - err->ee_info;
+            for (ZeroCopySend& pending : zeroCopyPending)
+            {
+                int64_t start = (int32_t)(pending.firstId - err->ee_info);
+                int64_t last = start + pending.calls - 1;
+                int64_t overlap = std::min<int64_t>(last, rangeLast) - std::max<int64_t>(start, 0) + 1;
+                if (overlap > 0)
+                {
+                    pending.remaining -= overlap;
+                }
+            }
+        }
+
+        //release finished payloads in the order they were sent
+        while (!zeroCopyPending.empty() && zeroCopyPending.front().remaining == 0)
+        {
+            if (zeroCopyPending.front().onRelease)
+            {
+                zeroCopyPending.front().onRelease();
+            }
+            zeroCopyPending.pop_front();
+            released++;
+        }
+    }
+    #endif
+
+    return released;
+}
+
+//blocks until every zero copy payload has been released or timeoutMs passes (-1 waits forever).
+//Returns true if nothing is pending anymore
+inline bool Socket::waitForZeroCopyCompletions(int timeoutMs)
+{
+    #if defined(__linux__)
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+
+    reapZeroCopyCompletions();
+    while (!zeroCopyPending.empty())
+    {
+        //the timeout covers the whole wait, not each notification
+        int remainingMs = -1;
+        if (timeoutMs >= 0)
+        {
+            auto remaining = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+            remainingMs = (int)std::max<int64_t>(remaining.count(), 0);
+        }
+
+        //notifications show up as POLLERR, which poll always reports
+        pollfd pfd = {socketId, 0, 0};
+        if (poll(&pfd, 1, remainingMs) <= 0)
+        {
+            return false;
+        }
+        if (reapZeroCopyCompletions() == 0 && (pfd.revents & (POLLHUP | POLLNVAL)))
+        {
+            return false;
+        }
+    }
+    #endif
+    return true;
+}
+
+//number of zero copy payloads the kernel has not released yet
+inline size_t Socket::pendingZeroCopySends()
+{
+    #if defined(__linux__)
+    return zeroCopyPending.size();
+    #else
+    return 0;
+    #endif
+}
+
+//number of zero copy completion notifications in which the kernel reported it copied after all
+inline size_t Socket::getZeroCopyFallbacks()
+{
+    #if defined(__linux__)
+    return zeroCopyFallbacks;
+    #else
+    return 0;
+    #endif
+}
+
+/************************************************************************
+ * Flush Queue Methods
+ ************************************************************************/
+
+//remember a socket that has unsent data
+inline void FlushQueue::schedule(Socket *socket)
+{
+    pending.push_back(socket);
+    socket->flushScheduled = true;
+}
+
+//forget a socket, used when it is destroyed before the next flushAll()
+inline void FlushQueue::cancel(Socket *socket)
+{
+    auto it = std::find(pending.begin(), pending.end(), socket);
+    if (it != pending.end())
+    {
+        *it = pending.back();
+        pending.pop_back();
+    }
+    socket->flushScheduled = false;
+    socket->flushBlocked = false;
+}
+
+//a scheduled socket was moved to a new address
+inline void FlushQueue::relocate(Socket *from, Socket *to)
+{
+    std::replace(pending.begin(), pending.end(), from, to);
+}
+
+//flush every socket that collected data since the last call, sockets the kernel did not take
+//everything from stay on the list (see the class comment)
+inline void FlushQueue::flushAll(bool wait)
+{
+    size_t kept = 0;
+
+    for (Socket *socket : pending)
+    {
+        if (wait)
+        {
+            socket->flush();
+        }
+        else if (socket->flushAvailable() && !socket->sendBuffer.empty())
+        {
+            if (!socket->flushBlocked && watchWritable)
+            {
+                watchWritable(socket->socketId, true);
+            }
+            socket->flushBlocked = true;
+            pending[kept++] = socket;
+            continue;
+        }
+        else
+        {
+            //drained, or failed and dropped like flush() does since the connection is broken anyway
+            socket->sendBuffer.clear();
+            socket->sendStart = 0;
+            if (socket->flushBlocked && watchWritable)
+            {
+                watchWritable(socket->socketId, false);
+            }
+        }
+        socket->flushBlocked = false;
+        socket->flushScheduled = false;
+    }
+    pending.resize(kept);
+}
+
+/************************************************************************
+ * Server Class Methods
+ ************************************************************************/
+//prevent wait time after restarting server on the same port
+inline void Server::allowPortReuse() 
+{
+    int reuse = 1;
+    #ifdef _WIN32
+    if (setsockopt(socketId, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse)) == SOCKET_ERROR) {
+        perror("setsockopt(SO_REUSEADDR) failed");
+    }
+    #else
+    if (setsockopt(socketId, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
+        perror("setsockopt(SO_REUSEADDR) failed");
+    }
+    #endif
+}
+
+inline void Server::allowPortSharing()
+{
+    #ifdef SO_REUSEPORT
+    int share = 1;
+    if (setsockopt(socketId, SOL_SOCKET, SO_REUSEPORT, &share, sizeof(share)) < 0) {
+        perror("setsockopt(SO_REUSEPORT) failed");
+    }
+    #else
+    std::cerr << "Port sharing is not supported on this platform" << std::endl;
+    #endif
+}
+
+//wait for client to connect, make a client_socket when they do. If fail to connect, return false
+inline bool Server::acceptConnection(int *client_socket)
+{
+    //check for failed client connection
+    if ((*client_socket = accept(socketId, NULL, NULL)) == -1) 
+        {
+            return false;
+        } 
+    return true;
+}
+
+inline size_t Server::acceptPending(std::vector<AcceptedClient> &clients, bool withPeers, size_t maxClients)
+{
+    //an empty queue has to end the loop instead of blocking it
+    if (!listenerNonBlocking)
+    {
+        listenerNonBlocking = setNonBlocking(true);
+    }
+
+    size_t taken = 0;
+    while (taken < maxClients)
+    {
+        AcceptedClient client;
+        client.peerLength = sizeof(client.peer);
+        sockaddr *peer = withPeers ? (sockaddr*)&client.peer : NULL;
+        socklen_t *peerLength = withPeers ? &client.peerLength : NULL;
+
+        #if defined(__linux__)
+        client.socket = accept4(socketId, peer, peerLength, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        #else
+        client.socket = accept(socketId, peer, peerLength);
+        #endif
+
+        if (client.socket == -1)
+        {
+            #ifdef _WIN32
+            int error = WSAGetLastError();
+            if (error == WSAECONNRESET)
+            {
+                continue;
+            }
+            #else
+            //the client gave up before we got to it, the next one may still be waiting
+            if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO)
+            {
+                continue;
+            }
+            #endif
+
+            //EAGAIN means the queue is empty. Anything else (out of fds) is left for the next
+            //wakeup, the connections stay queued until then
+            break;
+        }
+
+        #ifdef _WIN32
+        u_long mode = 1;
+        ioctlsocket(client.socket, FIONBIO, &mode);
+        #endif
+
+        if (!withPeers)
+        {
+            client.peerLength = 0;
+        }
+        clients.push_back(client);
+        taken++;
+    }
+
+    acceptedCount += taken;
+    if (taken > 0)
+    {
+        acceptDrains++;
+    }
+    return taken;
+}
+
+inline bool Server::setBacklog(int backlog)
+{
+    //listen() on a listening socket only updates its backlog
+    return listen(socketId, backlog) == 0;
+}
+
+inline Server::AcceptStats Server::getAcceptStats()
+{
+    AcceptStats stats = {acceptedCount, acceptDrains, 0, 0, 0, 0};
+
+    #if defined(__linux__)
+    //for a listening socket the kernel reports the queue length as unacked and the limit as sacked
+    tcp_info info;
+    socklen_t infoLength = sizeof(info);
+    if (getsockopt(socketId, IPPROTO_TCP, TCP_INFO, &info, &infoLength) == 0)
+    {
+        stats.queued = info.tcpi_unacked;
+        stats.backlog = info.tcpi_sacked;
+    }
+
+    //the overflow counters only exist system wide, as a line of names followed by a line of values
+    FILE *netstat = fopen("/proc/net/netstat", "r");
+    if (netstat != NULL)
+    {
+        char *line = NULL;
+        size_t lineLength = 0;
+        std::string names;
+
+        while (getline(&line, &lineLength, netstat) != -1)
+        {
+            if (strncmp(line, "TcpExt:", 7) != 0)
+            {
+                continue;
+            }
+            if (names.empty())
+            {
+                names = line;
+                continue;
+            }
+
+            //walk both lines in step
+            char *nameSave, *valueSave;
+            char *name = strtok_r(names.data(), " \n", &nameSave);
+            char *value = strtok_r(line, " \n", &valueSave);
+            while (name != NULL && value != NULL)
+            {
+                if (strcmp(name, "ListenOverflows") == 0)
+                {
+                    stats.listenOverflows = strtoull(value, NULL, 10);
+                }
+                else if (strcmp(name, "ListenDrops") == 0)
+                {
+                    stats.listenDrops = strtoull(value, NULL, 10);
+                }
+                name = strtok_r(NULL, " \n", &nameSave);
+                value = strtok_r(NULL, " \n", &valueSave);
+            }
+            break;
+        }
+        free(line);
+        fclose(netstat);
+    }
+    #endif
+
+    return stats;
+}
+
+/************************************************************************
+ * Connection table (accepted sockets pooled and indexed by fd)
+ ************************************************************************/
+
+//owns the Sockets of a server's clients. Finding one by fd is a single index into a flat array
+//that only holds what every event needs (the Socket and its id). The Sockets themselves and the
+//rarely used fields live in a pool of slots that is allocated up front and recycled through a
+//free list, so accepting, finding and closing clients allocates nothing once the pool is warm.
+//
+//Every connection gets an id that is never reused, which tells a connection apart from a newer
+//one that got the same fd or slot. A client may also be given a unique name (e.g. a username)
+//and found by it without a search. Not thread safe, it belongs to one event loop
+class ConnectionTable {
+public:
+    //slots for expectedConnections clients are allocated up front, the pool grows past that if needed
+    explicit ConnectionTable(size_t expectedConnections = DEFAULT_CONNECTION_POOL)
+    {
+        growPool(std::max<size_t>(expectedConnections, 1));
+    }
+
+    //closes every connection still in the table
+    ~ConnectionTable()
+    {
+        clear();
+    }
+
+    ConnectionTable(const ConnectionTable&) = delete;
+    ConnectionTable& operator=(const ConnectionTable&) = delete;
+
+    //wraps an accepted fd in a pooled Socket, NULL if the fd is in the table already. The
+    //Socket constructor runs the handshake unless it is deferred (see Socket::continueHandshake()),
+    //if it throws the fd is not added
+    Socket *add(int fd, bool autoPrint = false, bool deferHandshake = false);
+
+    //destroys the connection's Socket, which closes the fd, and recycles its slot. Returns false
+    //if fd is not in the table
+    bool remove(int fd);
+    void clear();
+
+    Socket *find(int fd)
+    {
+        return (fd >= 0 && (size_t)fd < byFd.size()) ? byFd[fd].socket : NULL;
+    }
+
+    //the connection with this fd and id, NULL if it has been removed since
+    Socket *find(int fd, uint64_t id);
+
+    //id of the connection using fd, 0 if there is none
+    uint64_t getId(int fd);
+
+    //returns false if fd is not in the table or another connection has the name already.
+    //An empty name removes the connection's name
+    bool setName(int fd, std::string_view name);
+    std::string_view getName(int fd);
+    Socket *findByName(std::string_view name);
+
+    size_t size()
+    {
+        return live.size();
+    }
+
+    //calls visitor with every connection in the table, in no particular order. The visitor may
+    //remove the connection it was given but no other one
+    template <class Visitor>
+    void forEach(Visitor &&visitor)
+    {
+        for (size_t i = live.size(); i-- > 0;)
+        {
+            visitor(*slots[live[i]].socket);
+        }
+    }
+
+private:
+    //hot, indexed by fd and touched on every event
+    struct Entry {
+        Socket *socket = NULL;
+        uint64_t id = 0;
+        uint32_t slot = 0;
+    };
+
+    //cold, only touched when connections come, go or are looked up by name
+    struct Slot {
+        std::optional<Socket> socket;   //the Socket lives right in the slot
+        int fd = -1;
+        std::string name;
+        uint32_t livePosition = 0;  //index in live
+    };
+
+    std::vector<Entry> byFd;            //grows with the highest fd seen
+    std::deque<Slot> slots;             //a deque so sockets keep their address when the pool grows
+    std::vector<uint32_t> freeSlots;
+    std::vector<uint32_t> live;         //slots in use, for forEach()
+    uint64_t nextId = 1;
+
+    //open addressing hash of the named slots, each entry is a slot + 1 and 0 marks a free spot.
+    //Kept at most half full so probes stay short, it is resized along with the pool
+    std::vector<uint32_t> names;
+
+    void growPool(size_t count);
+    size_t findNamePosition(std::string_view name);
+    void removeName(uint32_t slot);
+};
+
+inline Socket *ConnectionTable::add(int fd, bool autoPrint, bool deferHandshake)
+{
+    if (fd < 0 || find(fd) != NULL)
+    {
+        return NULL;
+    }
+
+    if (freeSlots.empty())
+    {
+        growPool(slots.size());
+    }
+    if ((size_t)fd >= byFd.size())
+    {
+        byFd.resize(std::max<size_t>(fd + 1, byFd.size() * 2));
+    }
+
+    //the slot is only taken once the Socket has been made
+    uint32_t slot = freeSlots.back();
+    Slot &cold = slots[slot];
+    cold.socket.emplace(fd, autoPrint, deferHandshake);
+    freeSlots.pop_back();
+
+    cold.fd = fd;
+    cold.livePosition = (uint32_t)live.size();
+    live.push_back(slot);
+
+    byFd[fd] = {&*cold.socket, nextId++, slot};
+    return &*cold.socket;
+}
+
+inline bool ConnectionTable::remove(int fd)
+{
+    if (find(fd) == NULL)
+    {
+        return false;
+    }
+
+    Entry &entry = byFd[fd];
+    Slot &cold = slots[entry.slot];
+
+    removeName(entry.slot);
+
+    //swap the last live slot into the gap
+    uint32_t moved = live.back();
+    live[cold.livePosition] = moved;
+    slots[moved].livePosition = cold.livePosition;
+    live.pop_back();
+
+    cold.socket.reset();
+    freeSlots.push_back(entry.slot);
+    entry = Entry();
+    return true;
+}
+
+inline void ConnectionTable::clear()
+{
+    while (!live.empty())
+    {
+        remove(slots[live.back()].fd);
+    }
+}
+
+inline Socket *ConnectionTable::find(int fd, uint64_t id)
+{
+    if (id == 0 || getId(fd) != id)
+    {
+        return NULL;
+    }
+    return byFd[fd].socket;
+}
+
+inline uint64_t ConnectionTable::getId(int fd)
+{
+    return find(fd) != NULL ? byFd[fd].id : 0;
+}
+
+inline bool ConnectionTable::setName(int fd, std::string_view name)
+{
+    if (find(fd) == NULL)
+    {
+        return false;
+    }
+
+    uint32_t slot = byFd[fd].slot;
+    if (slots[slot].name == name)
+    {
+        return true;
+    }
+    if (findByName(name) != NULL)
+    {
+        return false;
+    }
+
+    removeName(slot);
+    if (!name.empty())
+    {
+        slots[slot].name.assign(name);
+        names[findNamePosition(name)] = slot + 1;
+    }
+    return true;
+}
+
+inline std::string_view ConnectionTable::getName(int fd)
+{
+    return find(fd) != NULL ? std::string_view(slots[byFd[fd].slot].name) : std::string_view();
+}
+
+inline Socket *ConnectionTable::findByName(std::string_view name)
+{
+    if (name.empty())
+    {
+        return NULL;
+    }
+
+    uint32_t entry = names[findNamePosition(name)];
+    return entry != 0 ? &*slots[entry - 1].socket : NULL;
+}
+
+inline void ConnectionTable::growPool(size_t count)
+{
+    size_t first = slots.size();
+    slots.resize(first + count);
+    freeSlots.reserve(slots.size());
+    live.reserve(slots.size());
+
+    //hand out the lowest slots first
+    for (size_t slot = slots.size(); slot-- > first;)
+    {
+        freeSlots.push_back((uint32_t)slot);
+    }
+
+    //rehash the names into a table at least twice the size of the pool
+    size_t capacity = 16;
+    while (capacity < slots.size() * 2)
+    {
+        capacity *= 2;
+    }
+    if (capacity != names.size())
+    {
+        names.assign(capacity, 0);
+        for (uint32_t slot : live)
+        {
+            if (!slots[slot].name.empty())
+            {
+                names[findNamePosition(slots[slot].name)] = slot + 1;
+            }
+        }
+    }
+}
+
+//position of the name in names, or of the free spot where it would go
+inline size_t ConnectionTable::findNamePosition(std::string_view name)
+{
+    size_t mask = names.size() - 1;
+    size_t position = std::hash<std::string_view>()(name) & mask;
+
+    while (names[position] != 0 && slots[names[position] - 1].name != name)
+    {
+        position = (position + 1) & mask;
+    }
+    return position;
+}
+
+inline void ConnectionTable::removeName(uint32_t slot)
+{
+    std::string &name = slots[slot].name;
+    if (name.empty())
+    {
+        return;
+    }
+
+    size_t mask = names.size() - 1;
+    size_t position = findNamePosition(name);
+    name.clear();
+
+    //close the gap by moving back entries that probed past it (backward shift deletion), so
+    //lookups never need tombstones
+    size_t next = (position + 1) & mask;
+    while (names[next] != 0)
+    {
+        size_t home = std::hash<std::string_view>()(slots[names[next] - 1].name) & mask;
+        if (((next - home) & mask) >= ((next - position) & mask))
+        {
+            names[position] = names[next];
+            position = next;
+        }
+        next = (next + 1) & mask;
+    }
+    names[position] = 0;
+}
+
+/************************************************************************
+ * Event Manager Classes (Can be declared and used alongside server to create
+ * an event based server)
+ ************************************************************************/
+
+#if EVENT_BASED && defined(__linux__)
+
+/************************************************************************
+ * Epoll implementation
+ ************************************************************************/
+
+class EpollEventManager {
+
+public:
+    static constexpr EventBackend backend = BACKEND_EPOLL;
+
+    //declare vars
+    struct epoll_event newConnectionEvent;
+    struct epoll_event *events;
+    int epollFD;
+    int serverSocket;
+    int pendingEvents;
+    int eventBatchSize;
+    bool edgeTriggered;
+    bool oneShot;
+
+    //wait for event and return the type of event that occurred   
+    int waitForEvent();
+
+    //wait for events and return every ready fd at once (at most eventBatchSize). The span stays
+    //valid until the next wait, an empty span means the timeout expired or the wait failed
+    std::span<const ReadyEvent> waitForEvents(int timeoutMs = -1);
 
     //creates a new epoll instance for monitoring client socket for events
     void monitorClient(int clientSocket);
     void stopMonitoring(int clientSocket);
 
-    //default constructor initializes the epoll instance and events struct
-    //the server socket will be monitored for incoming events, i.e. connection requests
-    //and messages from client
-    EventManager(int socket, int maxConnections)
-    {
-        serverSocket = socket;
+    //changes what a monitored client is watched for, POLLIN (the default), POLLOUT or both.
+    //Errors and hangups are always reported, pause a client with stopMonitoring() instead of 0
+    void setInterest(int clientSocket, uint32_t events);
+
+    //clients monitored after turning this on are made non-blocking and reported edge triggered
+    //(EPOLLET, plus EPOLLRDHUP when the peer closes its side). A client then only shows up again
+    //once new data arrives, so every event must be handled with Socket::receiveAvailable()
+    //followed by getString()/getBytes() while Socket::hasBufferedMessage() is true
+    void setEdgeTriggered(bool enabled);
+
+    //reports an edge triggered client again if it is still readable, for data that was left in
+    //the kernel on purpose (see Socket::moreToReceive()). Level triggered clients need nothing
+    void requeue(int clientSocket);
+
+    //lets several threads wait on this epoll set at once (see LeaderFollowerServer). Clients
+    //monitored afterwards are one shot: once reported they stay quiet until rearm(), so only one
+    //thread handles a client at a time. The listener is re-added with EPOLLEXCLUSIVE and made
+    //non-blocking, a thread that loses the race for a connection gets EAGAIN instead of blocking
+    void shareBetweenThreads();
+    void rearm(int clientSocket);
+
+    //thread safe waitForEvents() for shared sets, every thread passes its own buffer. Nothing is
+    //flushed, corked sockets must be flushed by the thread handling them
+    std::span<const ReadyEvent> waitForEvents(std::span<ReadyEvent> buffer, int timeoutMs = -1);
+
+    //default constructor initializes the epoll instance and events struct
+    //the server socket will be monitored for incoming events, i.e. connection requests
+    //and messages from client
+    EpollEventManager(int socket, int maxConnections, int batchSize = DEFAULT_EVENT_BATCH)
+    {
+        serverSocket = socket;
+        eventBatchSize = batchSize;
+        edgeTriggered = false;
+        oneShot = false;
+
+        //init an epoll instance which has a queue NUM_CONNECTIONS long
+        epollFD = epoll_create(maxConnections);
+        if (epollFD == -1)
+        {
+            throw std::runtime_error("Error creating epoll instance");
+        }
+        
+        // Set the file descriptor to monitor
+        newConnectionEvent.data.fd = serverSocket;
+
+        // Specify the event(s) to monitor for
+        newConnectionEvent.events = EPOLLIN; 
+
+        // Add the server socket to the epoll instance
+        epoll_ctl(epollFD, EPOLL_CTL_ADD, serverSocket, &newConnectionEvent);
+        
+        // Allocate memory for an array of epoll events to store event notifications
+        events = (epoll_event*)malloc(eventBatchSize*sizeof(struct epoll_event));
+        readyEvents.reserve(eventBatchSize);
+    }
+
+    //destructor
+    ~EpollEventManager()
+    {
+        // Close the epoll instance
+        close(epollFD);
+
+        // Free the memory allocated for the events array
+        free(events);
+    }
+
+    //owns the epoll instance and the events array
+    EpollEventManager(const EpollEventManager&) = delete;
+    EpollEventManager& operator=(const EpollEventManager&) = delete;
+
+private:
+    //result of the last wait, waitForEvent() hands it out one fd at a time
+    std::vector<ReadyEvent> readyEvents;
+    size_t nextEvent = 0;
+
+    //what every client is watched for (see setInterest()), indexed by fd. epoll_ctl needs it to re-arm.
+    //Threads sharing the set monitor and rearm clients at the same time, so the vector is only
+    //touched with interestsLock held (interestOf() may grow it)
+    std::vector<uint32_t> interests;
+    std::mutex interestsLock;
+
+    uint32_t &interestOf(int fd)
+    {
+        if ((size_t)fd >= interests.size())
+        {
+            interests.resize(fd * 2 + 1, EPOLLIN);
+        }
+        return interests[fd];
+    }
+};
+
+inline std::span<const ReadyEvent> EpollEventManager::waitForEvents(int timeoutMs)
+{
+    readyEvents.clear();
+    nextEvent = 0;
+
+    pendingEvents = epoll_wait(epollFD, events, eventBatchSize, timeoutMs);
+
+    for (int i = 0; i < pendingEvents; i++)
+    {
+        //report connection requests as CONN_ATTEMPT, everything else by its client socket
+        int fd = (events[i].data.fd == serverSocket) ? CONN_ATTEMPT : events[i].data.fd;
+        readyEvents.push_back({fd, events[i].events});
+    }
+
+    return readyEvents;
+}
+
+inline int EpollEventManager::waitForEvent()
+{
+    //hand out the rest of the last wait before asking the kernel again
+    while (nextEvent < readyEvents.size())
+    {
+        const ReadyEvent &event = readyEvents[nextEvent++];
+        if (event.events != 0)
+        {
+            return event.fd;
+        }
+    }
+
+    if (waitForEvents().empty())
+    {
+        return -1;
+    }
+    return readyEvents[nextEvent++].fd;
+}
+
+inline void EpollEventManager::monitorClient(int clientSocket)
+{
+    // Create an epoll event structure for the client socket
+    struct epoll_event event;
+    event.data.fd = clientSocket; // Associate the client socket with the event struct
+    event.events = EPOLLIN; //Monitor for incoming data from client
+
+    // Edge triggered clients must never block a read, they are drained until EAGAIN instead
+    if (edgeTriggered)
+    {
+        fcntl(clientSocket, F_SETFL, fcntl(clientSocket, F_GETFL, 0) | O_NONBLOCK);
+        event.events |= EPOLLET | EPOLLRDHUP;
+    }
+
+    // In a shared set a client is reported to one thread and then waits for rearm()
+    if (oneShot)
+    {
+        event.events |= EPOLLONESHOT | EPOLLRDHUP;
+    }
+
+    // Known before the first report, a thread handling it may rearm it right away
+    {
+        std::lock_guard<std::mutex> guard(interestsLock);
+        interestOf(clientSocket) = EPOLLIN;
+    }
+
+    // Add the client socket to the epoll instance to begin monitoring
+    epoll_ctl(epollFD, EPOLL_CTL_ADD, clientSocket, &event);
+}
+
+inline void EpollEventManager::stopMonitoring(int clientSocket)
+{
+    //remove the client socket from epoll monitoring
+    epoll_ctl(epollFD, EPOLL_CTL_DEL, clientSocket, NULL);
+
+    //the last wait may still report the socket, its fd number could be reused before that entry is handled
+    for (ReadyEvent &event : readyEvents)
+    {
+        if (event.fd == clientSocket)
+        {
+            event.events = 0;
+        }
+    }
+}
+
+inline void EpollEventManager::setInterest(int clientSocket, uint32_t events)
+{
+    struct epoll_event event;
+    event.data.fd = clientSocket;
+    event.events = events & (EPOLLIN | EPOLLOUT);
+
+    // Keep the mode the client was monitored with
+    if (edgeTriggered)
+    {
+        event.events |= EPOLLET | EPOLLRDHUP;
+    }
+    if (oneShot)
+    {
+        event.events |= EPOLLONESHOT | EPOLLRDHUP;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(interestsLock);
+        interestOf(clientSocket) = events & (EPOLLIN | EPOLLOUT);
+    }
+    epoll_ctl(epollFD, EPOLL_CTL_MOD, clientSocket, &event);
+}
+
+inline void EpollEventManager::setEdgeTriggered(bool enabled)
+{
+    edgeTriggered = enabled;
+}
+
+//modifying an edge triggered fd makes epoll check it again, so it shows up in the next wait if it is still ready
+inline void EpollEventManager::requeue(int clientSocket)
+{
+    if (edgeTriggered)
+    {
+        uint32_t events;
+        {
+            std::lock_guard<std::mutex> guard(interestsLock);
+            events = interestOf(clientSocket);
+        }
+        setInterest(clientSocket, events);
+    }
+}
+
+inline void EpollEventManager::shareBetweenThreads()
+{
+    oneShot = true;
+
+    // EPOLLEXCLUSIVE can only be given when a fd is added, so add the listener again
+    fcntl(serverSocket, F_SETFL, fcntl(serverSocket, F_GETFL, 0) | O_NONBLOCK);
+    epoll_ctl(epollFD, EPOLL_CTL_DEL, serverSocket, NULL);
+    newConnectionEvent.events = EPOLLIN | EPOLLEXCLUSIVE;
+    epoll_ctl(epollFD, EPOLL_CTL_ADD, serverSocket, &newConnectionEvent);
+}
+
+//a one shot client was handled, report it again once it has something new. It keeps what it is
+//watched for (see setInterest())
+inline void EpollEventManager::rearm(int clientSocket)
+{
+    struct epoll_event event;
+    event.data.fd = clientSocket;
+    {
+        std::lock_guard<std::mutex> guard(interestsLock);
+        event.events = interestOf(clientSocket);
+    }
+    event.events |= EPOLLONESHOT | EPOLLRDHUP;
+    if (edgeTriggered)
+    {
+        event.events |= EPOLLET;
+    }
+
+    epoll_ctl(epollFD, EPOLL_CTL_MOD, clientSocket, &event);
+}
+
+inline std::span<const ReadyEvent> EpollEventManager::waitForEvents(std::span<ReadyEvent> buffer, int timeoutMs)
+{
+    //stack space for the kernel's results, a thread that wants more has to wait again
+    epoll_event kernelEvents[64];
+    int maxEvents = (int)std::min<size_t>(buffer.size(), 64);
+
+    int count = epoll_wait(epollFD, kernelEvents, maxEvents, timeoutMs);
+    for (int i = 0; i < count; i++)
+    {
+        int fd = (kernelEvents[i].data.fd == serverSocket) ? CONN_ATTEMPT : kernelEvents[i].data.fd;
+        buffer[i] = {fd, kernelEvents[i].events};
+    }
+
+    return buffer.first(std::max(count, 0));
+}
+
+/************************************************************************
+ * poll implementation (epoll is more efficient, consider using that)
+ ************************************************************************/
+
+class PollEventManager {
+public:
+    static constexpr EventBackend backend = BACKEND_POLL;
+
+    //declare vars
+    int serverSocket;
+    std::vector<pollfd> pollFds; // Vector to store pollfd structures for each socket
+    int eventBatchSize;
+
+    //wait for event and return the type of event that occurred   
+    int waitForEvent();
+
+    //wait for events and return every ready fd at once (at most eventBatchSize). The span stays
+    //valid until the next wait, an empty span means the timeout expired or the wait failed
+    std::span<const ReadyEvent> waitForEvents(int timeoutMs = -1);
+
+    //creates a new pollfd structure for monitoring client socket for events
+    void monitorClient(int clientSocket);
+    void stopMonitoring(int clientSocket);
+
+    //changes what a monitored client is watched for, POLLIN (the default), POLLOUT or both
+    void setInterest(int clientSocket, uint32_t events);
+
+    //default constructor initializes the pollfds vector
+    //the server socket will be monitored for incoming events, i.e. connection requests
+    //and messages from client
+    PollEventManager(int socket, int maxConnections, int batchSize = DEFAULT_EVENT_BATCH)
+    {
+        serverSocket = socket;
+        eventBatchSize = batchSize;
+        readyEvents.reserve(eventBatchSize);
+        pollFds.reserve(maxConnections + 1);
+
+        // Add the server socket to the pollfds vector
+        pollfd serverPollFd;
+        serverPollFd.fd = serverSocket;
+        serverPollFd.events = POLLIN; // Monitor for incoming data
+        pollFds.push_back(serverPollFd);
+        slotOf(serverSocket) = 0;
+    }
+
+private:
+    //result of the last wait, waitForEvent() hands it out one fd at a time
+    std::vector<ReadyEvent> readyEvents;
+    size_t nextEvent = 0;
+
+    //index of every monitored fd in pollFds (-1 if not monitored), so removing one is O(1)
+    std::vector<int> slots;
+    //where the next scan starts, a batch that filled up continues from here next time
+    size_t scanStart = 0;
+
+    int &slotOf(int fd)
+    {
+        if ((size_t)fd >= slots.size())
+        {
+            slots.resize(fd * 2 + 1, -1);
+        }
+        return slots[fd];
+    }
+};
+
+inline std::span<const ReadyEvent> PollEventManager::waitForEvents(int timeoutMs)
+{
+    readyEvents.clear();
+    nextEvent = 0;
+
+    // Call poll to wait for events
+    int readyFds = poll(pollFds.data(), pollFds.size(), timeoutMs);
+    if (readyFds > 0) {
+        size_t count = pollFds.size();
+        size_t i = 0;
+
+        // Collect every file descriptor that has an event (hangups and errors included). poll
+        // told us how many there are, so stop as soon as all of them have been found
+        for (; i < count && readyFds > 0 && (int)readyEvents.size() < eventBatchSize; ++i) {
+            pollfd &entry = pollFds[(scanStart + i) % count];
+            if (entry.revents != 0) {
+                // Report the server socket as a connection request
+                int fd = (entry.fd == serverSocket) ? CONN_ATTEMPT : entry.fd;
+                readyEvents.push_back({fd, (uint32_t)entry.revents});
+                readyFds--;
+            }
+        }
+
+        // The batch filled up before every ready fd was seen, start with the rest next time
+        scanStart = (readyFds > 0) ? (scanStart + i) % count : 0;
+    }
+    return readyEvents;
+}
+
+inline int PollEventManager::waitForEvent()
+{
+    //hand out the rest of the last wait before asking the kernel again
+    while (nextEvent < readyEvents.size())
+    {
+        const ReadyEvent &event = readyEvents[nextEvent++];
+        if (event.events != 0)
+        {
+            return event.fd;
+        }
+    }
+
+    if (waitForEvents().empty())
+    {
+        return -1; // No event occurred or error
+    }
+    return readyEvents[nextEvent++].fd;
+}
+
+inline void PollEventManager::monitorClient(int clientSocket)
+{
+    // Already monitored
+    if (slotOf(clientSocket) != -1) {
+        return;
+    }
+
+    // Create a new pollfd structure for the client socket
+    pollfd clientPollFd;
+    clientPollFd.fd = clientSocket;
+    clientPollFd.events = POLLIN; // Monitor for incoming data
+    clientPollFd.revents = 0;
+    slotOf(clientSocket) = pollFds.size();
+    pollFds.push_back(clientPollFd);
+}
+
+inline void PollEventManager::stopMonitoring(int clientSocket)
+{
+    int slot = slotOf(clientSocket);
+
+    // Remove the client's pollfd by moving the last one into its place
+    if (slot != -1) {
+        pollFds[slot] = pollFds.back();
+        slotOf(pollFds[slot].fd) = slot;
+        pollFds.pop_back();
+        slotOf(clientSocket) = -1;
+    }
+
+    //the last wait may still report the socket, its fd number could be reused before that entry is handled
+    for (ReadyEvent &event : readyEvents) {
+        if (event.fd == clientSocket) {
+            event.events = 0;
+        }
+    }
+}
+
+inline void PollEventManager::setInterest(int clientSocket, uint32_t events)
+{
+    int slot = slotOf(clientSocket);
+    if (slot != -1) {
+        pollFds[slot].events = events & (POLLIN | POLLOUT);
+    }
+}
+
+/************************************************************************
+ * select implementation (archaic and outdated. Only use on legacy systems)
+ ************************************************************************/
+
+class SelectEventManager {
+public:
+    static constexpr EventBackend backend = BACKEND_SELECT;
+
+    int serverSocket;
+    int max_fd;
+    fd_set readfds;             //filled in by select(), a copy of monitoredFds before every wait
+    fd_set monitoredFds;        //every fd being watched, kept up to date by monitorClient()/stopMonitoring()
+    fd_set writefds;            //like readfds, for clients watched for POLLOUT
+    fd_set monitoredWriteFds;   //clients watched for POLLOUT (see setInterest())
+    std::vector<int> clientSockets;
+    int eventBatchSize;
+
+    SelectEventManager(int socket, int maxConnections, int batchSize = DEFAULT_EVENT_BATCH)
+    : serverSocket(socket), max_fd(socket), eventBatchSize(batchSize)
+    {
+        FD_ZERO(&readfds);
+        FD_ZERO(&monitoredFds);
+        FD_ZERO(&writefds);
+        FD_ZERO(&monitoredWriteFds);
+        FD_SET(serverSocket, &monitoredFds);
+        std::fill(slots, slots + FD_SETSIZE, -1);
+        readyEvents.reserve(eventBatchSize);
+        clientSockets.reserve(maxConnections);
+    }
+
+    // Wait for events on server and client sockets and return every ready fd at once (at most
+    // eventBatchSize). The span stays valid until the next wait, an empty span means the
+    // timeout expired or the wait failed
+    std::span<const ReadyEvent> waitForEvents(int timeoutMs = -1) {
+    readyEvents.clear();
+    nextEvent = 0;
+
+    // select() overwrites the sets it is given, so hand it copies of the monitored ones
+    readfds = monitoredFds;
+    writefds = monitoredWriteFds;
+
+    timeval timeout;
+    timeout.tv_sec = timeoutMs / 1000;
+    timeout.tv_usec = (timeoutMs % 1000) * 1000;
+
+    int result = select(max_fd + 1, &readfds, &writefds, NULL, timeoutMs < 0 ? NULL : &timeout);
+    if (result == -1) {
+        std::cerr << "Error in select" << std::endl;
+        return readyEvents;
+    }
+
+    // Check if server socket has an event
+    if (result > 0 && FD_ISSET(serverSocket, &readfds)) {
+        readyEvents.push_back({CONN_ATTEMPT, POLLIN});
+        result--;
+    }
+
+    // Collect every client socket with an event, select told us how many there are (counting
+    // each set an fd is in) so stop as soon as all of them have been found
+    size_t count = clientSockets.size();
+    size_t i = 0;
+    for (; i < count && result > 0 && (int)readyEvents.size() < eventBatchSize; i++) {
+        int clientSocket = clientSockets[(scanStart + i) % count];
+        uint32_t events = 0;
+        if (FD_ISSET(clientSocket, &readfds)) {
+            events |= POLLIN;
+            result--;
+        }
+        if (FD_ISSET(clientSocket, &writefds)) {
+            events |= POLLOUT;
+            result--;
+        }
+        if (events != 0) {
+            readyEvents.push_back({clientSocket, events});
+        }
+    }
+
+    // The batch filled up before every ready fd was seen, start with the rest next time
+    scanStart = (result > 0 && count > 0) ? (scanStart + i) % count : 0;
+    return readyEvents;
+}
+
+    // Wait for an event and return the socket it occurred on
+    int waitForEvent() {
+    // Hand out the rest of the last wait before asking the kernel again
+    while (nextEvent < readyEvents.size()) {
+        const ReadyEvent &event = readyEvents[nextEvent++];
+        if (event.events != 0) {
+            return event.fd;
+        }
+    }
+
+    if (waitForEvents().empty()) {
+        return -1;
+    }
+    return readyEvents[nextEvent++].fd;
+}
+
+    void monitorClient(int clientSocket) {
+    // select can only watch fds below FD_SETSIZE
+    if (clientSocket >= FD_SETSIZE) {
+        std::cerr << "Error: select cannot monitor socket " << clientSocket << ", use another backend" << std::endl;
+        return;
+    }
+
+    // Already monitored
+    if (slots[clientSocket] != -1) {
+        return;
+    }
+
+    // Add the client socket to the list of monitored sockets
+    slots[clientSocket] = clientSockets.size();
+    clientSockets.push_back(clientSocket);
+
+    // Add the new client socket to the set of file descriptors to monitor
+    FD_SET(clientSocket, &monitoredFds);
+
+    // Update max_fd if necessary
+    if (clientSocket > max_fd) {
+        max_fd = clientSocket;
+    }
+}
+
+    void stopMonitoring(int clientSocket) {
+        if (clientSocket < 0 || clientSocket >= FD_SETSIZE || slots[clientSocket] == -1) {
+            return;
+        }
+
+        // Remove the client from the list by moving the last one into its place
+        int slot = slots[clientSocket];
+        clientSockets[slot] = clientSockets.back();
+        slots[clientSockets[slot]] = slot;
+        clientSockets.pop_back();
+        slots[clientSocket] = -1;
+
+        // A closed fd left in the sets would make every select() fail
+        FD_CLR(clientSocket, &monitoredFds);
+        FD_CLR(clientSocket, &monitoredWriteFds);
+        while (max_fd > serverSocket && !FD_ISSET(max_fd, &monitoredFds) && !FD_ISSET(max_fd, &monitoredWriteFds)) {
+            max_fd--;
+        }
+
+        // The last wait may still report the socket, its fd number could be reused before that entry is handled
+        for (ReadyEvent &event : readyEvents) {
+            if (event.fd == clientSocket) {
+                event.events = 0;
+            }
+        }
+    }
+
+    // Change what a monitored client is watched for, POLLIN (the default), POLLOUT or both
+    void setInterest(int clientSocket, uint32_t events) {
+        if (clientSocket < 0 || clientSocket >= FD_SETSIZE || slots[clientSocket] == -1) {
+            return;
+        }
+
+        if (events & POLLIN) {
+            FD_SET(clientSocket, &monitoredFds);
+        } else {
+            FD_CLR(clientSocket, &monitoredFds);
+        }
+        if (events & POLLOUT) {
+            FD_SET(clientSocket, &monitoredWriteFds);
+        } else {
+            FD_CLR(clientSocket, &monitoredWriteFds);
+        }
+    }
+
+private:
+    //result of the last wait, waitForEvent() hands it out one fd at a time
+    std::vector<ReadyEvent> readyEvents;
+    size_t nextEvent = 0;
+
+    //index of every monitored client in clientSockets (-1 if not monitored), so removing one is O(1)
+    int slots[FD_SETSIZE];
+    //where the next scan starts, a batch that filled up continues from here next time
+    size_t scanStart = 0;
+};
+
+/************************************************************************
+ * io_uring implementation (completion based, fewest syscalls per event)
+ ************************************************************************/
+
+#if HAS_IO_URING
+
+//minimal io_uring wrapper built directly on the kernel interface, so no liburing is needed.
+//Only the reactor thread may touch it
+class IoUring {
+public:
+    int ringFd;
+
+    IoUring(unsigned entries)
+    {
+        io_uring_params params;
+
+        //single issuer lets the kernel skip locking, older kernels reject the flag so retry without it
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_SINGLE_ISSUER;
+        ringFd = syscall(__NR_io_uring_setup, entries, &params);
+        if (ringFd < 0 && errno == EINVAL)
+        {
+            memset(&params, 0, sizeof(params));
+            ringFd = syscall(__NR_io_uring_setup, entries, &params);
+        }
+        if (ringFd < 0)
+        {
+            throw std::runtime_error("io_uring_setup failed");
+        }
+
+        //map the submission and completion rings (one mapping on kernels that share it)
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+        {
+            sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        }
+
+        sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        cqRing = (params.features & IORING_FEAT_SINGLE_MMAP) ? sqRing :
+                 mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        sqeCount = params.sq_entries;
+        sqes = (io_uring_sqe*)mmap(NULL, sqeCount * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED)
+        {
+            //the mappings that worked keep the ring alive, they go before the fd
+            if (sqes != MAP_FAILED)
+            {
+                munmap(sqes, sqeCount * sizeof(io_uring_sqe));
+            }
+            if (cqRing != MAP_FAILED && cqRing != sqRing)
+            {
+                munmap(cqRing, cqRingSize);
+            }
+            if (sqRing != MAP_FAILED)
+            {
+                munmap(sqRing, sqRingSize);
+            }
+            close(ringFd);
+            throw std::runtime_error("io_uring mmap failed");
+        }
+
+        char *sq = (char*)sqRing;
+        char *cq = (char*)cqRing;
+        sqHead = (unsigned*)(sq + params.sq_off.head);
+        sqTail = (unsigned*)(sq + params.sq_off.tail);
+        sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+        sqArray = (unsigned*)(sq + params.sq_off.array);
+        cqHead = (unsigned*)(cq + params.cq_off.head);
+        cqTail = (unsigned*)(cq + params.cq_off.tail);
+        cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+        sqLocalTail = *sqTail;
+    }
+
+    ~IoUring()
+    {
+        munmap(sqes, sqeCount * sizeof(io_uring_sqe));
+        if (cqRing != sqRing)
+        {
+            munmap(cqRing, cqRingSize);
+        }
+        munmap(sqRing, sqRingSize);
+        close(ringFd);
+    }
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    //returns a cleared submission entry. Entries are only handed to the kernel by submit(), so
+    //everything prepared during one loop iteration goes out with a single syscall
+    io_uring_sqe *getSqe()
+    {
+        //ring is full, push what we have to the kernel first
+        if (sqLocalTail - std::atomic_ref<unsigned>(*sqHead).load(std::memory_order_acquire) >= sqeCount)
+        {
+            submit(0);
+        }
+
+        unsigned index = sqLocalTail & sqMask;
+        io_uring_sqe *sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqArray[index] = index;
+        sqLocalTail++;
+        return sqe;
+    }
+
+    //hands every prepared entry to the kernel and optionally waits for waitFor completions,
+    //giving up after timeoutMs (-1 waits forever, errno is ETIME then)
+    int submit(unsigned waitFor, int timeoutMs = -1)
+    {
+        int result;
+        __kernel_timespec timeout;
+        io_uring_getevents_arg waitArgs;
+
+        memset(&waitArgs, 0, sizeof(waitArgs));
+        timeout.tv_sec = timeoutMs / 1000;
+        timeout.tv_nsec = (long long)(timeoutMs % 1000) * 1000000;
+        waitArgs.ts = (uint64_t)&timeout;
+        bool timed = waitFor > 0 && timeoutMs >= 0;
+
+        std::atomic_ref<unsigned>(*sqTail).store(sqLocalTail, std::memory_order_release);
+        do
+        {
+            unsigned toSubmit = sqLocalTail - std::atomic_ref<unsigned>(*sqHead).load(std::memory_order_acquire);
+            if (toSubmit == 0 && waitFor == 0)
+            {
+                return 0;
+            }
+            result = syscall(__NR_io_uring_enter, ringFd, toSubmit, waitFor,
+                             (waitFor > 0 ? IORING_ENTER_GETEVENTS : 0) | (timed ? IORING_ENTER_EXT_ARG : 0),
+                             timed ? (void*)&waitArgs : NULL, timed ? sizeof(waitArgs) : 0);
+        } while (result < 0 && errno == EINTR);
+
+        return result;
+    }
+
+    //returns the next completion or NULL, call cqeSeen() once it has been handled
+    io_uring_cqe *peekCqe()
+    {
+        unsigned head = *cqHead;
+        if (head == std::atomic_ref<unsigned>(*cqTail).load(std::memory_order_acquire))
+        {
+            return NULL;
+        }
+        return &cqes[head & cqMask];
+    }
+
+    void cqeSeen()
+    {
+        std::atomic_ref<unsigned>(*cqHead).store(*cqHead + 1, std::memory_order_release);
+    }
+
+private:
+    void *sqRing;
+    void *cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    io_uring_sqe *sqes;
+    unsigned sqeCount;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqArray;
+    unsigned sqMask;
+    unsigned sqLocalTail;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    io_uring_cqe *cqes;
+};
+
+//kinds of completions returned by IoUringEventManager::waitForCompletions()
+enum CompletionType {
+    COMPLETION_ACCEPT,  //fd is a newly accepted client (result < 0 if accepting failed)
+    COMPLETION_RECV,    //data/result bytes arrived on fd, result 0 = peer closed, < 0 = error
+    COMPLETION_SEND     //everything queued for fd so far was sent (result < 0 if sending failed)
+};
+
+struct Completion {
+    CompletionType type;
+    int fd;
+    int result;
+    const char *data;   //received bytes, valid until the next waitForCompletions() call
+};
+
+class IoUringEventManager {
+public:
+    static constexpr EventBackend backend = BACKEND_IO_URING;
+
+    int serverSocket;
+
+    int eventBatchSize;
+
+    //readiness API, compatible with the other architectures. waitForEvents() returns every
+    //ready fd at once (at most eventBatchSize), the span stays valid until the next wait
+    int waitForEvent();
+    std::span<const ReadyEvent> waitForEvents(int timeoutMs = -1);
+    void monitorClient(int clientSocket);
+    void stopMonitoring(int clientSocket);
+
+    //changes what a monitored client is watched for, POLLIN (the default), POLLOUT or both.
+    //Errors and hangups are always reported, pause a client with stopMonitoring() instead of 0
+    void setInterest(int clientSocket, uint32_t events);
+
+    //completion API for new code. I/O is done by the kernel: accepts and receives are multishot
+    //(one request keeps producing completions) and received data lands in a ring of provided
+    //buffers, so nothing needs to be read after a wakeup. Sends are queued per connection and
+    //submitted together with the next wait. Data is raw bytes, there is no framing or encryption
+    void startAccepting();
+    void startReceiving(int clientSocket);
+    void queueSend(int clientSocket, std::span<const uint8_t> data);
+    std::span<const Completion> waitForCompletions();
+
+    //sets up the ring and the provided receive buffers. The server socket is watched for
+    //connection requests once waitForEvent() is first called. Throws if the kernel does not support io_uring
+    IoUringEventManager(int socket, int maxConnections, int batchSize = DEFAULT_EVENT_BATCH)
+    : serverSocket(socket), eventBatchSize(batchSize), ring(new IoUring(URING_ENTRIES))
+    {
+        //provided buffer ring: the kernel picks a free buffer for every multishot recv completion
+        bufferRingSize = URING_RECV_BUFFERS * sizeof(io_uring_buf);
+        bufferRing = (io_uring_buf_ring*)mmap(NULL, bufferRingSize, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (bufferRing == MAP_FAILED)
+        {
+            throw std::runtime_error("Failed to allocate io_uring buffer ring");
+        }
+        recvBuffers.resize((size_t)URING_RECV_BUFFERS * URING_RECV_BUFFER_LEN);
+
+        io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t)bufferRing;
+        reg.ring_entries = URING_RECV_BUFFERS;
+        reg.bgid = 0;
+        buffersRegistered = syscall(__NR_io_uring_register, ring->ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) == 0;
+
+        bufferRingTail = 0;
+        for (unsigned i = 0; i < URING_RECV_BUFFERS; i++)
+        {
+            returnBuffer(i);
+        }
+        std::atomic_ref<uint16_t>(bufferRing->tail).store(bufferRingTail, std::memory_order_release);
+
+        fdStates.resize(std::max(socket, maxConnections) + 1);
+    }
+
+    ~IoUringEventManager()
+    {
+        //closing the ring cancels everything still in flight, after that the buffers can go
+        ring.reset();
+        for (UringFdState& state : fdStates)
+        {
+            delete state.inFlight;
+        }
+        for (UringSend *send : orphanedSends)
+        {
+            delete send;
+        }
+        munmap(bufferRing, bufferRingSize);
+    }
+
+    //owns the ring and the provided buffers
+    IoUringEventManager(const IoUringEventManager&) = delete;
+    IoUringEventManager& operator=(const IoUringEventManager&) = delete;
+
+private:
+    //user_data layout: operation in the top byte, then a 24 bit generation and the fd. The
+    //generation changes on stopMonitoring() so completions for a closed fd whose number has
+    //been reused are recognized and dropped. Sends carry a pointer to their UringSend instead
+    enum UringOp : uint64_t { URING_POLL = 1, URING_ACCEPT, URING_RECV, URING_SEND, URING_CANCEL };
+
+    struct UringSend {
+        int fd;
+        uint32_t generation;
+        std::vector<uint8_t> data;
+        size_t offset;
+    };
+
+    struct UringFdState {
+        uint32_t generation = 0;
+        bool monitored = false;     //readiness API is watching this fd
+        bool pollArmed = false;
+        uint32_t pollEvents = POLLIN;   //what the readiness poll waits for
+        bool receiving = false;     //multishot recv is active
+        UringSend *inFlight = NULL; //at most one send per fd is in flight so bytes stay in order
+        std::vector<uint8_t> queued;
+    };
+
+    std::unique_ptr<IoUring> ring;
+    std::vector<UringFdState> fdStates;
+    std::vector<UringSend*> orphanedSends;  //in flight sends of fds that stopped being monitored
+    std::deque<ReadyEvent> readyFds;        //readiness results not handed out yet
+    std::vector<ReadyEvent> readyEvents;    //result of the last wait, needs re-arming before the next one
+    size_t nextEvent = 0;                   //next entry of readyEvents waitForEvent() hands out
+    std::vector<Completion> completions;
+    std::vector<uint16_t> buffersInUse;     //provided buffers referenced by the last completions
+
+    io_uring_buf_ring *bufferRing;
+    size_t bufferRingSize;
+    uint16_t bufferRingTail;
+    bool buffersRegistered;
+    std::vector<char> recvBuffers;
+
+    static uint64_t userData(UringOp op, uint32_t generation, int fd)
+    {
+        return (op << 56) | ((uint64_t)(generation & 0xFFFFFF) << 32) | (uint32_t)fd;
+    }
+
+    UringFdState &state(int fd)
+    {
+        if ((size_t)fd >= fdStates.size())
+        {
+            fdStates.resize(fd * 2 + 1);
+        }
+        return fdStates[fd];
+    }
+
+    //puts a provided buffer back in the ring, published by the next tail store
+    void returnBuffer(uint16_t bufferId)
+    {
+        //index the ring memory directly, in C++ the uapi flexible array member of io_uring_buf_ring
+        //sits after an empty struct that takes up space, so bufs[] does not start at offset 0
+        io_uring_buf *buf = (io_uring_buf*)bufferRing + (bufferRingTail & (URING_RECV_BUFFERS - 1));
+        buf->addr = (uint64_t)(recvBuffers.data() + (size_t)bufferId * URING_RECV_BUFFER_LEN);
+        buf->len = URING_RECV_BUFFER_LEN;
+        buf->bid = bufferId;
+        bufferRingTail++;
+    }
+
+    //one shot poll, re-armed after the app handled the event so readiness behaves level triggered
+    void armPoll(int fd)
+    {
+        io_uring_sqe *sqe = ring->getSqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->poll32_events = state(fd).pollEvents;
+        sqe->user_data = userData(URING_POLL, state(fd).generation, fd);
+        state(fd).pollArmed = true;
+    }
+
+    void armRecv(int fd)
+    {
+        io_uring_sqe *sqe = ring->getSqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        sqe->user_data = userData(URING_RECV, state(fd).generation, fd);
+    }
+
+    void armAccept()
+    {
+        io_uring_sqe *sqe = ring->getSqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = serverSocket;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->user_data = userData(URING_ACCEPT, state(serverSocket).generation, serverSocket);
+    }
+
+    void submitSend(UringSend *send)
+    {
+        io_uring_sqe *sqe = ring->getSqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = send->fd;
+        sqe->addr = (uint64_t)(send->data.data() + send->offset);
+        sqe->len = send->data.size() - send->offset;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = (URING_SEND << 56) | (uint64_t)send;
+    }
+
+    //cancels the request identified by target, its completion is dropped by the generation check
+    void cancel(uint64_t target, uint8_t opcode)
+    {
+        io_uring_sqe *sqe = ring->getSqe();
+        sqe->opcode = opcode;
+        sqe->fd = -1;
+        sqe->addr = target;
+        sqe->user_data = userData(URING_CANCEL, 0, 0);
+    }
+
+    void handleSend(UringSend *send, int result);
+    void processCompletions();
+};
+
+//sorts every available completion into the readiness and completion queues
+inline void IoUringEventManager::processCompletions()
+{
+    io_uring_cqe *cqe;
+
+    while ((cqe = ring->peekCqe()) != NULL)
+    {
+        uint64_t data = cqe->user_data;
+        int result = cqe->res;
+        uint32_t flags = cqe->flags;
+        UringOp op = (UringOp)(data >> 56);
+        int fd = (int)(uint32_t)data;
+        uint32_t generation = (data >> 32) & 0xFFFFFF;
+        ring->cqeSeen();
+
+        if (op == URING_SEND)
+        {
+            handleSend((UringSend*)(data & ((1ULL << 56) - 1)), result);
+            continue;
+        }
+        if (op == URING_CANCEL || (state(fd).generation & 0xFFFFFF) != generation)
+        {
+            //stale completion of a request that was cancelled, hand the buffer back if it holds one
+            if (flags & IORING_CQE_F_BUFFER)
+            {
+                returnBuffer(flags >> IORING_CQE_BUFFER_SHIFT);
+            }
+            continue;
+        }
+
+        if (op == URING_POLL)
+        {
+            state(fd).pollArmed = false;
+            if (result > 0)
+            {
+                readyFds.push_back({fd == serverSocket ? CONN_ATTEMPT : fd, (uint32_t)result});
+            }
+            //a failed poll is re-armed so a monitored fd never silently drops out
+            else if (state(fd).monitored)
+            {
+                armPoll(fd);
+            }
+        }
+        else if (op == URING_ACCEPT)
+        {
+            completions.push_back({COMPLETION_ACCEPT, result, result, NULL});
+            if (!(flags & IORING_CQE_F_MORE))
+            {
+                armAccept();
+            }
+        }
+        else if (op == URING_RECV)
+        {
+            const char *bytes = NULL;
+            if (flags & IORING_CQE_F_BUFFER)
+            {
+                uint16_t bufferId = flags >> IORING_CQE_BUFFER_SHIFT;
+                bytes = recvBuffers.data() + (size_t)bufferId * URING_RECV_BUFFER_LEN;
+                buffersInUse.push_back(bufferId);
+            }
+
+            //out of provided buffers, the request ended but the connection is fine
+            if (result == -ENOBUFS)
+            {
+                armRecv(fd);
+                continue;
+            }
+
+            completions.push_back({COMPLETION_RECV, fd, result, bytes});
+
+            //multishot recv stopped (peer closed, error or the kernel gave up), resume while the connection is alive
+            if (!(flags & IORING_CQE_F_MORE))
+            {
+                state(fd).receiving = false;
+                if (result > 0)
+                {
+                    state(fd).receiving = true;
+                    armRecv(fd);
+                }
+            }
+        }
+    }
+}
+
+//a send finished, continue with what is left or what was queued in the meantime
+inline void IoUringEventManager::handleSend(UringSend *send, int result)
+{
+    //the fd stopped being monitored while this send was in flight
+    if (state(send->fd).generation != send->generation)
+    {
+        orphanedSends.erase(std::remove(orphanedSends.begin(), orphanedSends.end(), send), orphanedSends.end());
+        delete send;
+        return;
+    }
+
+    UringFdState &fdState = state(send->fd);
+    if (result < 0)
+    {
+        completions.push_back({COMPLETION_SEND, send->fd, result, NULL});
+        fdState.queued.clear();
+        fdState.inFlight = NULL;
+        delete send;
+        return;
+    }
+
+    send->offset += result;
+    if (send->offset < send->data.size())
+    {
+        submitSend(send);
+    }
+    else if (!fdState.queued.empty())
+    {
+        send->data.swap(fdState.queued);
+        fdState.queued.clear();
+        send->offset = 0;
+        submitSend(send);
+    }
+    else
+    {
+        completions.push_back({COMPLETION_SEND, send->fd, (int)send->data.size(), NULL});
+        fdState.inFlight = NULL;
+        delete send;
+    }
+}
+
+inline std::span<const ReadyEvent> IoUringEventManager::waitForEvents(int timeoutMs)
+{
+    //watch the server socket for connection requests, done here rather than in the constructor
+    //so apps that only use the completion API never see a poll on it
+    if (!state(serverSocket).monitored)
+    {
+        monitorClient(serverSocket);
+    }
+
+    //fds handed out last time have been handled, watch them again (submitted with the wait below)
+    for (const ReadyEvent &event : readyEvents)
+    {
+        int watched = (event.fd == CONN_ATTEMPT) ? serverSocket : event.fd;
+        if (state(watched).monitored && !state(watched).pollArmed)
+        {
+            armPoll(watched);
+        }
+    }
+    readyEvents.clear();
+    nextEvent = 0;
+
+    while (readyFds.empty())
+    {
+        int result = ring->submit(1, timeoutMs);
+        processCompletions();
+
+        //failed, or a timed wait is over (a wait that also submitted reports no ETIME, so don't retry)
+        if (result < 0 || timeoutMs >= 0)
+        {
+            break;
+        }
+    }
+
+    while (!readyFds.empty() && (int)readyEvents.size() < eventBatchSize)
+    {
+        readyEvents.push_back(readyFds.front());
+        readyFds.pop_front();
+    }
+    return readyEvents;
+}
+
+inline int IoUringEventManager::waitForEvent()
+{
+    //hand out the rest of the last wait before asking the kernel again
+    while (nextEvent < readyEvents.size())
+    {
+        const ReadyEvent &event = readyEvents[nextEvent++];
+        if (event.events != 0)
+        {
+            return event.fd;
+        }
+    }
+
+    if (waitForEvents().empty())
+    {
+        return -1;
+    }
+    return readyEvents[nextEvent++].fd;
+}
+
+inline void IoUringEventManager::monitorClient(int clientSocket)
+{
+    state(clientSocket).monitored = true;
+    state(clientSocket).pollEvents = POLLIN;
+    armPoll(clientSocket);
+}
+
+inline void IoUringEventManager::setInterest(int clientSocket, uint32_t events)
+{
+    UringFdState &fdState = state(clientSocket);
+
+    fdState.pollEvents = events & (POLLIN | POLLOUT);
+    if (!fdState.pollArmed)
+    {
+        return;
+    }
+
+    //change the armed poll in place. If it already fired its completion is queued with the old
+    //events, and the re-armed poll uses the new ones
+    io_uring_sqe *sqe = ring->getSqe();
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = userData(URING_POLL, fdState.generation, clientSocket);
+    sqe->len = IORING_POLL_UPDATE_EVENTS;
+    sqe->poll32_events = fdState.pollEvents;
+    sqe->user_data = userData(URING_CANCEL, 0, 0);
+}
+
+inline void IoUringEventManager::stopMonitoring(int clientSocket)
+{
+    UringFdState &fdState = state(clientSocket);
+
+    if (fdState.pollArmed)
+    {
+        cancel(userData(URING_POLL, fdState.generation, clientSocket), IORING_OP_POLL_REMOVE);
+    }
+    if (fdState.receiving)
+    {
+        cancel(userData(URING_RECV, fdState.generation, clientSocket), IORING_OP_ASYNC_CANCEL);
+    }
+    if (fdState.inFlight != NULL)
+    {
+        orphanedSends.push_back(fdState.inFlight);
+    }
+
+    //new generation, anything still in flight for the old connection gets ignored
+    fdState.generation = (fdState.generation + 1) & 0xFFFFFF;
+    fdState.monitored = false;
+    fdState.pollArmed = false;
+    fdState.receiving = false;
+    fdState.inFlight = NULL;
+    fdState.queued.clear();
+
+    readyFds.erase(std::remove_if(readyFds.begin(), readyFds.end(),
+                                  [clientSocket](const ReadyEvent &event) { return event.fd == clientSocket; }),
+                   readyFds.end());
+
+    //the last wait may still report the socket, its fd number could be reused before that entry is handled
+    for (ReadyEvent &event : readyEvents)
+    {
+        if (event.fd == clientSocket)
+        {
+            event.events = 0;
+        }
+    }
+
+    //get the cancellations to the kernel before the caller closes the fd
+    ring->submit(0);
+}
+
+//accept connections with one multishot request, each new client shows up as COMPLETION_ACCEPT
+inline void IoUringEventManager::startAccepting()
+{
+    armAccept();
+}
+
+//receive from the client with one multishot request, data shows up as COMPLETION_RECV
+inline void IoUringEventManager::startReceiving(int clientSocket)
+{
+    if (!buffersRegistered)
+    {
+        throw std::runtime_error("io_uring provided buffers are not supported by this kernel");
+    }
+    state(clientSocket).receiving = true;
+    armRecv(clientSocket);
+}
+
+//copies data into the connection's send queue. It is submitted with the next wait, and data
+//queued while a send is in flight goes out together once it finishes
+inline void IoUringEventManager::queueSend(int clientSocket, std::span<const uint8_t> data)
+{
+    UringFdState &fdState = state(clientSocket);
+
+    if (fdState.inFlight != NULL)
+    {
+        fdState.queued.insert(fdState.queued.end(), data.begin(), data.end());
+        return;
+    }
+
+    UringSend *send = new UringSend{clientSocket, fdState.generation, std::vector<uint8_t>(data.begin(), data.end()), 0};
+    fdState.inFlight = send;
+    submitSend(send);
+}
+
+//submits everything prepared since the last call, waits for at least one completion and returns
+//all completions available. Received data stays valid until the next call
+inline std::span<const Completion> IoUringEventManager::waitForCompletions()
+{
+    //the app is done with the buffers of the last batch, give them back to the kernel
+    for (uint16_t bufferId : buffersInUse)
+    {
+        returnBuffer(bufferId);
+    }
+    buffersInUse.clear();
+    std::atomic_ref<uint16_t>(bufferRing->tail).store(bufferRingTail, std::memory_order_release);
+    completions.clear();
+
+    while (completions.empty())
+    {
+        if (ring->submit(1) < 0)
+        {
+            break;
+        }
+        processCompletions();
+        std::atomic_ref<uint16_t>(bufferRing->tail).store(bufferRingTail, std::memory_order_release);
+    }
+
+    return completions;
+}
+
+#endif //io_uring
+
+/************************************************************************
+ * Task mailbox (hands work from other threads to an event loop)
+ ************************************************************************/
+
+//tasks posted from any thread run on the thread that owns the event loop. The loop monitors
+//eventFd and calls runPending() whenever it is reported. Posting never takes a lock: tasks are
+//pushed onto a lock free stack, and only the post that finds the stack empty writes the eventfd,
+//so a burst of posts costs one wakeup. The loop takes the whole stack with one exchange and runs
+//it as a batch in posting order
+class TaskMailbox {
+public:
+    int eventFd;
+
+    TaskMailbox()
+    {
+        eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (eventFd == -1)
+        {
+            throw std::runtime_error("Error creating mailbox eventfd");
+        }
+    }
+
+    //tasks that never ran are dropped
+    ~TaskMailbox()
+    {
+        TaskNode *node = head.exchange(NULL, std::memory_order_acquire);
+        while (node != NULL)
+        {
+            TaskNode *next = node->next;
+            delete node;
+            node = next;
+        }
+        close(eventFd);
+    }
+
+    TaskMailbox(const TaskMailbox&) = delete;
+    TaskMailbox& operator=(const TaskMailbox&) = delete;
+
+    //safe to call from any thread
+    void post(std::function<void()> task);
+
+    //interrupts the event loop's wait without posting anything
+    void wake();
+
+    //runs everything posted so far, returns how many tasks ran. Event loop thread only
+    size_t runPending();
+
+private:
+    struct TaskNode {
+        std::function<void()> task;
+        TaskNode *next;
+    };
+
+    std::atomic<TaskNode*> head{NULL};     //newest task first
+};
+
+inline void TaskMailbox::post(std::function<void()> task)
+{
+    TaskNode *node = new TaskNode{std::move(task), NULL};
+    TaskNode *previous = head.load(std::memory_order_relaxed);
+
+    do
+    {
+        node->next = previous;
+    } while (!head.compare_exchange_weak(previous, node, std::memory_order_release, std::memory_order_relaxed));
+
+    //the loop took everything before this, it needs waking up for the new batch
+    if (previous == NULL)
+    {
+        wake();
+    }
+}
+
+inline void TaskMailbox::wake()
+{
+    uint64_t one = 1;
+    if (write(eventFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    {
+        perror("Error waking event loop");
+    }
+}
+
+inline size_t TaskMailbox::runPending()
+{
+    uint64_t count;
+    size_t ran = 0;
+
+    //reset the eventfd first, a post that finds the stack empty after the exchange wakes the loop again
+    while (read(eventFd, &count, sizeof(count)) > 0)
+    {
+    }
+
+    //the stack is newest first, reverse it so tasks run in the order they were posted
+    TaskNode *node = head.exchange(NULL, std::memory_order_acquire);
+    TaskNode *batch = NULL;
+    while (node != NULL)
+    {
+        TaskNode *next = node->next;
+        node->next = batch;
+        batch = node;
+        node = next;
+    }
+
+    while (batch != NULL)
+    {
+        TaskNode *next = batch->next;
+        batch->task();
+        delete batch;
+        batch = next;
+        ran++;
+    }
+    return ran;
+}
+
+/************************************************************************
+ * Timer wheel (timers for an event loop, driven by the wait timeout)
+ ************************************************************************/
+
+//identifies an armed timer, 0 is never used
+using TimerId = uint64_t;
+
+//hierarchical timer wheel with millisecond ticks. Level 0 has one slot per tick for the next
+//256 ticks, each level above covers 256 times the range of the one below. A timer goes into the
+//lowest level that reaches its deadline and moves down a level (cascades) when the level below
+//wraps around, so arming and cancelling are O(1) linked list operations no matter how many
+//timers exist. Occupancy bitmaps let advance() and getNextExpiry() skip empty slots instead of
+//visiting every tick. Not thread safe, it belongs to one event loop
+class TimerWheel {
+public:
+    TimerWheel();
+
+    //runs callback once tick `expires` has been reached by advance()
+    TimerId add(uint64_t expires, std::function<void()> callback);
+
+    //returns false if the timer already ran or was cancelled
+    bool cancel(TimerId timer);
+
+    //runs every timer that expires at or before tick now, returns how many ran. Callbacks may
+    //add and cancel timers
+    size_t advance(uint64_t now);
+
+    //the earliest tick at which advance() has something to do, UINT64_MAX without timers. This
+    //is exact for level 0 and the next cascade for the levels above, so a wait may end early
+    //but never late
+    uint64_t getNextExpiry();
+
+    size_t size();
+
+private:
+    static constexpr int LEVELS = 4;
+    static constexpr int SLOT_BITS = 8;
+    static constexpr int SLOTS = 1 << SLOT_BITS;
+    static constexpr uint32_t NONE = UINT32_MAX;
+    static constexpr uint32_t RUNNING = LEVELS * SLOTS;   //list id of the slot being run by advance()
+
+    struct TimerNode {
+        uint64_t expires;
+        uint32_t generation = 0;    //bumped whenever the node is freed, so stale TimerIds miss
+        uint32_t list = NONE;       //slot the node is linked into, NONE while free
+        uint32_t prev = NONE;
+        uint32_t next = NONE;
+        std::function<void()> callback;
+    };
+
+    std::vector<TimerNode> nodes;
+    uint32_t freeNodes = NONE;                  //free list linked through next
+    uint32_t heads[LEVELS * SLOTS + 1];         //first node of every slot, plus the running one
+    uint64_t occupied[LEVELS][SLOTS / 64];      //which slots are not empty
+    uint64_t current = 0;                       //next tick advance() will process
+    size_t count = 0;
+
+    void link(uint32_t index);
+    void unlink(uint32_t index);
+    void cascade(int level);
+    int nextOccupied(int level, int start);
+};
+
+inline TimerWheel::TimerWheel()
+{
+    std::fill(heads, heads + LEVELS * SLOTS + 1, NONE);
+    memset(occupied, 0, sizeof(occupied));
+}
+
+inline TimerId TimerWheel::add(uint64_t expires, std::function<void()> callback)
+{
+    uint32_t index;
+
+    if (freeNodes != NONE)
+    {
+        index = freeNodes;
+        freeNodes = nodes[index].next;
+    }
+    else
+    {
+        index = nodes.size();
+        nodes.emplace_back();
+    }
+
+    TimerNode &node = nodes[index];
+    node.expires = expires;
+    node.callback = std::move(callback);
+    link(index);
+    count++;
+    return ((TimerId)(node.generation + 1) << 32) | index;
+}
+
+inline bool TimerWheel::cancel(TimerId timer)
+{
+    uint32_t index = (uint32_t)timer;
+
+    if (index >= nodes.size() || nodes[index].generation + 1 != (uint32_t)(timer >> 32) || nodes[index].list == NONE)
+    {
+        return false;
+    }
+
+    unlink(index);
+    nodes[index].callback = nullptr;
+    nodes[index].generation++;
+    nodes[index].next = freeNodes;
+    freeNodes = index;
+    count--;
+    return true;
+}
+
+//puts the node into the lowest level whose range reaches its deadline
+inline void TimerWheel::link(uint32_t index)
+{
+    TimerNode &node = nodes[index];
+    uint64_t expires = std::max(node.expires, current);
+    uint64_t delta = expires - current;
+    int level = 0;
+
+    while (level < LEVELS - 1 && delta >= ((uint64_t)1 << (SLOT_BITS * (level + 1))))
+    {
+        level++;
+    }
+
+    //beyond the top level the timer waits in the furthest slot and is placed again from there
+    uint64_t range = (uint64_t)1 << (SLOT_BITS * LEVELS);
+    if (delta >= range)
+    {
+        expires = current + range - 1;
+    }
+
+    int slot = (expires >> (SLOT_BITS * level)) & (SLOTS - 1);
+    uint32_t list = level * SLOTS + slot;
+
+    node.list = list;
+    node.prev = NONE;
+    node.next = heads[list];
+    if (node.next != NONE)
+    {
+        nodes[node.next].prev = index;
+    }
+    heads[list] = index;
+    occupied[level][slot / 64] |= (uint64_t)1 << (slot % 64);
+}
+
+inline void TimerWheel::unlink(uint32_t index)
+{
+    TimerNode &node = nodes[index];
+
+    if (node.prev != NONE)
+    {
+        nodes[node.prev].next = node.next;
+    }
+    else
+    {
+        heads[node.list] = node.next;
+    }
+    if (node.next != NONE)
+    {
+        nodes[node.next].prev = node.prev;
+    }
+
+    //the running list has no occupancy bit
+    if (node.list != RUNNING && heads[node.list] == NONE)
+    {
+        int level = node.list / SLOTS;
+        int slot = node.list % SLOTS;
+        occupied[level][slot / 64] &= ~((uint64_t)1 << (slot % 64));
+    }
+    node.list = NONE;
+}
+
+//moves the timers of the level's current slot down, returns with the slot empty
+inline void TimerWheel::cascade(int level)
+{
+    int slot = (current >> (SLOT_BITS * level)) & (SLOTS - 1);
+    uint32_t list = level * SLOTS + slot;
+
+    while (heads[list] != NONE)
+    {
+        uint32_t index = heads[list];
+        unlink(index);
+        link(index);
+    }
+}
+
+//first occupied slot of the level at or after start (wrapping around), -1 if there is none
+inline int TimerWheel::nextOccupied(int level, int start)
+{
+    for (int i = 0; i <= SLOTS / 64; i++)
+    {
+        int word = ((start / 64) + i) % (SLOTS / 64);
+        uint64_t bits = occupied[level][word];
+
+        //the first word is searched from start, and once more up to start after wrapping
+        if (i == 0)
+        {
+            bits &= ~(uint64_t)0 << (start % 64);
+        }
+        else if (i == SLOTS / 64)
+        {
+            bits &= ((uint64_t)1 << (start % 64)) - 1;
+        }
+
+        if (bits != 0)
+        {
+            return word * 64 + std::countr_zero(bits);
+        }
+    }
+    return -1;
+}
+
+inline size_t TimerWheel::advance(uint64_t now)
+{
+    size_t ran = 0;
+
+    while (current <= now)
+    {
+        int slot = current & (SLOTS - 1);
+
+        //level 0 wrapped around, bring the timers of the next range down (and further up if
+        //that level wrapped as well)
+        if (slot == 0)
+        {
+            for (int level = 1; level < LEVELS; level++)
+            {
+                cascade(level);
+                if (((current >> (SLOT_BITS * level)) & (SLOTS - 1)) != 0)
+                {
+                    break;
+                }
+            }
+        }
+
+        //nothing due in this slot, jump to the next one that has timers or to the next wrap
+        if (heads[slot] == NONE)
+        {
+            int next = nextOccupied(0, slot);
+            uint64_t skip = (next > slot) ? (uint64_t)(next - slot) : (uint64_t)(SLOTS - slot);
+            current = std::min(current + skip, now + 1);
+            continue;
+        }
+
+        //take the slot's list first, callbacks may arm timers that land in this slot again
+        heads[RUNNING] = heads[slot];
+        heads[slot] = NONE;
+        occupied[0][slot / 64] &= ~((uint64_t)1 << (slot % 64));
+        for (uint32_t index = heads[RUNNING]; index != NONE; index = nodes[index].next)
+        {
+            nodes[index].list = RUNNING;
+        }
+        current++;
+
+        while (heads[RUNNING] != NONE)
+        {
+            uint32_t index = heads[RUNNING];
+            unlink(index);
+
+            //free the node before running, the callback may reuse it for a new timer
+            std::function<void()> callback = std::move(nodes[index].callback);
+            nodes[index].callback = nullptr;
+            nodes[index].generation++;
+            nodes[index].next = freeNodes;
+            freeNodes = index;
+            count--;
+
+            callback();
+            ran++;
+        }
+    }
+    return ran;
+}
+
+inline uint64_t TimerWheel::getNextExpiry()
+{
+    uint64_t next = UINT64_MAX;
+
+    if (count == 0)
+    {
+        return next;
+    }
+
+    for (int level = 0; level < LEVELS; level++)
+    {
+        int shift = SLOT_BITS * level;
+        int position = (current >> shift) & (SLOTS - 1);
+        int slot = nextOccupied(level, position);
+        if (slot == -1)
+        {
+            continue;
+        }
+
+        //level 0 slots are due at their tick, higher slots once the levels below wrap around
+        //to them. A higher slot is never the current one, that one was cascaded already
+        uint64_t steps = (slot - position) & (SLOTS - 1);
+        if (level == 0)
+        {
+            next = std::min(next, current + steps);
+        }
+        else
+        {
+            next = std::min(next, ((current >> shift) + (steps == 0 ? SLOTS : steps)) << shift);
+        }
+    }
+    return next;
+}
+
+inline size_t TimerWheel::size()
+{
+    return count;
+}
+
+/************************************************************************
+ * Runtime selected EventManager
+ ************************************************************************/
+
+class TaskExecutor;
+
+//EventManager picks its backend when it is constructed and forwards every call to it. Calls
+//are dispatched by switching over the compiled in backend types, there are no virtual calls.
+//For the tightest loops, visit() runs a generic lambda against the concrete backend, so an
+//event loop written inside it is compiled once per backend and only makes direct calls.
+//A backend the kernel does not support falls back to the next one (io_uring -> epoll -> poll)
+//
+//Timers (addTimer(), setIdleTimeout()) live in a TimerWheel that is driven by the wait timeout:
+//every wait ends in time for the next timer and expired timers run right after it, before its
+//events are returned. Tasks from other threads (post()) run at the same point, and so do the
+//handlers of clients monitored with one, right after the sockets registered with autoFlush()
+//were flushed. Loops that wait through visit() bypass all of these
+class EventManager {
+public:
+    int serverSocket;
+
+    //uses the backend chosen with EVENT_BASED_ARCHITECTURE
+    EventManager(int socket, int maxConnections, int batchSize = DEFAULT_EVENT_BATCH)
+    : EventManager((EventBackend)EVENT_BASED_ARCHITECTURE, socket, maxConnections, batchSize)
+    {
+    }
+
+    EventManager(EventBackend requested, int socket, int maxConnections, int batchSize = DEFAULT_EVENT_BATCH)
+    : serverSocket(socket), backends(createBackend(requested, socket, maxConnections, batchSize))
+    {
+        std::visit([this](auto &backend) { backend.monitorClient(mailbox.eventFd); }, backends);
+
+        //clients whose output backed up are watched for POLLOUT until it drained
+        flushQueue->watchWritable = [this](int clientSocket, bool writable) {
+            setInterest(clientSocket, writable ? POLLIN | POLLOUT : POLLIN);
+        };
+    }
+
+    //waits for handshake computations still running on workers, they post back to this
+    //EventManager, then sends whatever the last loop iteration left corked
+    ~EventManager()
+    {
+        while (handshakesComputing.load(std::memory_order_acquire) > 0)
+        {
+            std::this_thread::yield();
+        }
+        flushQueue->flushAll(true);
+    }
+
+    EventManager(const EventManager&) = delete;
+    EventManager& operator=(const EventManager&) = delete;
+
+    //calls visitor with the concrete backend, see the class comment
+    template <class Visitor>
+    decltype(auto) visit(Visitor &&visitor)
+    {
+        return std::visit(std::forward<Visitor>(visitor), backends);
+    }
+
+    //returns the next ready fd, -1 if the wait failed
+    int waitForEvent();
+
+    //waits at most timeoutMs (-1 for no limit) and runs the timers that expired meanwhile. The
+    //span stays valid until the next wait, it is empty after a timeout or a wakeup for timers
+    std::span<const ReadyEvent> waitForEvents(int timeoutMs = -1);
+
+    //runs callback on the loop thread once delayMs have passed
+    TimerId addTimer(int delayMs, std::function<void()> callback);
+
+    //returns false if the timer already ran or was cancelled
+    bool cancelTimer(TimerId timer);
+
+    //runs task on the thread waiting on this EventManager, in a batch with everything else posted
+    //since the last wait. Safe to call from any thread, e.g. to send on or close a connection
+    //owned by the loop without sharing the Socket under a lock
+    void post(std::function<void()> task);
+
+    //like post(), but runs task right away when called from the loop thread itself
+    void dispatch(std::function<void()> task);
+
+    //clients with an idle timeout that go timeoutMs without being reported by a wait are passed
+    //to handler, which usually closes them. Every event counts as activity, so keeping track
+    //costs nothing per message. A client that stays open is reported again after another
+    //timeoutMs. timeoutMs <= 0 turns it off, stopMonitoring() does as well
+    void setIdleHandler(std::function<void(int)> handler);
+    void setIdleTimeout(int clientSocket, int timeoutMs);
+
+    //called on the loop thread with the events of a client that was monitored with it
+    using EventHandler = std::function<void(int clientSocket, uint32_t events)>;
+
+    void monitorClient(int clientSocket)
+    {
+        visit([clientSocket](auto &backend) { backend.monitorClient(clientSocket); });
+    }
+
+    //the client's events go straight to handler from inside the wait instead of being returned.
+    //Handlers sit in a slot indexed by fd, so dispatching one costs the same no matter how many
+    //clients are connected and no lookup is needed to find the connection it belongs to
+    void monitorClient(int clientSocket, EventHandler handler);
+
+    //also drops the client's handler, which may be the one calling this
+    void stopMonitoring(int clientSocket);
+
+    void setInterest(int clientSocket, uint32_t events)
+    {
+        visit([clientSocket, events](auto &backend) { backend.setInterest(clientSocket, events); });
+    }
+
+    //the socket is corked and flushed at the start of every wait. A client whose peer reads
+    //slower than it is written to is watched for POLLOUT as well until its output drained, so
+    //its handler may see POLLOUT events
+    void autoFlush(Socket *socket)
+    {
+        socket->setFlushQueue(flushQueue);
+    }
+
+    //reports the client again in the next wait although nothing new arrived, needed by edge
+    //triggered clients that still have data after Socket::receiveAvailable() used up its budget
+    void requeue(int clientSocket)
+    {
+        visit([clientSocket](auto &backend) {
+            if constexpr (requires { backend.requeue(clientSocket); })
+            {
+                backend.requeue(clientSocket);
+            }
+        });
+    }
+
+    //drives the deferred handshake of socket (see Socket::continueHandshake()) from inside the
+    //waits, so the loop keeps serving everyone else while the peer is slow. onDone runs on the
+    //loop thread with whether it succeeded, right away if there is nothing to wait for. The
+    //socket is monitored with a handler meanwhile and stops being monitored before onDone, which
+    //usually monitors it again for its messages or closes it. An idle timeout set meanwhile
+    //ends with the handshake as well. Given workers, the Kyber computations run on them and the
+    //handshake resumes on the loop thread once they are done, so bursts of handshakes use every
+    //core and do not hold up the established connections. Stopping the client drops its
+    //handshake, a computation still running is then ignored
+    void handshake(Socket *socket, std::function<void(bool)> onDone, TaskExecutor *workers = NULL);
+
+    //returns false if the active backend has no edge triggered mode
+    bool setEdgeTriggered(bool enabled)
+    {
+        return visit([enabled](auto &backend) {
+            if constexpr (requires { backend.setEdgeTriggered(enabled); })
+            {
+                backend.setEdgeTriggered(enabled);
+                return true;
+            }
+            return false;
+        });
+    }
+
+    //the backend that is actually running, which differs from the requested one after a fallback
+    EventBackend getBackend()
+    {
+        return visit([](auto &backend) { return backend.backend; });
+    }
+
+    const char *getBackendName()
+    {
+        switch (getBackend())
+        {
+            case BACKEND_EPOLL:
+                return "EPOLL";
+            case BACKEND_POLL:
+                return "POLL";
+            case BACKEND_IO_URING:
+                return "IO_URING";
+            default:
+                return "SELECT";
+        }
+    }
+
+    //like the global snitch() but reports the backend in use instead of the compiled default
+    void snitch()
+    {
+        std::cout << std::endl << getBackendName() << " IS IN USE" << std::endl;
+    }
+
+    //the concrete backend, or NULL if another one is active. Used for backend specific
+    //features like the io_uring completion API
+    template <class Backend>
+    Backend *getBackendAs()
+    {
+        return std::get_if<Backend>(&backends);
+    }
+
+private:
+    using Backends = std::variant<EpollEventManager, PollEventManager, SelectEventManager
+    #if HAS_IO_URING
+                                  , IoUringEventManager
+    #endif
+                                  >;
+    Backends backends;
+
+    //the sockets registered with autoFlush(), flushed at the start of every wait, i.e. once the
+    //previous loop iteration has finished handling its events
+    std::shared_ptr<FlushQueue> flushQueue = std::make_shared<FlushQueue>();
+
+    //last batch of waitForEvents(), handed out one fd at a time by waitForEvent()
+    std::span<const ReadyEvent> readyEvents;
+    size_t nextEvent = 0;
+    bool timerWakeup = false;   //the last wait was cut short for the timers
+
+    struct IdleTimer {
+        TimerId timer = 0;
+        uint64_t lastActive = 0;
+        int timeoutMs = 0;
+    };
+
+    TaskMailbox mailbox;                                //monitored by the backend, never reported
+
+    std::deque<EventHandler> handlers;      //indexed by fd, a deque so a handler survives growing it
+    std::vector<EventHandler> retiredHandlers;  //stopped during the last wait, may still be running
+    size_t handledClients = 0;
+    std::atomic<std::thread::id> loopThread;            //the thread of the last wait
+
+    //a handshake driven by handshake(). Owned by the client's handler, so it is gone once the
+    //client stops being monitored
+    struct PendingHandshake {
+        Socket *socket;
+        std::function<void(bool)> onDone;
+        TaskExecutor *workers;
+        uint32_t interest = POLLIN;
+        bool monitored = false;
+        bool computing = false;     //the backend does not watch the socket while a worker runs the Kyber computation
+    };
+    std::atomic<size_t> handshakesComputing{0};
+    void advanceHandshake(const std::shared_ptr<PendingHandshake> &pending);
+
+    TimerWheel timers;
+    std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    std::vector<IdleTimer> idleTimers;      //indexed by fd
+    size_t idleClients = 0;
+    std::function<void(int)> idleHandler;
+
+    //milliseconds since the EventManager was created, the tick of the timer wheel
+    uint64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - epoch).count();
+    }
+
+    void checkIdle(int clientSocket);
+
+    //the backends can be neither copied nor moved, so they are built right inside the variant
+    static Backends createBackend(EventBackend requested, int socket, int maxConnections, int batchSize)
+    {
+        #if HAS_IO_URING
+        if (requested == BACKEND_IO_URING)
+        {
+            try
+            {
+                return Backends(std::in_place_type<IoUringEventManager>, socket, maxConnections, batchSize);
+            }
+            catch (const std::runtime_error&)
+            {
+                requested = BACKEND_EPOLL;
+            }
+        }
+        #else
+        if (requested == BACKEND_IO_URING)
+        {
+            requested = BACKEND_EPOLL;
+        }
+        #endif
+
+        if (requested == BACKEND_EPOLL)
+        {
+            try
+            {
+                return Backends(std::in_place_type<EpollEventManager>, socket, maxConnections, batchSize);
+            }
+            catch (const std::runtime_error&)
+            {
+                requested = BACKEND_POLL;
+            }
+        }
+
+        if (requested == BACKEND_SELECT)
+        {
+            return Backends(std::in_place_type<SelectEventManager>, socket, maxConnections, batchSize);
+        }
+        return Backends(std::in_place_type<PollEventManager>, socket, maxConnections, batchSize);
+    }
+};
+
+inline int EventManager::waitForEvent()
+{
+    while (true)
+    {
+        //hand out the rest of the last wait before asking the kernel again
+        while (nextEvent < readyEvents.size())
+        {
+            const ReadyEvent &event = readyEvents[nextEvent++];
+            if (event.events != 0)
+            {
+                return event.fd;
+            }
+        }
+
+        //an empty wait that only woke up for the timers is not a failure
+        if (waitForEvents().empty() && !timerWakeup)
+        {
+            return -1;
+        }
+    }
+}
+
+inline std::span<const ReadyEvent> EventManager::waitForEvents(int timeoutMs)
+{
+    //end the wait in time for the next timer
+    uint64_t nextExpiry = timers.getNextExpiry();
+    timerWakeup = false;
+    if (nextExpiry != UINT64_MAX)
+    {
+        uint64_t start = now();
+        int untilTimer = (int)std::min<uint64_t>(nextExpiry > start ? nextExpiry - start : 0, INT_MAX);
+        if (timeoutMs < 0 || untilTimer < timeoutMs)
+        {
+            timeoutMs = untilTimer;
+            timerWakeup = true;
+        }
+    }
+
+    loopThread.store(std::this_thread::get_id(), std::memory_order_relaxed);
+    retiredHandlers.clear();
+
+    //the previous loop iteration is done, send everything it corked
+    flushQueue->flushAll();
+    readyEvents = visit([timeoutMs](auto &backend) { return backend.waitForEvents(timeoutMs); });
+    nextEvent = 0;
+
+    //run the posted tasks and hide the mailbox from the caller, cleared entries are skipped
+    //just like the ones of clients that stopped being monitored
+    for (const ReadyEvent &event : readyEvents)
+    {
+        if (event.fd == mailbox.eventFd && event.events != 0)
+        {
+            const_cast<ReadyEvent&>(event).events = 0;
+            mailbox.runPending();
+        }
+    }
+
+    uint64_t current = now();
+    if (idleClients > 0)
+    {
+        for (const ReadyEvent &event : readyEvents)
+        {
+            if (event.fd >= 0 && (size_t)event.fd < idleTimers.size())
+            {
+                idleTimers[event.fd].lastActive = current;
+            }
+        }
+    }
+    timers.advance(current);
+
+    //clients with a handler are dispatched right here and hidden like the mailbox. A handler
+    //that stops another client clears that client's entry, so it is skipped below
+    if (handledClients > 0)
+    {
+        for (const ReadyEvent &event : readyEvents)
+        {
+            if (event.events != 0 && event.fd >= 0 && (size_t)event.fd < handlers.size() && handlers[event.fd])
+            {
+                uint32_t events = event.events;
+                const_cast<ReadyEvent&>(event).events = 0;
+                handlers[event.fd](event.fd, events);
+            }
+        }
+    }
+
+    return readyEvents;
+}
+
+inline void EventManager::monitorClient(int clientSocket, EventHandler handler)
+{
+    if ((size_t)clientSocket >= handlers.size())
+    {
+        handlers.resize(clientSocket + 1);
+    }
+    //a handler can replace itself, the old one is kept until it has returned
+    if (handlers[clientSocket])
+    {
+        retiredHandlers.push_back(std::move(handlers[clientSocket]));
+    }
+    else
+    {
+        handledClients++;
+    }
+    handlers[clientSocket] = std::move(handler);
+
+    monitorClient(clientSocket);
+}
+
+inline void EventManager::stopMonitoring(int clientSocket)
+{
+    setIdleTimeout(clientSocket, 0);
+    visit([clientSocket](auto &backend) { backend.stopMonitoring(clientSocket); });
+
+    if (clientSocket >= 0 && (size_t)clientSocket < handlers.size() && handlers[clientSocket])
+    {
+        //destroyed at the start of the next wait, once the handler is sure to have returned
+        retiredHandlers.push_back(std::move(handlers[clientSocket]));
+        handlers[clientSocket] = nullptr;
+        handledClients--;
+    }
+}
+
+inline TimerId EventManager::addTimer(int delayMs, std::function<void()> callback)
+{
+    return timers.add(now() + std::max(delayMs, 0), std::move(callback));
+}
+
+inline bool EventManager::cancelTimer(TimerId timer)
+{
+    return timers.cancel(timer);
+}
+
+inline void EventManager::post(std::function<void()> task)
+{
+    mailbox.post(std::move(task));
+}
+
+inline void EventManager::dispatch(std::function<void()> task)
+{
+    if (loopThread.load(std::memory_order_relaxed) == std::this_thread::get_id())
+    {
+        task();
+        return;
+    }
+    mailbox.post(std::move(task));
+}
+
+inline void EventManager::setIdleHandler(std::function<void(int)> handler)
+{
+    idleHandler = std::move(handler);
+}
+
+inline void EventManager::setIdleTimeout(int clientSocket, int timeoutMs)
+{
+    if (clientSocket < 0 || ((size_t)clientSocket >= idleTimers.size() && timeoutMs <= 0))
+    {
+        return;
+    }
+    if ((size_t)clientSocket >= idleTimers.size())
+    {
+        idleTimers.resize(clientSocket * 2 + 1);
+    }
+
+    IdleTimer &idle = idleTimers[clientSocket];
+    if (idle.timer != 0)
+    {
+        timers.cancel(idle.timer);
+        idleClients--;
+    }
+    idle = IdleTimer();
+
+    if (timeoutMs > 0)
+    {
+        idle.timeoutMs = timeoutMs;
+        idle.lastActive = now();
+        idle.timer = addTimer(timeoutMs, [this, clientSocket]() { checkIdle(clientSocket); });
+        idleClients++;
+    }
+}
+
+//the client's idle timer ran out. Activity only updates lastActive, so the timer is moved to the
+//new deadline here instead of on every event
+inline void EventManager::checkIdle(int clientSocket)
+{
+    IdleTimer &idle = idleTimers[clientSocket];
+    uint64_t current = now();
+    uint64_t deadline = idle.lastActive + idle.timeoutMs;
+
+    if (current < deadline)
+    {
+        idle.timer = addTimer(deadline - current, [this, clientSocket]() { checkIdle(clientSocket); });
+        return;
+    }
+
+    //armed again first, the handler usually closes the client which cancels it
+    idle.lastActive = current;
+    idle.timer = addTimer(idle.timeoutMs, [this, clientSocket]() { checkIdle(clientSocket); });
+    if (idleHandler)
+    {
+        idleHandler(clientSocket);
+    }
+}
+
+/************************************************************************
+ * Work stealing executor (runs CPU heavy work away from the event loops)
+ ************************************************************************/
+
+//pool of worker threads for handlers that are too expensive to run inside an event loop.
+//Every worker has its own deque: tasks submitted by a worker go to the back of its own deque
+//and are taken from there (the data is still in its cache), tasks from other threads go to a
+//shared queue, and a worker that runs dry steals from the front of the other deques. Idle
+//workers sleep, the pool grows towards maxWorkers while tasks pile up and shrinks back to
+//minWorkers once workers have been idle for EXECUTOR_IDLE_MS. Results are usually posted to
+//the TaskMailbox of the event loop that owns the connection. Tasks of one connection may
+//finish in any order
+class TaskExecutor {
+public:
+    //0 workers means one per CPU
+    TaskExecutor(size_t minWorkers = 1, size_t maxWorkers = 0);
+
+    //runs the tasks still queued, then stops the workers
+    ~TaskExecutor();
+
+    TaskExecutor(const TaskExecutor&) = delete;
+    TaskExecutor& operator=(const TaskExecutor&) = delete;
+
+    //safe to call from any thread, including from inside a task
+    void submit(std::function<void()> task);
+
+    size_t getWorkerCount();
+    size_t getQueueDepth();
+
+private:
+    struct Worker {
+        std::mutex lock;
+        std::deque<std::function<void()>> tasks;    //guarded by lock
+        std::thread thread;
+        bool running = false;                       //guarded by sleepLock
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;   //maxWorkers slots, threads start and stop as needed
+    std::mutex sharedLock;
+    std::deque<std::function<void()>> shared;      //tasks submitted from outside, guarded by sharedLock
+    std::atomic<size_t> queued{0};
+    std::mutex sleepLock;
+    std::condition_variable wakeUp;
+    size_t minWorkers;
+    size_t activeWorkers = 0;                       //guarded by sleepLock
+    size_t sleepingWorkers = 0;                     //guarded by sleepLock
+    bool stopping = false;                          //guarded by sleepLock
+
+    //the worker the current thread belongs to, NULL on other threads
+    inline static thread_local Worker *currentWorker = NULL;
+    inline static thread_local TaskExecutor *currentExecutor = NULL;
+
+    void startWorker();
+    void runWorker(size_t index);
+    bool takeTask(size_t index, std::function<void()> &task);
+};
+
+inline TaskExecutor::TaskExecutor(size_t minWorkers, size_t maxWorkers)
+{
+    size_t cpus = std::max(1u, std::thread::hardware_concurrency());
+
+    if (maxWorkers == 0)
+    {
+        maxWorkers = cpus;
+    }
+    this->minWorkers = std::max<size_t>(1, std::min(minWorkers == 0 ? cpus : minWorkers, maxWorkers));
+
+    for (size_t i = 0; i < maxWorkers; i++)
+    {
+        workers.emplace_back(new Worker());
+    }
+
+    std::lock_guard<std::mutex> guard(sleepLock);
+    for (size_t i = 0; i < this->minWorkers; i++)
+    {
+        startWorker();
+    }
+}
+
+inline TaskExecutor::~TaskExecutor()
+{
+    {
+        std::lock_guard<std::mutex> guard(sleepLock);
+        stopping = true;
+    }
+    wakeUp.notify_all();
+
+    for (std::unique_ptr<Worker> &worker : workers)
+    {
+        if (worker->thread.joinable())
+        {
+            worker->thread.join();
+        }
+    }
+}
+
+inline void TaskExecutor::submit(std::function<void()> task)
+{
+    //a worker keeps its own follow up work, everyone else goes through the shared queue
+    if (currentExecutor == this && currentWorker != NULL)
+    {
+        std::lock_guard<std::mutex> guard(currentWorker->lock);
+        currentWorker->tasks.push_back(std::move(task));
+    }
+    else
+    {
+        std::lock_guard<std::mutex> guard(sharedLock);
+        shared.push_back(std::move(task));
+    }
+    size_t depth = queued.fetch_add(1) + 1;
+
+    std::lock_guard<std::mutex> guard(sleepLock);
+    if (sleepingWorkers > 0)
+    {
+        wakeUp.notify_one();
+    }
+    else if (depth > activeWorkers * EXECUTOR_GROW_DEPTH && activeWorkers < workers.size())
+    {
+        startWorker();
+    }
+}
+
+inline size_t TaskExecutor::getWorkerCount()
+{
+    std::lock_guard<std::mutex> guard(sleepLock);
+    return activeWorkers;
+}
+
+inline size_t TaskExecutor::getQueueDepth()
+{
+    return queued.load();
+}
+
+//starts a thread in a free slot, sleepLock must be held
+inline void TaskExecutor::startWorker()
+{
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        Worker &worker = *workers[i];
+        if (!worker.running)
+        {
+            //the slot's previous thread has retired, it is done or about to be
+            if (worker.thread.joinable())
+            {
+                worker.thread.join();
+            }
+            worker.running = true;
+            activeWorkers++;
+            worker.thread = std::thread([this, i]() { runWorker(i); });
+            return;
+        }
+    }
+}
+
+//own deque from the back, then the shared queue, then steal from the front of the others
+inline bool TaskExecutor::takeTask(size_t index, std::function<void()> &task)
+{
+    {
+        Worker &own = *workers[index];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.tasks.empty())
+        {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> guard(sharedLock);
+        if (!shared.empty())
+        {
+            task = std::move(shared.front());
+            shared.pop_front();
+            return true;
+        }
+    }
+    for (size_t i = 1; i < workers.size(); i++)
+    {
+        Worker &victim = *workers[(index + i) % workers.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.tasks.empty())
+        {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+inline void TaskExecutor::runWorker(size_t index)
+{
+    std::function<void()> task;
+
+    currentWorker = workers[index].get();
+    currentExecutor = this;
+
+    while (true)
+    {
+        if (takeTask(index, task))
+        {
+            queued.fetch_sub(1);
+            task();
+            task = nullptr;
+            continue;
+        }
+
+        std::unique_lock<std::mutex> guard(sleepLock);
+        if (queued.load() > 0)
+        {
+            continue;
+        }
+
+        bool woken = true;
+        if (!stopping)
+        {
+            sleepingWorkers++;
+            woken = wakeUp.wait_for(guard, std::chrono::milliseconds(EXECUTOR_IDLE_MS),
+                                    [this]() { return queued.load() > 0 || stopping; });
+            sleepingWorkers--;
+        }
+
+        //shutting down with nothing left, or idle for a while in a pool above its minimum
+        if ((stopping && queued.load() == 0) || (!woken && activeWorkers > minWorkers))
+        {
+            workers[index]->running = false;
+            activeWorkers--;
+            return;
+        }
+    }
+}
+
+//EventManager::handshake() is defined here because it hands the Kyber computations to a TaskExecutor
+inline void EventManager::handshake(Socket *socket, std::function<void(bool)> onDone, TaskExecutor *workers)
+{
+    std::shared_ptr<PendingHandshake> pending(new PendingHandshake{socket, std::move(onDone), workers});
+    advanceHandshake(pending);
+}
+
+//moves the handshake along until it waits for the socket or a worker, or is over
+inline void EventManager::advanceHandshake(const std::shared_ptr<PendingHandshake> &pending)
+{
+    Socket *socket = pending->socket;
+    int clientSocket = socket->socketId;
+    HandshakeStatus status = socket->continueHandshake(pending->workers != NULL);
+
+    if (status == HANDSHAKE_DONE || status == HANDSHAKE_FAILED)
+    {
+        //stopMonitoring() retires the handler that owns pending, onDone is moved out of it first
+        std::function<void(bool)> done = std::move(pending->onDone);
+        if (pending->monitored)
+        {
+            stopMonitoring(clientSocket);
+        }
+        done(status == HANDSHAKE_DONE);
+        return;
+    }
+
+    //from here on the handler keeps the handshake alive
+    if (!pending->monitored)
+    {
+        pending->monitored = true;
+        monitorClient(clientSocket, [this, pending](int, uint32_t) {
+            if (!pending->computing)
+            {
+                advanceHandshake(pending);
+            }
+        });
+    }
+
+    if (status == HANDSHAKE_WANT_COMPUTE)
+    {
+        //a readable or hung up socket would be reported by every wait until the worker is done,
+        //so the backend stops watching it meanwhile. The handler stays and keeps the handshake
+        visit([clientSocket](auto &backend) { backend.stopMonitoring(clientSocket); });
+
+        //the result comes back through the mailbox, by then the client may have been stopped
+        pending->computing = true;
+        handshakesComputing.fetch_add(1, std::memory_order_relaxed);
+        std::weak_ptr<PendingHandshake> waiting = pending;
+        pending->workers->submit([this, waiting, computation = socket->getHandshakeComputation()]() {
+            computation();
+            post([this, waiting]() {
+                if (std::shared_ptr<PendingHandshake> resumed = waiting.lock())
+                {
+                    //watched again from scratch, i.e. for POLLIN
+                    resumed->computing = false;
+                    resumed->interest = POLLIN;
+                    monitorClient(resumed->socket->socketId);
+                    advanceHandshake(resumed);
+                }
+            });
+            handshakesComputing.fetch_sub(1, std::memory_order_release);
+        });
+        return;
+    }
+
+    uint32_t wanted = (status == HANDSHAKE_WANT_WRITE) ? POLLOUT : POLLIN;
+    if (wanted != pending->interest)
+    {
+        pending->interest = wanted;
+        setInterest(clientSocket, wanted);
+    }
+}
+
+/************************************************************************
+ * Multi reactor server (one event loop per thread, sharded by SO_REUSEPORT)
+ ************************************************************************/
+
+class ReactorServer;
+
+//one event loop of a ReactorServer: its own listening socket, EventManager and connection
+//table. A connection stays on the reactor that accepted it, so nothing in here is shared
+//between threads and handlers need no locking. Work handed to other threads (a TaskExecutor)
+//comes back through post() and finds its connection again with findConnection()
+struct Reactor {
+    int index;
+    ReactorServer *server;
+    std::unique_ptr<Server> listener;
+    EventManager *eventManager = NULL;                  //set while the reactor thread runs
+    ConnectionTable connections;
+    std::vector<Server::AcceptedClient> accepted;       //reused by every drain of the accept queue
+    TaskMailbox mailbox;                                //not the EventManager's, posts may come before it exists
+    std::thread thread;
+
+    //runs task on this reactor's thread, safe to call from any thread. Tasks still pending
+    //when the reactor stops are dropped
+    void post(std::function<void()> task);
+
+    //id of the connection currently using fd, 0 if there is none. Reactor thread only
+    uint64_t getConnectionId(int fd);
+
+    //the connection with this fd and id, NULL if it has been closed since (the fd may belong
+    //to a newer connection by now). Reactor thread only
+    Socket *findConnection(int fd, uint64_t id);
+};
+
+inline void Reactor::post(std::function<void()> task)
+{
+    mailbox.post(std::move(task));
+}
+
+inline uint64_t Reactor::getConnectionId(int fd)
+{
+    return connections.getId(fd);
+}
+
+inline Socket *Reactor::findConnection(int fd, uint64_t id)
+{
+    return connections.find(fd, id);
+}
+
+//runs numReactors event loops on their own threads. Every reactor listens on the same port
+//(SO_REUSEPORT), the kernel spreads new connections over the listeners and each connection is
+//handled by the reactor that accepted it. With cpuSteering a CBPF program hands a connection
+//to the reactor pinned to the CPU that received it, which works best with one reactor per CPU
+class ReactorServer {
+public:
+    //called on the owning reactor's thread. Returning false closes the connection. onConnect
+    //runs once the client's handshake is done. onMessage must take exactly one message out of
+    //the socket (getString()/getBytes())
+    std::function<bool(Reactor&, Socket&)> onConnect;
+    std::function<bool(Reactor&, Socket&)> onMessage;
+    std::function<void(Reactor&, Socket&)> onDisconnect;
+
+    //connections that send nothing for this long are closed, 0 keeps them open. Set before start()
+    int idleTimeoutMs = 0;
+
+    //runs the Kyber computations of the handshakes, so a burst of new connections is spread over
+    //every core instead of queueing on the reactors that accepted them. With CRYPTOGRAPHY the
+    //server starts a pool of its own, NULL computes on the reactor threads. Set before start(),
+    //a pool given here must outlive the server
+    TaskExecutor *handshakeWorkers = NULL;
+
+    //creates and binds every listening socket, throws if that fails (after closing everything
+    //built up to then). numReactors <= 0 uses one reactor per CPU
+    ReactorServer(int port, int numReactors, int maxConnections, bool cpuSteering = false,
+                  EventBackend backend = (EventBackend)EVENT_BASED_ARCHITECTURE);
+
+    //stops the reactors if that has not happened yet
+    ~ReactorServer();
+
+    ReactorServer(const ReactorServer&) = delete;
+    ReactorServer& operator=(const ReactorServer&) = delete;
+
+    //starts every reactor thread, set the handlers first
+    void start();
+
+    //asks every reactor to close its connections and exit. Safe to call from any thread,
+    //handlers included
+    void stop();
+
+    //blocks until every reactor has exited
+    void wait();
+
+    size_t getReactorCount();
+
+private:
+    std::vector<std::unique_ptr<Reactor>> reactors;
+    std::unique_ptr<TaskExecutor> cryptoWorkers;
+    std::atomic<bool> stopping{false};
+    int maxConnections;
+    bool cpuSteering;
+    EventBackend backend;
+
+    bool attachCpuSteering();
+    void runReactor(Reactor &reactor);
+    void acceptClients(Reactor &reactor);
+    void connectClient(Reactor &reactor, int clientSocket);
+    void handleClient(Reactor &reactor, int clientSocket);
+    void disconnect(Reactor &reactor, int clientSocket);
+};
+
+inline ReactorServer::ReactorServer(int port, int numReactors, int maxConnections, bool cpuSteering, EventBackend backend)
+: maxConnections(maxConnections), cpuSteering(cpuSteering), backend(backend)
+{
+    if (numReactors <= 0)
+    {
+        numReactors = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    //the listeners join the SO_REUSEPORT group in this order, which is the index the steering program returns.
+    //A reactor owns its listener and mailbox, so when a later one throws the ones built so far are closed again
+    for (int i = 0; i < numReactors; i++)
+    {
+        std::unique_ptr<Reactor> reactor(new Reactor());
+        reactor->index = i;
+        reactor->server = this;
+        reactor->listener.reset(new Server(port, maxConnections, false, true, true));
+        reactors.push_back(std::move(reactor));
+    }
+
+    if (cpuSteering && !attachCpuSteering())
+    {
+        perror("setsockopt(SO_ATTACH_REUSEPORT_CBPF) failed");
+        this->cpuSteering = false;
+    }
+
+    #if CRYPTOGRAPHY
+    //one worker per CPU at most, idle ones exit again after a burst
+    cryptoWorkers.reset(new TaskExecutor());
+    handshakeWorkers = cryptoWorkers.get();
+    #endif
+}
+
+inline ReactorServer::~ReactorServer()
+{
+    stop();
+    wait();
+}
+
+//classic BPF program run by the kernel for every new connection, it picks the listener with
+//the index of the receiving CPU (modulo the reactor count)
+inline bool ReactorServer::attachCpuSteering()
+{
+    sock_filter code[] = {
+        {BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU)},
+        {BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)reactors.size()},
+        {BPF_RET | BPF_A, 0, 0, 0},
+    };
+    sock_fprog program = {sizeof(code) / sizeof(code[0]), code};
+
+    //attaching to one listener applies to the whole group
+    return setsockopt(reactors[0]->listener->socketId, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) == 0;
+}
+
+inline void ReactorServer::start()
+{
+    stopping.store(false, std::memory_order_release);
+    for (std::unique_ptr<Reactor> &reactor : reactors)
+    {
+        Reactor *target = reactor.get();
+        reactor->thread = std::thread([this, target]() { runReactor(*target); });
+    }
+}
+
+inline void ReactorServer::stop()
+{
+    stopping.store(true, std::memory_order_release);
+    for (std::unique_ptr<Reactor> &reactor : reactors)
+    {
+        reactor->mailbox.wake();
+    }
+}
+
+inline void ReactorServer::wait()
+{
+    for (std::unique_ptr<Reactor> &reactor : reactors)
+    {
+        //a handler calling wait() must not join its own reactor
+        if (reactor->thread.joinable() && reactor->thread.get_id() != std::this_thread::get_id())
+        {
+            reactor->thread.join();
+        }
+    }
+}
+
+inline size_t ReactorServer::getReactorCount()
+{
+    return reactors.size();
+}
+
+inline void ReactorServer::runReactor(Reactor &reactor)
+{
+    //steering only keeps a connection on its CPU if the reactor runs there too
+    if (cpuSteering)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(reactor.index % CPU_SETSIZE, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+
+    //created on the reactor thread, some backends must only be used by the thread that made them
+    EventManager eventManager(backend, reactor.listener->socketId, maxConnections);
+    reactor.eventManager = &eventManager;
+    eventManager.setEdgeTriggered(true);
+    eventManager.monitorClient(reactor.mailbox.eventFd);
+    eventManager.setIdleHandler([this, &reactor](int clientSocket) {
+        if (reactor.getConnectionId(clientSocket) != 0)
+        {
+            disconnect(reactor, clientSocket);
+        }
+    });
+
+    while (!stopping.load(std::memory_order_acquire))
+    {
+        for (const ReadyEvent &event : eventManager.waitForEvents())
+        {
+            if (event.events == 0)
+            {
+                continue;
+            }
+
+            if (event.fd == CONN_ATTEMPT)
+            {
+                acceptClients(reactor);
+            }
+            else if (event.fd == reactor.mailbox.eventFd)
+            {
+                reactor.mailbox.runPending();
+            }
+            else
+            {
+                handleClient(reactor, event.fd);
+            }
+        }
+    }
+
+    //shutting down, close every connection this reactor owns
+    eventManager.stopMonitoring(reactor.mailbox.eventFd);
+    reactor.connections.forEach([this, &reactor](Socket &connection) {
+        disconnect(reactor, connection.socketId);
+    });
+    reactor.eventManager = NULL;
+}
+
+//takes every connection waiting on the reactor's listener, not just one per wakeup
+inline void ReactorServer::acceptClients(Reactor &reactor)
+{
+    reactor.accepted.clear();
+    reactor.listener->acceptPending(reactor.accepted);
+
+    for (const Server::AcceptedClient &client : reactor.accepted)
+    {
+        int clientSocket = client.socket;
+
+        //the key exchange runs between the reactor's other events instead of blocking it
+        Socket *connection = reactor.connections.add(clientSocket, false, true);
+        if (connection == NULL)
+        {
+            close(clientSocket);
+            continue;
+        }
+
+        //a peer that stalls the handshake is closed like an idle one
+        reactor.eventManager->handshake(connection, [this, &reactor, clientSocket](bool ok) {
+            if (!ok)
+            {
+                reactor.connections.remove(clientSocket);
+                return;
+            }
+            connectClient(reactor, clientSocket);
+        }, handshakeWorkers);
+        if (idleTimeoutMs > 0 && connection->handshakePending())
+        {
+            reactor.eventManager->setIdleTimeout(clientSocket, idleTimeoutMs);
+        }
+    }
+}
+
+//the client's handshake is done, hands it to onConnect and starts watching it for messages
+inline void ReactorServer::connectClient(Reactor &reactor, int clientSocket)
+{
+    Socket *connection = reactor.connections.find(clientSocket);
+
+    if (onConnect && !onConnect(reactor, *connection))
+    {
+        reactor.connections.remove(clientSocket);
+        return;
+    }
+
+    reactor.eventManager->monitorClient(clientSocket);
+    reactor.eventManager->autoFlush(connection);
+    if (idleTimeoutMs > 0)
+    {
+        reactor.eventManager->setIdleTimeout(clientSocket, idleTimeoutMs);
+    }
+}
+
+//reads everything the client sent and hands each complete message to onMessage
+inline void ReactorServer::handleClient(Reactor &reactor, int clientSocket)
+{
+    Socket *found = reactor.connections.find(clientSocket);
+    if (found == NULL)
+    {
+        reactor.eventManager->stopMonitoring(clientSocket);
+        return;
+    }
+
+    Socket &connection = *found;
+    bool connected = connection.receiveAvailable();
+
+    while (connection.hasBufferedMessage())
+    {
+        if (!onMessage || !onMessage(reactor, connection))
+        {
+            connected = false;
+            break;
+        }
+    }
+
+    if (!connected)
+    {
+        disconnect(reactor, clientSocket);
+    }
+    //a fast sender gets its turn again after everyone else that is ready
+    else if (connection.moreToReceive())
+    {
+        reactor.eventManager->requeue(clientSocket);
+    }
+}
+
+inline void ReactorServer::disconnect(Reactor &reactor, int clientSocket)
+{
+    //onConnect never saw a client that is still in its handshake
+    if (onDisconnect && !reactor.connections.find(clientSocket)->handshakePending())
+    {
+        onDisconnect(reactor, *reactor.connections.find(clientSocket));
+    }
+
+    //stop watching before the Socket destructor closes the fd
+    reactor.eventManager->stopMonitoring(clientSocket);
+    reactor.connections.remove(clientSocket);
+}
+
+/************************************************************************
+ * Leader/follower server (a thread pool sharing one epoll set)
+ ************************************************************************/
+
+//numThreads threads wait on one shared epoll set and whichever wakes up handles the event, so
+//uneven per connection cost is balanced across the pool instead of loading one reactor. Clients
+//are one shot: a client is handled by one thread at a time and re-armed once that thread is
+//done, after which any thread may pick it up next. Handlers therefore run concurrently for
+//different clients, state shared between clients must be locked by the handlers. Clients are
+//non-blocking and replies only go out as far as the kernel takes them, the rest waits for the
+//client to become writable. A peer that stops reading never holds up a thread, its sends fail
+//once the send high-water mark is passed (see Socket::setSendHighWater())
+class LeaderFollowerServer {
+public:
+    //returning false closes the connection. onConnect runs once the client's handshake is done,
+    //the handshake moves along on whichever thread the client is reported to, like its messages.
+    //onMessage must take exactly one message out of the socket (getString()/getBytes())
+    std::function<bool(Socket&)> onConnect;
+    std::function<bool(Socket&)> onMessage;
+    std::function<void(Socket&)> onDisconnect;
+
+    //binds and listens, throws if that fails
+    LeaderFollowerServer(int port, int numThreads, int maxConnections);
+
+    //stops the pool if that has not happened yet
+    ~LeaderFollowerServer();
+
+    LeaderFollowerServer(const LeaderFollowerServer&) = delete;
+    LeaderFollowerServer& operator=(const LeaderFollowerServer&) = delete;
+
+    //starts the threads, set the handlers first
+    void start();
+
+    //asks every thread to exit, safe to call from any thread, handlers included
+    void stop();
+
+    //blocks until every thread has exited, then closes the remaining connections
+    void wait();
+
+private:
+    //a connection moves between threads. busy is taken by the thread handling it, which makes
+    //the previous thread's changes to the Socket visible to the next one
+    struct Connection {
+        std::unique_ptr<Socket> socket;
+        std::atomic<bool> busy{false};
+        std::shared_ptr<FlushQueue> output = std::make_shared<FlushQueue>();    //holds just this socket
+        bool writable = false;          //its output backed up, so it is watched for POLLOUT as well
+        uint32_t interest = POLLIN;     //what it was last armed with
+        bool admitted = false;          //onConnect accepted it
+    };
+
+    Server listener;
+    EpollEventManager eventManager;
+    std::mutex acceptLock;              //acceptPending() is used by one thread at a time
+    std::vector<Server::AcceptedClient> accepted;   //guarded by acceptLock
+    std::mutex connectionsLock;
+    std::vector<std::unique_ptr<Connection>> connections;   //indexed by fd, guarded by connectionsLock
+    std::vector<std::thread> threads;
+    std::atomic<bool> stopping{false};
+    int numThreads;
+    int wakeFd;
+
+    void runWorker();
+    void acceptClients();
+    void handleClient(int clientSocket);
+    bool admit(Connection &connection);
+    void handBack(int clientSocket, Connection &connection, uint32_t interest);
+    void disconnect(int clientSocket);
+};
+
+inline LeaderFollowerServer::LeaderFollowerServer(int port, int numThreads, int maxConnections)
+: listener(port, maxConnections, false, true), eventManager(listener.socketId, maxConnections), numThreads(numThreads)
+{
+    //stays readable once written, so it wakes every thread on stop() (added before sharing so it is not one shot)
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeFd == -1)
+    {
+        throw std::runtime_error("Error creating pool eventfd");
+    }
+    eventManager.monitorClient(wakeFd);
+    eventManager.shareBetweenThreads();
+}
+
+inline LeaderFollowerServer::~LeaderFollowerServer()
+{
+    stop();
+    wait();
+    close(wakeFd);
+}
+
+inline void LeaderFollowerServer::start()
+{
+    uint64_t count;
+
+    //forget an earlier stop()
+    stopping.store(false, std::memory_order_release);
+    while (read(wakeFd, &count, sizeof(count)) > 0)
+    {
+    }
+
+    for (int i = 0; i < std::max(numThreads, 1); i++)
+    {
+        threads.emplace_back([this]() { runWorker(); });
+    }
+}
+
+inline void LeaderFollowerServer::stop()
+{
+    uint64_t wake = 1;
+
+    stopping.store(true, std::memory_order_release);
+    if (write(wakeFd, &wake, sizeof(wake)) < 0)
+    {
+        perror("Error waking thread pool");
+    }
+}
+
+inline void LeaderFollowerServer::wait()
+{
+    for (std::thread &thread : threads)
+    {
+        //a handler calling wait() must not join its own thread
+        if (thread.joinable() && thread.get_id() != std::this_thread::get_id())
+        {
+            thread.join();
+        }
+    }
+    threads.clear();
+
+    //nobody is handling events anymore, close whatever is still connected
+    for (size_t fd = 0; fd < connections.size(); fd++)
+    {
+        if (connections[fd])
+        {
+            disconnect(fd);
+        }
+    }
+}
+
+inline void LeaderFollowerServer::runWorker()
+{
+    //one event per wait: the leader takes a single event and leaves the rest to its followers
+    ReadyEvent event[1];
+
+    while (!stopping.load(std::memory_order_acquire))
+    {
+        for (const ReadyEvent &ready : eventManager.waitForEvents(event))
+        {
+            if (ready.fd == CONN_ATTEMPT)
+            {
+                acceptClients();
+            }
+            else if (ready.fd != wakeFd)
+            {
+                handleClient(ready.fd);
+            }
+        }
+    }
+}
+
+//drains the accept queue. A thread that finds another one doing it leaves, the listener is level
+//triggered and is reported again if connections are still waiting once that thread is done
+inline void LeaderFollowerServer::acceptClients()
+{
+    std::unique_lock<std::mutex> accepting(acceptLock, std::try_to_lock);
+    if (!accepting.owns_lock())
+    {
+        return;
+    }
+
+    accepted.clear();
+    listener.acceptPending(accepted);
+    for (const Server::AcceptedClient &client : accepted)
+    {
+        int clientSocket = client.socket;
+
+        if (stopping.load(std::memory_order_acquire))
+        {
+            close(clientSocket);
+            continue;
+        }
+
+        //the key exchange is left to handleClient(), so a silent peer never holds a thread
+        std::unique_ptr<Connection> connection(new Connection());
+        connection->socket.reset(new Socket(clientSocket, false, true));
+
+        Connection *watched = connection.get();
+        connection->output->watchWritable = [watched](int, bool writable) {
+            watched->writable = writable;
+        };
+
+        //the server's first handshake step is a read, the client is reported once it arrives
+        if (!connection->socket->handshakePending() && !admit(*connection))
+        {
+            continue;
+        }
+
+        //the table entry must exist before the client can be reported
+        {
+            std::lock_guard<std::mutex> lock(connectionsLock);
+            if ((size_t)clientSocket >= connections.size())
+            {
+                connections.resize(clientSocket + 1);
+            }
+            connections[clientSocket] = std::move(connection);
+        }
+        eventManager.monitorClient(clientSocket);
+    }
+}
+
+inline void LeaderFollowerServer::handleClient(int clientSocket)
+{
+    Connection *connection = NULL;
+
+    {
+        std::lock_guard<std::mutex> lock(connectionsLock);
+        if ((size_t)clientSocket < connections.size())
+        {
+            connection = connections[clientSocket].get();
+        }
+    }
+
+    //one shot reports a client to a single thread, so it can never be busy here
+    if (connection == NULL || connection->busy.exchange(true, std::memory_order_acquire))
+    {
+        return;
+    }
+
+    Socket &socket = *connection->socket;
+
+    //the handshake moves along as far as it gets, the client is handed back until it can go on
+    if (socket.handshakePending())
+    {
+        HandshakeStatus status = socket.continueHandshake();
+        if (status == HANDSHAKE_FAILED)
+        {
+            disconnect(clientSocket);
+            return;
+        }
+        if (status != HANDSHAKE_DONE)
+        {
+            handBack(clientSocket, *connection, status == HANDSHAKE_WANT_WRITE ? POLLOUT : POLLIN);
+            return;
+        }
+        if (!admit(*connection))
+        {
+            disconnect(clientSocket);
+            return;
+        }
+    }
+
+    bool connected = socket.receiveAvailable();
+
+    while (socket.hasBufferedMessage())
+    {
+        if (!onMessage || !onMessage(socket))
+        {
+            connected = false;
+            break;
+        }
+    }
+
+    if (!connected)
+    {
+        disconnect(clientSocket);
+        return;
+    }
+
+    //send what the kernel takes now, a backed up client is watched for POLLOUT until it drained
+    connection->output->flushAll();
+    handBack(clientSocket, *connection, connection->writable ? POLLIN | POLLOUT : POLLIN);
+}
+
+//the client's handshake is done, its replies now go out through its own flush queue: together
+//once the handlers are done and only as far as the kernel takes them
+inline bool LeaderFollowerServer::admit(Connection &connection)
+{
+    connection.socket->setFlushQueue(connection.output);
+    if (onConnect && !onConnect(*connection.socket))
+    {
+        return false;
+    }
+    connection.admitted = true;
+    connection.output->flushAll();
+    return true;
+}
+
+//rearms the client for interest. Only this changes what it is watched for, it must not be
+//reported again while a thread still holds it
+inline void LeaderFollowerServer::handBack(int clientSocket, Connection &connection, uint32_t interest)
+{
+    bool interestChanged = interest != connection.interest;
+    connection.interest = interest;
+
+    //the next thread the client is reported to sees everything done here
+    connection.busy.store(false, std::memory_order_release);
+    if (interestChanged)
+    {
+        eventManager.setInterest(clientSocket, interest);
+    }
+    else
+    {
+        eventManager.rearm(clientSocket);
+    }
+}
+
+inline void LeaderFollowerServer::disconnect(int clientSocket)
+{
+    std::unique_ptr<Connection> connection;
+
+    //take it out of the table first, the fd number may be reused as soon as the Socket closes it
+    eventManager.stopMonitoring(clientSocket);
+    {
+        std::lock_guard<std::mutex> lock(connectionsLock);
+        connection = std::move(connections[clientSocket]);
+    }
+
+    //onConnect never saw a client that did not finish its handshake or was refused
+    if (onDisconnect && connection->admitted)
+    {
+        onDisconnect(*connection->socket);
+    }
+}
+
+/************************************************************************
+ * Coroutines (sequential per connection code on one event loop thread)
+ ************************************************************************/
+
+class AsyncServer;
+
+//state shared by every Task coroutine: who to resume once it finishes
+struct TaskPromiseBase {
+    std::coroutine_handle<> self;
+    std::coroutine_handle<> continuation;   //the coroutine awaiting this one
+    std::exception_ptr exception;
+    AsyncServer *owner = NULL;              //set for tasks started with AsyncServer::spawn()
+
+    //tasks are lazy, they start running once awaited or spawned
+    std::suspend_always initial_suspend() noexcept
+    {
+        return {};
+    }
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept
+        {
+            return false;
+        }
+        template <class Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+        {
+            return handle.promise().finish();
+        }
+        void await_resume() noexcept
+        {
+        }
+    };
+
+    FinalAwaiter final_suspend() noexcept
+    {
+        return {};
+    }
+
+    void unhandled_exception()
+    {
+        exception = std::current_exception();
+    }
+
+    //the coroutine to run next once this one is done
+    std::coroutine_handle<> finish() noexcept;
+};
+
+template <class T>
+class Task;
+
+template <class T>
+struct TaskPromise : TaskPromiseBase {
+    std::optional<T> value;
+
+    Task<T> get_return_object();
+
+    void return_value(T result)
+    {
+        value.emplace(std::move(result));
+    }
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase {
+    Task<void> get_return_object();
+
+    void return_void()
+    {
+    }
+};
+
+//return type of coroutines driven by an AsyncServer. A Task does nothing until it is awaited
+//with co_await, which runs it and resumes the awaiting coroutine with its result once it is done.
+//Tasks nobody awaits are started with AsyncServer::spawn()
+template <class T = void>
+class Task {
+public:
+    using promise_type = TaskPromise<T>;
+
+    Task(Task &&other) noexcept
+    : handle(std::exchange(other.handle, {}))
+    {
+    }
+
+    //destroying a task that has not finished destroys the whole chain of coroutines it awaits
+    ~Task()
+    {
+        if (handle)
+        {
+            handle.destroy();
+        }
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    bool await_ready() noexcept
+    {
+        return false;
+    }
+
+    //symmetric transfer, so chains of tasks finishing at once do not grow the stack
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept
+    {
+        handle.promise().continuation = awaiter;
+        return handle;
+    }
+
+    T await_resume()
+    {
+        if (handle.promise().exception)
+        {
+            std::rethrow_exception(handle.promise().exception);
+        }
+        if constexpr (!std::is_void_v<T>)
+        {
+            return std::move(*handle.promise().value);
+        }
+    }
+
+private:
+    friend struct TaskPromise<T>;
+    friend class AsyncServer;
+
+    explicit Task(std::coroutine_handle<promise_type> handle)
+    : handle(handle)
+    {
+    }
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+template <class T>
+Task<T> TaskPromise<T>::get_return_object()
+{
+    self = std::coroutine_handle<TaskPromise<T>>::from_promise(*this);
+    return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object()
+{
+    self = std::coroutine_handle<TaskPromise<void>>::from_promise(*this);
+    return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+class AsyncSocket;
+
+//single threaded server whose connections are handled by coroutines. Every co_await on a socket
+//that is not ready suspends the coroutine and registers it with the EventManager, run() resumes
+//it once the backend reports the fd, so sequential looking per connection code runs without
+//blocking and without a thread per connection:
+//
+//    Task<> serve(std::unique_ptr<AsyncSocket> conn)
+//    {
+//        while (std::optional<string> message = co_await conn->recvMessage())
+//        {
+//            if (!co_await conn->send(*message)) break;
+//        }
+//    }
+//
+//    Task<> acceptClients(AsyncServer &server)
+//    {
+//        while (std::unique_ptr<AsyncSocket> conn = co_await server.accept())
+//        {
+//            server.spawn(serve(std::move(conn)));
+//        }
+//    }
+//
+//Everything except stop() and post() must be used from the thread that calls run(). The key
+//exchange of CRYPTOGRAPHY runs in the connection's coroutine before its first message, so a
+//slow peer only suspends its own coroutine
+class AsyncServer {
+public:
+    //binds and listens, throws if that fails
+    AsyncServer(int port, int maxConnections, EventBackend backend = (EventBackend)EVENT_BASED_ARCHITECTURE);
+
+    //destroys the coroutines that are still suspended, which closes their sockets
+    ~AsyncServer();
+
+    AsyncServer(const AsyncServer&) = delete;
+    AsyncServer& operator=(const AsyncServer&) = delete;
+
+    //runs task until its first suspension, after that it is resumed by run(). An exception
+    //escaping a spawned task terminates the program, like one escaping a std::thread
+    void spawn(Task<void> task);
+
+    //handles events and resumes coroutines until stop() is called
+    void run();
+
+    //makes run() return, safe to call from any thread and from coroutines
+    void stop();
+
+    //runs task on the loop thread, safe to call from any thread (see EventManager::post())
+    void post(std::function<void()> task);
+
+    //the next client, NULL once accepting fails
+    Task<std::unique_ptr<AsyncSocket>> accept();
+
+    EventManager &getEventManager();
+
+private:
+    friend class AsyncSocket;
+    friend struct TaskPromiseBase;
+
+    //the coroutines waiting for one fd. interest is what the backend watches it for, it is
+    //widened when a coroutine starts waiting and only narrowed once an event finds nobody
+    //waiting, so a loop that keeps reading does not change it on every message
+    struct FdWaiters {
+        std::coroutine_handle<> reader;
+        std::coroutine_handle<> writer;
+        uint32_t interest = 0;
+    };
+
+    //suspends the awaiting coroutine until the fd is ready for events (POLLIN or POLLOUT)
+    struct ReadyAwaiter {
+        AsyncServer &server;
+        int fd;
+        uint32_t events;
+
+        bool await_ready() noexcept
+        {
+            return false;
+        }
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            server.waitFor(fd, events, handle);
+        }
+        void await_resume() noexcept
+        {
+        }
+    };
+
+    //suspends the awaiting coroutine until a connection has been accepted
+    struct AcceptAwaiter {
+        AsyncServer &server;
+
+        bool await_ready() noexcept
+        {
+            return !server.acceptedClients.empty();
+        }
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            server.acceptors.push_back(handle);
+        }
+        void await_resume() noexcept
+        {
+        }
+    };
+
+    Server listener;
+    EventManager eventManager;
+    bool stopping = false;
+    std::vector<FdWaiters> waiters;                     //indexed by fd
+    std::deque<std::coroutine_handle<>> acceptors;      //coroutines waiting in accept()
+    std::deque<int> acceptedClients;                    //accepted while nobody was waiting
+    std::vector<Server::AcceptedClient> acceptBatch;    //reused by drainAcceptQueue()
+    std::vector<TaskPromiseBase*> spawned;              //spawned tasks that have not finished
+
+    FdWaiters &waitersOf(int fd);
+    void waitFor(int fd, uint32_t events, std::coroutine_handle<> handle);
+    void setInterest(int fd, uint32_t events);
+    void forget(int fd);
+    void acceptClients();
+    size_t drainAcceptQueue();
+    void resumeWaiters(const ReadyEvent &event);
+    void finished(TaskPromiseBase &promise);
+};
+
+//a connection owned by a coroutine of an AsyncServer. The socket is non-blocking and corked:
+//send() appends to the output buffer and then waits until the kernel has taken all of it.
+//At most one coroutine may wait to receive and one to send on a connection at a time
+class AsyncSocket {
+public:
+    //takes over an accepted client socket
+    AsyncSocket(AsyncServer &server, int clientSocket);
+
+    //stops watching the fd, then the Socket closes it
+    ~AsyncSocket();
+
+    AsyncSocket(const AsyncSocket&) = delete;
+    AsyncSocket& operator=(const AsyncSocket&) = delete;
+
+    //the next message, empty once the peer closed the connection or it failed
+    Task<std::optional<string>> recvMessage();
+    Task<std::optional<std::vector<uint8_t>>> recvBytes();
+
+    //sends one message, true once all of it has been handed to the kernel
+    Task<bool> send(string message);
+    Task<bool> sendBytes(std::vector<uint8_t> data);
+
+    //the underlying socket for everything that does not wait (e.g. setReceiveBufferSize())
+    Socket &getSocket();
+
+private:
+    AsyncServer &server;
+    std::unique_ptr<Socket> socket;
+
+    Task<bool> finishHandshake();
+    Task<bool> waitForMessage();
+    Task<bool> drain();
+};
+
+inline std::coroutine_handle<> TaskPromiseBase::finish() noexcept
+{
+    if (continuation)
+    {
+        return continuation;
+    }
+
+    //a spawned task has nobody to hand its result to, it cleans up after itself
+    if (owner != NULL)
+    {
+        if (exception)
+        {
+            std::terminate();
+        }
+        owner->finished(*this);
+        self.destroy();
+    }
+    return std::noop_coroutine();
+}
+
+inline AsyncServer::AsyncServer(int port, int maxConnections, EventBackend backend)
+: listener(port, maxConnections, false, true), eventManager(backend, listener.socketId, maxConnections)
+{
+    //a connection that is gone before accept() gets to it must not block the loop
+    listener.setNonBlocking(true);
+}
+
+inline AsyncServer::~AsyncServer()
+{
+    //destroying a suspended coroutine destroys its locals, including the AsyncSockets it owns
+    while (!spawned.empty())
+    {
+        std::coroutine_handle<> handle = spawned.back()->self;
+        spawned.pop_back();
+        handle.destroy();
+    }
+
+    for (int clientSocket : acceptedClients)
+    {
+        close(clientSocket);
+    }
+}
+
+inline void AsyncServer::spawn(Task<void> task)
+{
+    std::coroutine_handle<TaskPromise<void>> handle = std::exchange(task.handle, {});
+
+    handle.promise().owner = this;
+    spawned.push_back(&handle.promise());
+    handle.resume();
+}
+
+inline void AsyncServer::finished(TaskPromiseBase &promise)
+{
+    spawned.erase(std::find(spawned.begin(), spawned.end(), &promise));
+}
+
+inline void AsyncServer::run()
+{
+    stopping = false;
+
+    while (!stopping)
+    {
+        for (const ReadyEvent &event : eventManager.waitForEvents())
+        {
+            if (event.events == 0)
+            {
+                continue;
+            }
+
+            if (event.fd == CONN_ATTEMPT)
+            {
+                acceptClients();
+            }
+            else
+            {
+                resumeWaiters(event);
+            }
+        }
+    }
+}
+
+inline void AsyncServer::stop()
+{
+    eventManager.post([this]() { stopping = true; });
+}
+
+inline void AsyncServer::post(std::function<void()> task)
+{
+    eventManager.post(std::move(task));
+}
+
+inline EventManager &AsyncServer::getEventManager()
+{
+    return eventManager;
+}
+
+inline Task<std::unique_ptr<AsyncSocket>> AsyncServer::accept()
+{
+    while (acceptedClients.empty())
+    {
+        if (drainAcceptQueue() > 0)
+        {
+            break;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            co_return NULL;
+        }
+        co_await AcceptAwaiter{*this};
+    }
+
+    int clientSocket = acceptedClients.front();
+    acceptedClients.pop_front();
+    co_return std::unique_ptr<AsyncSocket>(new AsyncSocket(*this, clientSocket));
+}
+
+//accepts every waiting connection, even with nobody in accept() the listener has to be drained
+//or level triggered backends would keep reporting it
+inline void AsyncServer::acceptClients()
+{
+    drainAcceptQueue();
+
+    while (!acceptors.empty() && !acceptedClients.empty())
+    {
+        std::coroutine_handle<> acceptor = acceptors.front();
+        acceptors.pop_front();
+        acceptor.resume();
+    }
+}
+
+//moves every connection waiting in the listener's queue to acceptedClients
+inline size_t AsyncServer::drainAcceptQueue()
+{
+    acceptBatch.clear();
+    size_t taken = listener.acceptPending(acceptBatch);
+
+    for (const Server::AcceptedClient &client : acceptBatch)
+    {
+        acceptedClients.push_back(client.socket);
+    }
+    return taken;
+}
+
+inline AsyncServer::FdWaiters &AsyncServer::waitersOf(int fd)
+{
+    if ((size_t)fd >= waiters.size())
+    {
+        waiters.resize(fd * 2 + 1);
+    }
+    return waiters[fd];
+}
+
+inline void AsyncServer::waitFor(int fd, uint32_t events, std::coroutine_handle<> handle)
+{
+    FdWaiters &fdWaiters = waitersOf(fd);
+
+    if (events & POLLIN)
+    {
+        fdWaiters.reader = handle;
+    }
+    else
+    {
+        fdWaiters.writer = handle;
+    }
+    setInterest(fd, fdWaiters.interest | events);
+}
+
+//tells the backend what to watch fd for, 0 stops watching it
+inline void AsyncServer::setInterest(int fd, uint32_t events)
+{
+    FdWaiters &fdWaiters = waitersOf(fd);
+
+    if (events == fdWaiters.interest)
+    {
+        return;
+    }
+
+    if (events == 0)
+    {
+        eventManager.stopMonitoring(fd);
+    }
+    else
+    {
+        //a freshly monitored fd is already watched for POLLIN, anything else (narrowing back to
+        //POLLIN included) has to reach the backend or a writable socket is reported forever
+        if (fdWaiters.interest == 0)
+        {
+            eventManager.monitorClient(fd);
+            if (events != POLLIN)
+            {
+                eventManager.setInterest(fd, events);
+            }
+        }
+        else
+        {
+            eventManager.setInterest(fd, events);
+        }
+    }
+    fdWaiters.interest = events;
+}
+
+//the socket is about to close, drop everything known about its fd
+inline void AsyncServer::forget(int fd)
+{
+    FdWaiters &fdWaiters = waitersOf(fd);
+
+    if (fdWaiters.interest != 0)
+    {
+        eventManager.stopMonitoring(fd);
+    }
+    fdWaiters = FdWaiters();
+}
+
+//readiness is only a hint, the resumed coroutines retry and wait again if there is nothing to do
+inline void AsyncServer::resumeWaiters(const ReadyEvent &event)
+{
+    uint32_t failed = POLLERR | POLLHUP;
+    bool resumed = false;
+
+    if ((event.events & (POLLIN | failed)) && waitersOf(event.fd).reader)
+    {
+        std::exchange(waitersOf(event.fd).reader, {}).resume();
+        resumed = true;
+    }
+
+    //look the writer up again, the reader may have closed the connection
+    if ((event.events & (POLLOUT | failed)) && waitersOf(event.fd).writer)
+    {
+        std::exchange(waitersOf(event.fd).writer, {}).resume();
+        resumed = true;
+    }
+
+    //nobody wanted this, stop watching for what nobody waits for
+    if (!resumed)
+    {
+        FdWaiters &fdWaiters = waitersOf(event.fd);
+        setInterest(event.fd, (fdWaiters.reader ? POLLIN : 0) | (fdWaiters.writer ? POLLOUT : 0));
+    }
+}
+
+inline AsyncSocket::AsyncSocket(AsyncServer &server, int clientSocket)
+: server(server), socket(new Socket(clientSocket, false, true))
+{
+    socket->setNonBlocking(true);
+
+    //sends only fill the output buffer, drain() hands it to the kernel
+    socket->setCorked(true);
+    socket->setCorkFlushThreshold(SIZE_MAX);
+}
+
+inline AsyncSocket::~AsyncSocket()
+{
+    server.forget(socket->socketId);
+}
+
+inline Socket &AsyncSocket::getSocket()
+{
+    return *socket;
+}
+
+//runs the handshake until it is done, suspending whenever the peer is not ready
+inline Task<bool> AsyncSocket::finishHandshake()
+{
+    HandshakeStatus status;
+
+    while ((status = socket->continueHandshake()) != HANDSHAKE_DONE)
+    {
+        if (status == HANDSHAKE_FAILED)
+        {
+            co_return false;
+        }
+        co_await AsyncServer::ReadyAwaiter{server, socket->socketId, (uint32_t)(status == HANDSHAKE_WANT_READ ? POLLIN : POLLOUT)};
+    }
+    co_return true;
+}
+
+//true once a complete message is buffered, false if the connection ends first
+inline Task<bool> AsyncSocket::waitForMessage()
+{
+    //awaited into a variable first, gcc 12 miscompiles a co_await inside the condition when
+    //the coroutine awaits again afterwards
+    if (socket->handshakePending())
+    {
+        bool ready = co_await finishHandshake();
+        if (!ready)
+        {
+            co_return false;
+        }
+    }
+
+    while (!socket->hasBufferedMessage())
+    {
+        bool open = socket->receiveAvailable();
+
+        //messages that arrived before the peer closed are still handed out
+        if (socket->hasBufferedMessage())
+        {
+            break;
+        }
+        if (!open)
+        {
+            co_return false;
+        }
+        co_await AsyncServer::ReadyAwaiter{server, socket->socketId, POLLIN};
+    }
+    co_return true;
+}
+
+inline Task<std::optional<string>> AsyncSocket::recvMessage()
+{
+    string message;
+
+    if (!co_await waitForMessage() || !socket->getString(message))
+    {
+        co_return std::nullopt;
+    }
+    co_return message;
+}
+
+inline Task<std::optional<std::vector<uint8_t>>> AsyncSocket::recvBytes()
+{
+    std::vector<uint8_t> data;
+
+    if (!co_await waitForMessage() || !socket->getBytes(data))
+    {
+        co_return std::nullopt;
+    }
+    co_return data;
+}
+
+//waits until everything in the output buffer has been handed to the kernel
+inline Task<bool> AsyncSocket::drain()
+{
+    while (true)
+    {
+        if (!socket->flushAvailable())
+        {
+            co_return false;
+        }
+        if (socket->pendingSendBytes() == 0)
+        {
+            co_return true;
+        }
+        co_await AsyncServer::ReadyAwaiter{server, socket->socketId, POLLOUT};
+    }
+}
+
+inline Task<bool> AsyncSocket::send(string message)
+{
+    if (socket->handshakePending())
+    {
+        bool ready = co_await finishHandshake();
+        if (!ready)
+        {
+            co_return false;
+        }
+    }
+    if (!socket->sendString(message))
+    {
+        co_return false;
+    }
+    co_return co_await drain();
+}
+
+inline Task<bool> AsyncSocket::sendBytes(std::vector<uint8_t> data)
+{
+    if (socket->handshakePending())
+    {
+        bool ready = co_await finishHandshake();
+        if (!ready)
+        {
+            co_return false;
+        }
+    }
+    if (!socket->sendBytes(data))
+    {
+        co_return false;
+    }
+    co_return co_await drain();
+}
+
+#endif //event based 
+
+
+/************************************************************************
+ * Keypair pool (Kyber keypairs generated ahead of the handshakes)
+ ************************************************************************/
+
+#if CRYPTOGRAPHY
+//keeps up to highWatermark Kyber keypairs ready for the handshakes of the responding side (see
+//Socket::setKeypairPool()). Background threads generate them with prng::prng_t, starting once
+//fewer than lowWatermark are left and stopping at highWatermark, so keygen runs between
+//connection bursts instead of while a connection is being set up. Each keypair is handed out once.
+//Safe to use from any thread
+class KeypairPool {
+public:
+    //fills the pool in the background right away
+    KeypairPool(size_t lowWatermark = DEFAULT_KEYPAIR_POOL_LOW, size_t highWatermark = DEFAULT_KEYPAIR_POOL_HIGH,
+                size_t numThreads = 1);
+
+    //stops the threads and wipes the keypairs that were never used
+    ~KeypairPool();
+
+    KeypairPool(const KeypairPool&) = delete;
+    KeypairPool& operator=(const KeypairPool&) = delete;
+
+    //moves a keypair into publicKey and secretKey, false if none is ready right now
+    bool take(std::vector<uint8_t> &publicKey, std::vector<uint8_t> &secretKey);
+
+    size_t size();
+
+    struct Stats {
+        uint64_t generated;     //keypairs made by the background threads
+        uint64_t taken;         //keypairs handed out by take()
+        uint64_t misses;        //take() calls that found the pool empty
+    };
+    Stats getStats();
+
+    //generates one keypair on the calling thread, what the handshake does without a pool
+    static void generate(std::vector<uint8_t> &publicKey, std::vector<uint8_t> &secretKey);
+
+private:
+    struct Keypair {
+        std::vector<uint8_t> publicKey;
+        std::vector<uint8_t> secretKey;
+    };
+
+    std::mutex lock;
+    std::condition_variable refill;
+    std::deque<Keypair> ready;          //guarded by lock
+    size_t generating = 0;              //keypairs being made right now, guarded by lock
+    bool refilling = false;             //between dropping below low and reaching high, guarded by lock
+    bool stopping = false;              //guarded by lock
+    size_t lowWatermark;
+    size_t highWatermark;
+    Stats stats = {};                   //guarded by lock
+    std::vector<std::thread> threads;
+
+    void runRefill();
+};
+
+inline KeypairPool::KeypairPool(size_t lowWatermark, size_t highWatermark, size_t numThreads)
+: highWatermark(std::max<size_t>(highWatermark, 1))
+{
+    //an empty pool always counts as low
+    this->lowWatermark = std::clamp<size_t>(lowWatermark, 1, this->highWatermark);
+
+    //starts out empty, i.e. below any low watermark
+    refilling = true;
+    for (size_t i = 0; i < std::max<size_t>(numThreads, 1); i++)
+    {
+        threads.emplace_back([this]() { runRefill(); });
+    }
+}
+
+inline KeypairPool::~KeypairPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    refill.notify_all();
+
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+
+    for (Keypair &keypair : ready)
+    {
+        OPENSSL_cleanse(keypair.secretKey.data(), keypair.secretKey.size());
+    }
+}
+
+inline bool KeypairPool::take(std::vector<uint8_t> &publicKey, std::vector<uint8_t> &secretKey)
+{
+    std::unique_lock<std::mutex> guard(lock);
+
+    if (ready.empty())
+    {
+        stats.misses++;
+        return false;
+    }
+
+    publicKey = std::move(ready.front().publicKey);
+    secretKey = std::move(ready.front().secretKey);
+    ready.pop_front();
+    stats.taken++;
+
+    //only wake the threads when crossing the low watermark, not on every take
+    if (!refilling && ready.size() < lowWatermark)
+    {
+        refilling = true;
+        guard.unlock();
+        refill.notify_all();
+    }
+    return true;
+}
+
+inline size_t KeypairPool::size()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return ready.size();
+}
+
+inline KeypairPool::Stats KeypairPool::getStats()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return stats;
+}
+
+inline void KeypairPool::generate(std::vector<uint8_t> &publicKey, std::vector<uint8_t> &secretKey)
+{
+    // seed variables required for keypair generation
+    std::vector<uint8_t> d(SEED_LEN, 0);
+    std::vector<uint8_t> z(SEED_LEN, 0);
+    auto _d = std::span<uint8_t, SEED_LEN>(d);
+    auto _z = std::span<uint8_t, SEED_LEN>(z);
+
+    // public/ private keypair variables
+    publicKey.resize(kyber1024_kem::PKEY_LEN);
+    secretKey.resize(kyber1024_kem::SKEY_LEN);
+    auto _pkey = std::span<uint8_t, kyber1024_kem::PKEY_LEN>(publicKey);
+    auto _skey = std::span<uint8_t, kyber1024_kem::SKEY_LEN>(secretKey);
+
+    // fill up keygen seeds using PRNG
+    prng::prng_t prng;
+    prng.read(_d);
+    prng.read(_z);
+
+    // generate a keypair
+    kyber1024_kem::keygen(_d, _z, _pkey, _skey);
+}
+
+//background thread, sleeps until the pool is below the low watermark and then fills it up to the
+//high one. Keypairs are generated outside the lock
+inline void KeypairPool::runRefill()
+{
+    std::unique_lock<std::mutex> guard(lock);
+
+    while (true)
+    {
+        refill.wait(guard, [this]() { return stopping || (refilling && ready.size() + generating < highWatermark); });
+        if (stopping)
+        {
+            return;
+        }
+
+        generating++;
+        guard.unlock();
+
+        Keypair keypair;
+        generate(keypair.publicKey, keypair.secretKey);
+
+        guard.lock();
+        generating--;
+        ready.push_back(std::move(keypair));
+        stats.generated++;
+        if (ready.size() >= highWatermark)
+        {
+            refilling = false;
+        }
+    }
+}
+#endif //CRYPTOGRAPHY
+
 
-        //init an epoll instance which has a queue NUM_CONNECTIONS long
-        epollFD = epoll_create(maxConnections);
-        
-        // Set the file descriptor to monitor
-        newConnectionEvent.data.fd = serverSocket;
+/************************************************************************
+ * Session resumption (tickets that let a returning client skip the Kyber KEM)
+ ************************************************************************/
 
-        // Specify the event(s) to monitor for
-        newConnectionEvent.events = EPOLLIN; 
+#if CRYPTOGRAPHY
+//the keys a server seals its resumption tickets with (see Socket::setTicketKeys()). Tickets are
+//sealed with the current key, which is replaced once it is rotationSeconds old. The previous key
+//is kept for one more rotation so tickets issued just before still open, older tickets are
+//rejected. Every ticket opens once, a replayed one is rejected. Given a path (linux only) the
+//keys live in that file, memory mapped, so tickets survive a server restart. Which tickets were
+//used is only kept in memory, a restart forgets it. The file holds the keys in plain, keep it
+//private to one server process. Safe to use from any thread
+class TicketKeys {
+public:
+    //throws if the key file can not be opened or mapped
+    TicketKeys(int rotationSeconds = DEFAULT_TICKET_ROTATION_SECONDS, const string &path = "");
 
-        // Add the server socket to the epoll instance
-        epoll_ctl(epollFD, EPOLL_CTL_ADD, serverSocket, &newConnectionEvent);
-        
-        // Allocate memory for an array of epoll events to store event notifications
-        events = (epoll_event*)malloc(MAX_FDS*sizeof(struct epoll_event));
+    //unmaps the key file, in memory keys are wiped
+    ~TicketKeys();
+
+    TicketKeys(const TicketKeys&) = delete;
+    TicketKeys& operator=(const TicketKeys&) = delete;
+
+    //encrypts secret (RESUMPTION_SECRET_LEN bytes) into ticket (TICKET_LEN bytes)
+    bool seal(std::span<const uint8_t> secret, std::span<uint8_t> ticket);
+
+    //decrypts ticket into secret, false if it was tampered with, its key is gone, it is too old
+    //or it was opened before
+    bool open(std::span<const uint8_t> ticket, std::vector<uint8_t> &secret);
+
+    //replaces the current key right away, e.g. when it may have leaked
+    bool rotate();
+
+    struct Stats {
+        uint64_t issued;        //tickets sealed
+        uint64_t accepted;      //tickets opened
+        uint64_t rejected;      //tickets that did not open, replays included
+        uint64_t replayed;      //tickets rejected because they were opened before
+    };
+    Stats getStats();
+
+private:
+    struct Key {
+        uint32_t id;            //the first bytes of every ticket sealed with it, 0 for no key
+        int64_t created;        //time(NULL) when it became the current key
+        uint8_t secret[KEY_LEN];
+    };
+
+    //layout of the key file
+    struct KeyFile {
+        uint64_t magic;
+        Key current;
+        Key previous;
+    };
+    static constexpr uint64_t KEY_FILE_MAGIC = 0x31594b54454b4353;
+
+    std::mutex lock;
+    KeyFile *keys;              //the mapped file or ownKeys, guarded by lock
+    KeyFile ownKeys = {};
+    int rotationSeconds;
+    Stats stats = {};           //guarded by lock
+
+    //key id and nonce of every opened ticket that is not too old yet, with the time it will be.
+    //Expired ones are dropped once per rotation. Guarded by lock
+    std::unordered_map<string, int64_t> usedTickets;
+    int64_t nextUsedTicketsPurge = 0;
+
+    bool rotateLocked(int64_t now);
+    static bool crypt(bool encrypting, const Key &key, const uint8_t *nonce, const uint8_t *in, size_t length,
+                      uint8_t *out, uint8_t *tag);
+};
+
+//the tickets a client got from the servers it talked to and the long-term keys of servers it
+//connects to with 0-RTT, by "ip:port" (see Socket::setSessionCache()).
+//A ticket is handed out once, resuming with it brings the next one. When full, storing a session
+//for a new server drops another one. Safe to use from any thread
+class SessionCache {
+public:
+    SessionCache(size_t capacity = DEFAULT_SESSION_CACHE_LEN);
+
+    //wipes the secrets that were never used
+    ~SessionCache();
+
+    SessionCache(const SessionCache&) = delete;
+    SessionCache& operator=(const SessionCache&) = delete;
+
+    //keeps ticket and the secret it carries for the next connection to server
+    void store(const string &server, std::span<const uint8_t> ticket, std::span<const uint8_t> secret);
+
+    //moves the session for server out of the cache, false if there is none
+    bool take(const string &server, std::vector<uint8_t> &ticket, std::vector<uint8_t> &secret);
+
+    size_t size();
+
+    //the long-term public key of server (see ServerKeypair::getPublicKey()), connections to it
+    //then use the 0-RTT handshake. These are never dropped, an empty key forgets one
+    void setServerKey(const string &server, std::span<const uint8_t> publicKey);
+    bool getServerKey(const string &server, std::vector<uint8_t> &publicKey);
+
+private:
+    struct Session {
+        std::vector<uint8_t> ticket;
+        std::vector<uint8_t> secret;
+    };
+
+    std::mutex lock;
+    std::unordered_map<string, Session> sessions;   //guarded by lock
+    std::unordered_map<string, std::vector<uint8_t>> serverKeys;   //guarded by lock
+    size_t capacity;
+};
+
+inline TicketKeys::TicketKeys(int rotationSeconds, const string &path)
+: rotationSeconds(std::max(rotationSeconds, 1))
+{
+    keys = &ownKeys;
+
+    #if defined(__linux__)
+    if (!path.empty())
+    {
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (fd == -1)
+        {
+            cerr << "Error opening ticket key file: " << strerror(errno) << endl;
+            throw runtime_error("Failed to open ticket key file");
+        }
+
+        //a new file is zero filled by ftruncate, an existing one keeps its keys
+        void *mapped = MAP_FAILED;
+        if (ftruncate(fd, sizeof(KeyFile)) == 0)
+        {
+            mapped = mmap(NULL, sizeof(KeyFile), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (mapped == MAP_FAILED)
+        {
+            cerr << "Error mapping ticket key file: " << strerror(errno) << endl;
+            throw runtime_error("Failed to map ticket key file");
+        }
+        keys = static_cast<KeyFile*>(mapped);
     }
+    #endif
 
-    //destructor
-    ~EventManager()
+    //keys left by an earlier run are used as they are, rotation catches up on the next seal
+    if (keys->magic != KEY_FILE_MAGIC || keys->current.id == 0)
     {
-        // Close the epoll instance
-        close(epollFD);
+        *keys = {};
+        keys->magic = KEY_FILE_MAGIC;
+        if (!rotateLocked(time(NULL)))
+        {
+            throw runtime_error("Failed to generate ticket key");
+        }
+    }
+}
 
-        // Free the memory allocated for the events array
-        free(events);
+inline TicketKeys::~TicketKeys()
+{
+    #if defined(__linux__)
+    if (keys != &ownKeys)
+    {
+        munmap(keys, sizeof(KeyFile));
+        return;
     }
-};
+    #endif
+    OPENSSL_cleanse(&ownKeys, sizeof(ownKeys));
+}
 
-int EventManager::waitForEvent()
+inline bool TicketKeys::seal(std::span<const uint8_t> secret, std::span<uint8_t> ticket)
 {
-    pendingEvents = epoll_wait(epollFD, events, MAX_FDS, -1);
+    if (secret.size() != RESUMPTION_SECRET_LEN || ticket.size() != TICKET_LEN)
+    {
+        return false;
+    }
+
+    int64_t now = time(NULL);
+    Key key;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (now - keys->current.created >= rotationSeconds && !rotateLocked(now))
+        {
+            return false;
+        }
+        key = keys->current;
+        stats.issued++;
+    }
 
-    //check for new connection request
-    if (events[0].data.fd == serverSocket) 
+    //keyId || nonce || secret and issue time encrypted || tag
+    uint8_t plainText[RESUMPTION_SECRET_LEN + 8];
+    memcpy(plainText, secret.data(), RESUMPTION_SECRET_LEN);
+    for (int i = 0; i < 8; i++)
     {
-        return CONN_ATTEMPT;
+        plainText[RESUMPTION_SECRET_LEN + i] = static_cast<uint8_t>(static_cast<uint64_t>(now) >> (56 - 8 * i));
     }
-    //otherwise we received data from an existing client connection
-    else 
+    for (int i = 0; i < 4; i++)
     {
-        //return client socket
-        return events[0].data.fd;
+        ticket[i] = static_cast<uint8_t>(key.id >> (24 - 8 * i));
     }
+
+    bool sealed = RAND_bytes(ticket.data() + 4, 12) == 1 &&
+                  crypt(true, key, ticket.data() + 4, plainText, sizeof(plainText), ticket.data() + 16, ticket.data() + 56);
+
+    OPENSSL_cleanse(plainText, sizeof(plainText));
+    OPENSSL_cleanse(&key, sizeof(key));
+    return sealed;
 }
 
-void EventManager::monitorClient(int clientSocket)
+inline bool TicketKeys::open(std::span<const uint8_t> ticket, std::vector<uint8_t> &secret)
 {
-    // Create an epoll event structure for the client socket
-    struct epoll_event event;
-    event.data.fd = clientSocket; // Associate the client socket with the event struct
-    event.events = EPOLLIN; //Monitor for incoming data from client
+    if (ticket.size() != TICKET_LEN)
+    {
+        return false;
+    }
 
-    // Add the client socket to the epoll instance to begin monitoring
-    epoll_ctl(epollFD, EPOLL_CTL_ADD, clientSocket, &event);
+    uint32_t id = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        id = (id << 8) | ticket[i];
+    }
+
+    int64_t now = time(NULL);
+    int64_t expires = 0;
+    Key key = {};
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (id != 0 && id == keys->current.id)
+        {
+            key = keys->current;
+        }
+        else if (id != 0 && id == keys->previous.id)
+        {
+            key = keys->previous;
+        }
+    }
+
+    uint8_t plainText[RESUMPTION_SECRET_LEN + 8];
+    bool opened = key.id != 0 &&
+                  crypt(false, key, ticket.data() + 4, ticket.data() + 16, sizeof(plainText), plainText,
+                        const_cast<uint8_t*>(ticket.data() + 56));
+
+    if (opened)
+    {
+        uint64_t issued = 0;
+        for (int i = 0; i < 8; i++)
+        {
+            issued = (issued << 8) | plainText[RESUMPTION_SECRET_LEN + i];
+        }
+        int64_t age = now - static_cast<int64_t>(issued);
+        expires = static_cast<int64_t>(issued) + 2 * static_cast<int64_t>(rotationSeconds);
+        opened = age >= 0 && now <= expires;
+    }
+
+    OPENSSL_cleanse(&key, sizeof(key));
+
+    std::lock_guard<std::mutex> guard(lock);
+    if (opened)
+    {
+        if (now >= nextUsedTicketsPurge)
+        {
+            std::erase_if(usedTickets, [now](const auto &used) { return used.second < now; });
+            nextUsedTicketsPurge = now + rotationSeconds;
+        }
+
+        //the key id and the random nonce tell tickets apart, the rest is sealed with them
+        if (!usedTickets.emplace(string(ticket.begin(), ticket.begin() + 16), expires).second)
+        {
+            opened = false;
+            stats.replayed++;
+        }
+    }
+    if (opened)
+    {
+        secret.assign(plainText, plainText + RESUMPTION_SECRET_LEN);
+    }
+    OPENSSL_cleanse(plainText, sizeof(plainText));
+
+    opened ? stats.accepted++ : stats.rejected++;
+    return opened;
 }
 
-void EventManager::stopMonitoring(int clientSocket)
+inline bool TicketKeys::rotate()
 {
-    //remove the client socket from epoll monitoring
-    epoll_ctl(epollFD, EPOLL_CTL_DEL, clientSocket, NULL);
+    std::lock_guard<std::mutex> guard(lock);
+    return rotateLocked(time(NULL));
 }
 
-/************************************************************************
- * poll implementation (epoll is more efficient, consider using that)
- ************************************************************************/
+inline TicketKeys::Stats TicketKeys::getStats()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return stats;
+}
+
+//the current key becomes the previous one and a new key the current one. A mapped file is
+//synced, so a restart right after still finds the new key
+inline bool TicketKeys::rotateLocked(int64_t now)
+{
+    Key next = {};
+    do
+    {
+        if (RAND_bytes(reinterpret_cast<unsigned char*>(&next.id), sizeof(next.id)) != 1)
+        {
+            return false;
+        }
+    } while (next.id == 0 || next.id == keys->current.id);
 
-#elif EVENT_BASED_ARCHITECTURE == 1 
+    if (RAND_bytes(next.secret, KEY_LEN) != 1)
+    {
+        return false;
+    }
+    next.created = now;
 
-#define MAX_FDS 1024 // Maximum number of file descriptors to monitor
+    keys->previous = keys->current;
+    keys->current = next;
+    OPENSSL_cleanse(&next, sizeof(next));
 
-class EventManager {
-public:
-    //declare vars
-    int serverSocket;
-    std::vector<pollfd> pollFds; // Vector to store pollfd structures for each socket
+    #if defined(__linux__)
+    if (keys != &ownKeys)
+    {
+        msync(keys, sizeof(KeyFile), MS_SYNC);
+    }
+    #endif
+    return true;
+}
 
-    //wait for event and return the type of event that occurred   
-    int waitForEvent();
+//AES-256-GCM with a 12 byte nonce and a 16 byte tag. The key id is authenticated as well, so a
+//ticket can not be moved to another key
+inline bool TicketKeys::crypt(bool encrypting, const Key &key, const uint8_t *nonce, const uint8_t *in, size_t length,
+                       uint8_t *out, uint8_t *tag)
+{
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (!ctx)
+    {
+        return false;
+    }
 
-    //creates a new pollfd structure for monitoring client socket for events
-    void monitorClient(int clientSocket);
-    void stopMonitoring(int clientSocket);
+    uint8_t keyId[4];
+    for (int i = 0; i < 4; i++)
+    {
+        keyId[i] = static_cast<uint8_t>(key.id >> (24 - 8 * i));
+    }
 
-    //default constructor initializes the pollfds vector
-    //the server socket will be monitored for incoming events, i.e. connection requests
-    //and messages from client
-    EventManager(int socket, int maxConnections)
+    int len = 0;
+    bool done = EVP_CipherInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL, encrypting) == 1 &&
+                EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, 12, NULL) == 1 &&
+                EVP_CipherInit_ex(ctx, NULL, NULL, key.secret, nonce, encrypting) == 1 &&
+                EVP_CipherUpdate(ctx, NULL, &len, keyId, sizeof(keyId)) == 1 &&
+                EVP_CipherUpdate(ctx, out, &len, in, length) == 1;
+
+    //decrypting checks the tag in CipherFinal, so it has to be set before
+    if (done && !encrypting)
     {
-        serverSocket = socket;
+        done = EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, 16, tag) == 1;
+    }
+    int finalLen = 0;
+    done = done && EVP_CipherFinal_ex(ctx, out + len, &finalLen) == 1;
+    if (done && encrypting)
+    {
+        done = EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, 16, tag) == 1;
+    }
 
-        // Add the server socket to the pollfds vector
-        pollfd serverPollFd;
-        serverPollFd.fd = serverSocket;
-        serverPollFd.events = POLLIN; // Monitor for incoming data
-        pollFds.push_back(serverPollFd);
+    EVP_CIPHER_CTX_free(ctx);
+    return done;
+}
+
+inline SessionCache::SessionCache(size_t capacity)
+: capacity(std::max<size_t>(capacity, 1))
+{
+}
+
+inline SessionCache::~SessionCache()
+{
+    for (auto &entry : sessions)
+    {
+        OPENSSL_cleanse(entry.second.secret.data(), entry.second.secret.size());
     }
+}
 
-    //destructor
-    ~EventManager()
+inline void SessionCache::store(const string &server, std::span<const uint8_t> ticket, std::span<const uint8_t> secret)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    auto found = sessions.find(server);
+    if (found == sessions.end() && sessions.size() >= capacity)
     {
-        // No need to close anything for poll-based implementation
+        OPENSSL_cleanse(sessions.begin()->second.secret.data(), sessions.begin()->second.secret.size());
+        sessions.erase(sessions.begin());
     }
-};
 
-int EventManager::waitForEvent()
+    Session &session = sessions[server];
+    OPENSSL_cleanse(session.secret.data(), session.secret.size());
+    session.ticket.assign(ticket.begin(), ticket.end());
+    session.secret.assign(secret.begin(), secret.end());
+}
+
+inline bool SessionCache::take(const string &server, std::vector<uint8_t> &ticket, std::vector<uint8_t> &secret)
 {
-    // Call poll to wait for events
-    int readyFds = poll(pollFds.data(), pollFds.size(), -1);
-    if (readyFds > 0) {
-        // Check which file descriptor has an event
-        for (size_t i = 0; i < pollFds.size(); ++i) {
-            if (pollFds[i].revents & POLLIN) {
-                // Check if it's the server socket
-                if (pollFds[i].fd == serverSocket) {
-                    return CONN_ATTEMPT;
-                } else {
-                    // Otherwise, return client socket
-                    return pollFds[i].fd;
-                }
-            }
-        }
+    std::lock_guard<std::mutex> guard(lock);
+
+    auto found = sessions.find(server);
+    if (found == sessions.end())
+    {
+        return false;
     }
-    return -1; // No event occurred or error
+
+    ticket = std::move(found->second.ticket);
+    secret = std::move(found->second.secret);
+    sessions.erase(found);
+    return true;
 }
 
-void EventManager::monitorClient(int clientSocket)
+inline size_t SessionCache::size()
 {
-    // Create a new pollfd structure for the client socket
-    pollfd clientPollFd;
-    clientPollFd.fd = clientSocket;
-    clientPollFd.events = POLLIN; // Monitor for incoming data
-    pollFds.push_back(clientPollFd);
+    std::lock_guard<std::mutex> guard(lock);
+    return sessions.size();
 }
 
-void EventManager::stopMonitoring(int clientSocket)
+inline void SessionCache::setServerKey(const string &server, std::span<const uint8_t> publicKey)
 {
-    // Find the pollfd associated with the client socket and remove it
-    for (auto it = pollFds.begin(); it != pollFds.end(); ++it) {
-        if (it->fd == clientSocket) {
-            pollFds.erase(it);
-            break;
-        }
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (publicKey.empty())
+    {
+        serverKeys.erase(server);
+        return;
+    }
+    serverKeys[server].assign(publicKey.begin(), publicKey.end());
+}
+
+inline bool SessionCache::getServerKey(const string &server, std::vector<uint8_t> &publicKey)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    auto found = serverKeys.find(server);
+    if (found == serverKeys.end())
+    {
+        return false;
     }
+    publicKey = found->second;
+    return true;
 }
+#endif //CRYPTOGRAPHY
 
 /************************************************************************
- * select implementation (archaic and outdated. Only use on legacy systems)
+ * Server keypair (long-term Kyber keypair for 0-RTT handshakes)
  ************************************************************************/
 
-#elif EVENT_BASED_ARCHITECTURE == 2 //select
-
-class EventManager {
+#if CRYPTOGRAPHY
+//a server's long-term Kyber keypair (see Socket::setServerKeypair()). Clients learn the public key
+//out of band, which also proves to them that they talk to the holder of the secret key. The parts
+//of the secret key that kyber1024_kem::decapsulate() decodes or regenerates on every call (the
+//secret vector, the public vector and the public matrix, which takes 16 SHAKE128 streams) are
+//expanded once here and stay resident, every decapsulation only does the math that depends on the
+//cipher. Safe to use from any thread
+class ServerKeypair {
 public:
-    int serverSocket;
-    int max_fd;
-    fd_set readfds;
-    std::vector<int> clientSockets;
+    //generates a new keypair
+    ServerKeypair();
+
+    //loads a keypair saved from getSecretKey(), throws if it has the wrong size
+    ServerKeypair(std::span<const uint8_t> secretKey);
+
+    //wipes the secret key
+    ~ServerKeypair();
+
+    ServerKeypair(const ServerKeypair&) = delete;
+    ServerKeypair& operator=(const ServerKeypair&) = delete;
+
+    //what the clients need, PKEY_LEN bytes
+    const std::vector<uint8_t> &getPublicKey();
+
+    //keep it private, it holds the public key as well
+    const std::vector<uint8_t> &getSecretKey();
+
+    //same result as kyber1024_kem::decapsulate() with the secret key, including the implicit
+    //rejection of ciphers that were not made for this key
+    shake256::shake256_t decapsulate(std::span<const uint8_t, kyber1024_kem::CIPHER_LEN> cipher);
+
+private:
+    static constexpr size_t k = kyber1024_kem::k;
+    static constexpr size_t du = kyber1024_kem::du;
+    static constexpr size_t dv = kyber1024_kem::dv;
+    static constexpr size_t eta1 = kyber1024_kem::η1;
+    static constexpr size_t eta2 = kyber1024_kem::η2;
+    static constexpr size_t POLY_VEC_LEN = k * 12 * 32;    //an encoded polynomial vector
 
-    EventManager(int socket, int maxConnections) : serverSocket(socket), max_fd(socket)
+    std::vector<uint8_t> publicKey;
+    std::vector<uint8_t> secretKey;                                 //s || public key || H(public key) || z
+    std::array<field::zq_t, k * ntt::N> secretVector{};             //s, in the NTT domain
+    std::array<field::zq_t, k * ntt::N> publicVector{};             //t, in the NTT domain
+    std::array<field::zq_t, k * k * ntt::N> publicMatrix{};         //A transposed, from rho
+
+    void expand();
+};
+
+inline ServerKeypair::ServerKeypair()
+{
+    KeypairPool::generate(publicKey, secretKey);
+    expand();
+}
+
+inline ServerKeypair::ServerKeypair(std::span<const uint8_t> secretKey)
+{
+    if (secretKey.size() != kyber1024_kem::SKEY_LEN)
     {
-        FD_ZERO(&readfds);
+        throw runtime_error("Server secret key has the wrong size");
     }
+    this->secretKey.assign(secretKey.begin(), secretKey.end());
+    publicKey.assign(secretKey.begin() + POLY_VEC_LEN, secretKey.begin() + POLY_VEC_LEN + kyber1024_kem::PKEY_LEN);
+    expand();
+}
 
-    // Wait for events on server and client sockets
-    int waitForEvent() {
-    while (true) {
-        FD_SET(serverSocket, &readfds);
+inline ServerKeypair::~ServerKeypair()
+{
+    OPENSSL_cleanse(secretKey.data(), secretKey.size());
+    OPENSSL_cleanse(secretVector.data(), sizeof(secretVector));
+}
 
-        // Add all client sockets to the set
-        for (int clientSocket : clientSockets) {
-            FD_SET(clientSocket, &readfds);
-            if (clientSocket > max_fd) {
-                max_fd = clientSocket;
-            }
-        }
+inline const std::vector<uint8_t> &ServerKeypair::getPublicKey()
+{
+    return publicKey;
+}
 
-        timeval timeout;
-        timeout.tv_sec = 3; // 3 seconds timeout
-        timeout.tv_usec = 0;
+inline const std::vector<uint8_t> &ServerKeypair::getSecretKey()
+{
+    return secretKey;
+}
 
-        int result = select(max_fd + 1, &readfds, NULL, NULL, &timeout);
-        if (result == -1) {
-            std::cerr << "Error in select" << std::endl;
-            return -1;
-        } else if (result > 0) {
-            // Check if server socket has an event
-            if (FD_ISSET(serverSocket, &readfds)) {
-                return CONN_ATTEMPT;
-            }
+//decodes what pke::decrypt() and pke::encrypt() would decode or generate on every call
+inline void ServerKeypair::expand()
+{
+    auto _s = std::span<const uint8_t, POLY_VEC_LEN>(secretKey.data(), POLY_VEC_LEN);
+    auto _t = std::span<const uint8_t, POLY_VEC_LEN>(publicKey.data(), POLY_VEC_LEN);
+    auto _rho = std::span<const uint8_t, 32>(publicKey.data() + POLY_VEC_LEN, 32);
 
-            // Check if any client socket has an event
-            for (int clientSocket : clientSockets) {
-                if (FD_ISSET(clientSocket, &readfds)) {
-                    return clientSocket; // Return the client socket with the event
-                }
-            }
-        }
-        // If no event occurred, continue looping
+    kyber_utils::poly_vec_decode<k, 12>(_s, secretVector);
+    kyber_utils::poly_vec_decode<k, 12>(_t, publicVector);
+    kyber_utils::generate_matrix<k, true>(publicMatrix, _rho);
+}
+
+//kem::decapsulate() with pke::decrypt() and the re-encryption of pke::encrypt() inlined, using the
+//resident parts of the key
+inline shake256::shake256_t ServerKeypair::decapsulate(std::span<const uint8_t, kyber1024_kem::CIPHER_LEN> cipher)
+{
+    constexpr size_t encoff = k * du * 32;
+    auto _enc0 = cipher.subspan<0, encoff>();
+    auto _enc1 = cipher.subspan<encoff, dv * 32>();
+    auto _h = std::span<const uint8_t, 32>(secretKey.data() + POLY_VEC_LEN + kyber1024_kem::PKEY_LEN, 32);
+    auto _z = std::span<const uint8_t, 32>(secretKey.data() + POLY_VEC_LEN + kyber1024_kem::PKEY_LEN + 32, 32);
+
+    std::array<uint8_t, 64> g_in{};
+    std::array<uint8_t, 64> g_out{};
+    std::array<uint8_t, kyber1024_kem::CIPHER_LEN> c_prime{};
+    std::array<uint8_t, 64> kdf_in{};
+
+    auto _g_in0 = std::span(g_in).subspan<0, 32>();
+    auto _g_in1 = std::span(g_in).subspan<32, 32>();
+    auto _g_out0 = std::span(g_out).subspan<0, 32>();
+    auto _g_out1 = std::span(g_out).subspan<32, 32>();
+    auto _kdf_in0 = std::span(kdf_in).subspan<0, 32>();
+    auto _kdf_in1 = std::span(kdf_in).subspan<32, 32>();
+
+    // decrypt the message, s is resident
+    {
+        std::array<field::zq_t, k * ntt::N> u{};
+        kyber_utils::poly_vec_decode<k, du>(_enc0, u);
+        kyber_utils::poly_vec_decompress<k, du>(u);
+
+        std::array<field::zq_t, ntt::N> v{};
+        kyber_utils::decode<dv>(_enc1, v);
+        kyber_utils::poly_decompress<dv>(v);
+
+        kyber_utils::poly_vec_ntt<k>(u);
+
+        std::array<field::zq_t, ntt::N> t{};
+        kyber_utils::matrix_multiply<1, k, k, 1>(secretVector, u, t);
+        kyber_utils::poly_vec_intt<1>(t);
+        kyber_utils::poly_vec_sub_from<1>(t, v);
+
+        kyber_utils::poly_compress<1>(v);
+        kyber_utils::encode<1>(v, _g_in0);
     }
-}
+    std::copy(_h.begin(), _h.end(), _g_in1.begin());
 
-    void monitorClient(int clientSocket) {
-    // Add the client socket to the list of monitored sockets
-    clientSockets.push_back(clientSocket);
+    sha3_512::sha3_512_t h512;
+    h512.absorb(g_in);
+    h512.finalize();
+    h512.digest(g_out);
 
-    // Add the new client socket to the set of file descriptors to monitor
-    FD_SET(clientSocket, &readfds);
+    // encrypt it again with the coins it implies, t and A are resident
+    {
+        uint8_t N = 0;
 
-    // Update max_fd if necessary
-    if (clientSocket > max_fd) {
-        max_fd = clientSocket;
-    }
-}
+        std::array<field::zq_t, k * ntt::N> r{};
+        kyber_utils::generate_vector<k, eta1>(r, _g_out1, N);
+        N += k;
 
-    void stopMonitoring(int clientSocket) {
-        // No need to stop monitoring individual clients with select
-    }
-};
+        std::array<field::zq_t, k * ntt::N> e1{};
+        kyber_utils::generate_vector<k, eta2>(e1, _g_out1, N);
+        N += k;
 
-#endif //event based architecture decision
+        std::array<field::zq_t, ntt::N> e2{};
+        kyber_utils::generate_vector<1, eta2>(e2, _g_out1, N);
 
-#endif //event based 
+        kyber_utils::poly_vec_ntt<k>(r);
 
+        std::array<field::zq_t, k * ntt::N> u{};
+        kyber_utils::matrix_multiply<k, k, k, 1>(publicMatrix, r, u);
+        kyber_utils::poly_vec_intt<k>(u);
+        kyber_utils::poly_vec_add_to<k>(e1, u);
 
-/************************************************************************
- * Socket Cryptography Methods (available to both server and client sub-classes)
- ************************************************************************/
+        std::array<field::zq_t, ntt::N> v{};
+        kyber_utils::matrix_multiply<1, k, k, 1>(publicVector, r, v);
+        kyber_utils::poly_vec_intt<1>(v);
+        kyber_utils::poly_vec_add_to<1>(e2, v);
 
-#if CRYPTOGRAPHY
-// Function to send the public key over the network
-bool Socket::sendKeyData(const uint8_t* data, size_t dataSize) {
-    // Send the actual data
-    int bytesSent = send(socketId, reinterpret_cast<const char*>(data), dataSize, 0);
-    if (bytesSent == -1) {
-        std::cerr << "Error sending data" << std::endl;
-        return false;
-    }
+        std::array<field::zq_t, ntt::N> m{};
+        kyber_utils::decode<1>(_g_in0, m);
+        kyber_utils::poly_decompress<1>(m);
+        kyber_utils::poly_vec_add_to<1>(m, v);
 
-    #if VERBOSE
-    cout << "public key sent." << endl;
-    #endif
+        auto _c_prime0 = std::span(c_prime).subspan<0, encoff>();
+        auto _c_prime1 = std::span(c_prime).subspan<encoff, dv * 32>();
 
-    return true;
-}
+        kyber_utils::poly_vec_compress<k, du>(u);
+        kyber_utils::poly_vec_encode<k, du>(u, _c_prime0);
 
-// Function to receive the public key from the network
-bool Socket::getKeyData(uint8_t* data, size_t dataSize) 
-{
-    // Receive key data
-    int bytesReceived = recv(socketId, reinterpret_cast<char*>(data), dataSize, 0);
-    
-    //check for success
-    if (bytesReceived <= 0) 
-    {
-        if (bytesReceived == 0) 
-        {
-            std::cerr << "Connection closed by peer" << std::endl;
-        } else 
-        {
-            std::cerr << "Error receiving data" << std::endl;
-        }
-        return false;
+        kyber_utils::poly_compress<dv>(v);
+        kyber_utils::encode<dv>(v, _c_prime1);
     }
 
-    #if VERBOSE
-    cout << "public key received: " << data;
-    #endif
+    // a cipher that does not encrypt to itself gets a key derived from z instead, in constant time
+    using kdf_t = std::span<const uint8_t, 32>;
+    const uint32_t cond = kyber_utils::ct_memcmp(cipher, std::span<const uint8_t, kyber1024_kem::CIPHER_LEN>(c_prime));
+    kyber_utils::ct_cond_memcpy(cond, _kdf_in0, kdf_t(_g_out0), _z);
 
-    return true;
+    sha3_256::sha3_256_t h256;
+    h256.absorb(cipher);
+    h256.finalize();
+    h256.digest(_kdf_in1);
+
+    shake256::shake256_t xof256;
+    xof256.absorb(kdf_in);
+    xof256.finalize();
+
+    OPENSSL_cleanse(g_in.data(), g_in.size());
+    OPENSSL_cleanse(g_out.data(), g_out.size());
+    OPENSSL_cleanse(kdf_in.data(), kdf_in.size());
+    return xof256;
 }
+#endif //CRYPTOGRAPHY
+
+/************************************************************************
+ * Socket Cryptography Methods (available to both server and client sub-classes)
+ ************************************************************************/
 
+#if CRYPTOGRAPHY
 #if VERBOSE
-void Socket::printHex(string str)
+inline void Socket::printHex(string str)
 {
     for (char c : str) {
         cout << hex << setw(2) << setfill('0') << static_cast<unsigned int>(static_cast<unsigned char>(c));
@@ -827,31 +7511,18 @@ inline bool Socket::encrypt(string& str) {
         return true; // If cryptography is not applied, consider it successful
     }
 
-    unsigned char cipherText[500]; 
-    const unsigned char* plainText = reinterpret_cast<const unsigned char*>(str.c_str());
-    int plainTextLength = str.length();
-    int cipherTextLength;
-
     #if VERBOSE
     cout << "plain text input to encrypt(): " << str << endl;
     #endif
 
-    if (EVP_EncryptUpdate(encryptionContext.encrypt_ctx, cipherText, &cipherTextLength, plainText, plainTextLength) != 1)
-    {
-        cout << "Error: Failed EncryptUpdate";
-        return false;
-    }
-    
-    int updateLen;
-    if (EVP_EncryptFinal_ex(encryptionContext.encrypt_ctx, cipherText + cipherTextLength, &updateLen) != 1)
+    std::vector<uint8_t> cipherText;
+    if (!encryptBytes(std::span<const uint8_t>(reinterpret_cast<const uint8_t*>(str.data()), str.length()), cipherText))
     {
-        cout << "Error: Failed EncryptFinal";
         return false;
     }
-    cipherTextLength += updateLen;
 
     // Update the input string with the encrypted data
-    str.assign(reinterpret_cast<char*>(cipherText), cipherTextLength);
+    str.assign(reinterpret_cast<char*>(cipherText.data()), cipherText.size());
 
     #if VERBOSE
     cout << "Encrypted text output from encrypt(): ";
@@ -872,39 +7543,92 @@ inline bool Socket::decrypt(string& str) {
     printHex(str);
     #endif
 
-    unsigned char plainText[500]; 
-    const unsigned char* cipherText = reinterpret_cast<const unsigned char*>(str.c_str());
-    int cipherTextLength = str.length();
+    std::vector<uint8_t> plainText;
+    if (!decryptBytes(std::span<const uint8_t>(reinterpret_cast<const uint8_t*>(str.data()), str.length()), plainText))
+    {
+        return false;
+    }
+
+    // Set the decrypted data back to the input string
+    str.assign(reinterpret_cast<char*>(plainText.data()), plainText.size());
+
+    #if VERBOSE
+    cout << "plain text output from decrypt(): " << str << endl;
+    #endif
+
+    return true;
+}
+
+// Encrypts a buffer of any size, the output is at most one AES block longer than the input
+inline bool Socket::encryptBytes(std::span<const uint8_t> plainText, std::vector<uint8_t>& cipherText)
+{
+    std::string_view piece(reinterpret_cast<const char*>(plainText.data()), plainText.size());
+    return encryptPieces(std::span<const std::string_view>(&piece, 1), cipherText);
+}
+
+// Encrypts the pieces in order as if they were one joined buffer, without joining them
+inline bool Socket::encryptPieces(std::span<const std::string_view> pieces, std::vector<uint8_t>& cipherText)
+{
+    int cipherTextLength = 0;
+    int updateLen;
+    size_t plainTextLength = 0;
+
+    for (std::string_view piece : pieces)
+    {
+        plainTextLength += piece.size();
+    }
+    cipherText.resize(plainTextLength + AES_BLOCK_SIZE);
+
+    for (std::string_view piece : pieces)
+    {
+        if (EVP_EncryptUpdate(encryptionContext.encrypt_ctx, cipherText.data() + cipherTextLength, &updateLen, 
+                              reinterpret_cast<const unsigned char*>(piece.data()), piece.size()) != 1)
+        {
+            cout << "Error: Failed EncryptUpdate";
+            return false;
+        }
+        cipherTextLength += updateLen;
+    }
+    
+    if (EVP_EncryptFinal_ex(encryptionContext.encrypt_ctx, cipherText.data() + cipherTextLength, &updateLen) != 1)
+    {
+        cout << "Error: Failed EncryptFinal";
+        return false;
+    }
+    cipherText.resize(cipherTextLength + updateLen);
+
+    return true;
+}
+
+// Decrypts a buffer of any size, the output is never longer than the input
+inline bool Socket::decryptBytes(std::span<const uint8_t> cipherText, std::vector<uint8_t>& plainText)
+{
     int plainTextLength;
+    int len;
 
-    if (EVP_DecryptUpdate(encryptionContext.decrypt_ctx, plainText, &plainTextLength, cipherText, cipherTextLength) != 1)
+    //DecryptUpdate may write up to one block more than it was given
+    plainText.resize(cipherText.size() + AES_BLOCK_SIZE);
+
+    if (EVP_DecryptUpdate(encryptionContext.decrypt_ctx, plainText.data(), &plainTextLength, cipherText.data(), cipherText.size()) != 1)
     {
         //handle error
         cout << "Error: DecryptUpdate";
         return false;
     }
 
-    int len;
-    if(1 != EVP_DecryptFinal_ex(encryptionContext.decrypt_ctx, plainText + plainTextLength, &len))
+    if(1 != EVP_DecryptFinal_ex(encryptionContext.decrypt_ctx, plainText.data() + plainTextLength, &len))
     {
         //handle error
         cout << "Error: DecryptFinal";
         return false;
     }
-    plainTextLength += len;  
-
-    // Set the decrypted data back to the input string
-    str.assign(reinterpret_cast<char*>(plainText), plainTextLength);
-
-    #if VERBOSE
-    cout << "plain text output from decrypt(): " << str << endl;
-    #endif
+    plainText.resize(plainTextLength + len);
 
     return true;
 }
 
 //initializes the encryption and decryption context
-bool Socket::initAES() {
+inline bool Socket::initAES() {
     // Initialize AES encryption context
     encryptionContext.encrypt_ctx = EVP_CIPHER_CTX_new();
     if (!encryptionContext.encrypt_ctx) {
@@ -937,129 +7661,496 @@ bool Socket::initAES() {
 
 //function to be called by server and client upon creation of a connection. They will use Kyber 
 //key generation to arrive at a secret shared key to use later for AES encrypted communication
-// the socket classes must have opposite initiator values upon calling the function
-void Socket::setupEncryption()
-{
-  // seed variables required for keypair generation
-  std::vector<uint8_t> d(SEED_LEN, 0);
-  std::vector<uint8_t> z(SEED_LEN, 0);
-  auto _d = std::span<uint8_t, SEED_LEN>(d);
-  auto _z = std::span<uint8_t, SEED_LEN>(z);
-
-  // public/ private keypair variables
-  std::vector<uint8_t> pkey(kyber1024_kem::PKEY_LEN, 0);
-  std::vector<uint8_t> skey(kyber1024_kem::SKEY_LEN, 0);
-  auto _pkey = std::span<uint8_t, kyber1024_kem::PKEY_LEN>(pkey);
-  auto _skey = std::span<uint8_t, kyber1024_kem::SKEY_LEN>(skey);
-
-  // cipher variable required shared key generation
-  std::vector<uint8_t> cipher(kyber1024_kem::CIPHER_LEN, 0);
-  auto _cipher = std::span<uint8_t, kyber1024_kem::CIPHER_LEN>(cipher);
-
-  // shared key variable
-  std::vector<uint8_t> shrd_key(KEY_LEN, 0);
-  auto _shrd_key = std::span<uint8_t, KEY_LEN>(shrd_key);
-
-  // pseudo-randomness source
-  prng::prng_t prng;
-
-  // fill up keygen seeds using PRNG
-  prng.read(_d);
-  prng.read(_z);
-
-  // generate a keypair
-  kyber1024_kem::keygen(_d, _z, _pkey, _skey);
-
-  //run the kyber KEM 
-  if (initiator)
-  {
-    //declare variable to store communicating parties public key
-    std::vector<uint8_t> cp_pkey(kyber1024_kem::PKEY_LEN, 0);
-    auto _cp_pkey = std::span<uint8_t, kyber1024_kem::PKEY_LEN>(cp_pkey);
-    
-    //assert(sendKeyData(pkey.data(), _pkey.size()));
-    assert(getKeyData(_cp_pkey.data(), _cp_pkey.size()));
+// the socket classes must have opposite initiator values upon calling the function.
+//Runs the handshake started by beginHandshake() to the end, waiting whenever the peer is not ready
+inline bool Socket::setupEncryption()
+{
+    while (true)
+    {
+        switch (continueHandshake())
+        {
+            case HANDSHAKE_DONE:
+                return true;
+            case HANDSHAKE_WANT_READ:
+                if (!retryAfterWouldBlock(POLLIN))
+                {
+                    return false;
+                }
+                break;
+            case HANDSHAKE_WANT_WRITE:
+                if (!retryAfterWouldBlock(POLLOUT))
+                {
+                    return false;
+                }
+                break;
+            default:
+                return false;
+        }
+    }
+}
+
+//sets up the first step. The server (initiator) waits for the client's hello and needs no
+//keypair of its own. A client that knows the server's long-term key is done right away (0-RTT),
+//one with a ticket from its session cache resumes, otherwise it takes or generates a keypair and
+//sends the public key
+inline void Socket::beginHandshake()
+{
+    handshake.reset(new Handshake());
+
+    if (initiator)
+    {
+        handshake->ticketKeys = ticketKeys;
+        handshake->serverKeypair = serverKeypair;
+        receiveHello();
+        return;
+    }
+
+    //with a session cache every full handshake asks for a ticket
+    if (sessionCache && !sessionName.empty())
+    {
+        std::vector<uint8_t> serverKey;
+        if (sessionCache->getServerKey(sessionName, serverKey) && sendEarlyCipher(serverKey))
+        {
+            return;
+        }
+
+        handshake->ticketRequested = true;
+
+        std::vector<uint8_t> ticket;
+        if (sessionCache->take(sessionName, ticket, handshake->resumptionSecret))
+        {
+            handshake->clientNonce.assign(RESUMPTION_NONCE_LEN, 0);
+            if (RAND_bytes(handshake->clientNonce.data(), RESUMPTION_NONCE_LEN) == 1)
+            {
+                //hello, ticket and nonce in one write
+                handshake->step = Handshake::SEND_TICKET;
+                handshake->message = {HELLO_MARKER, HELLO_RESUME};
+                handshake->message.insert(handshake->message.end(), ticket.begin(), ticket.end());
+                handshake->message.insert(handshake->message.end(), handshake->clientNonce.begin(), handshake->clientNonce.end());
+                return;
+            }
+            OPENSSL_cleanse(handshake->resumptionSecret.data(), handshake->resumptionSecret.size());
+        }
+    }
+    sendPublicKey();
+}
+
+//client: the first step of a full handshake, also taken once the server rejected our ticket
+inline void Socket::sendPublicKey()
+{
+    Handshake &state = *handshake;
+
+    //the responding side needs a keypair, the pool usually has one ready
+    if (!keypairPool || !keypairPool->take(state.message, state.secretKey))
+    {
+        KeypairPool::generate(state.message, state.secretKey);
+    }
+    if (state.ticketRequested)
+    {
+        state.message.insert(state.message.begin(), {HELLO_MARKER, HELLO_REQUEST_TICKET});
+    }
+    state.step = Handshake::SEND_PUBLIC_KEY;
+    state.transferred = 0;
+}
+
+//client: the 0-RTT handshake. Encapsulates to the server's long-term key, so the keys are ready
+//without hearing from the server. The hello and the cipher wait in the output buffer and go out in
+//one write with the first message (see sendPieces()), or before we first wait for the server.
+//Returns false if serverKey can not be used, the full handshake runs instead
+inline bool Socket::sendEarlyCipher(std::span<const uint8_t> serverKey)
+{
+    if (serverKey.size() != kyber1024_kem::PKEY_LEN)
+    {
+        return false;
+    }
+    auto _pkey = std::span<const uint8_t, kyber1024_kem::PKEY_LEN>(serverKey.data(), kyber1024_kem::PKEY_LEN);
 
     // fill up seed required for key encapsulation, using PRNG
     std::vector<uint8_t> m(SEED_LEN, 0);
     auto _m = std::span<uint8_t, SEED_LEN>(m);
+    prng::prng_t prng;
     prng.read(_m);
-    
-    // encapsulate cipher using communicating parties public key, compute cipher text and obtain KDF
-    auto skdf = kyber1024_kem::encapsulate(_m, _cp_pkey, _cipher);
 
-    //send cipher to communicating party
-    assert(sendKeyData(_cipher.data(), _cipher.size()));
+    std::vector<uint8_t> hello(HELLO_LEN + kyber1024_kem::CIPHER_LEN, 0);
+    hello[0] = HELLO_MARKER;
+    hello[1] = HELLO_EARLY_CIPHER;
+    auto _cipher = std::span<uint8_t, kyber1024_kem::CIPHER_LEN>(hello.data() + HELLO_LEN, kyber1024_kem::CIPHER_LEN);
+    auto skdf = kyber1024_kem::encapsulate(_m, _pkey, _cipher);
+    OPENSSL_cleanse(m.data(), m.size());
+
+    //nothing comes back, so the IV follows the key in the KDF's output
+    encryptionContext.sharedKey.assign(KEY_LEN, 0);
+    skdf.squeeze(encryptionContext.sharedKey);
+    skdf.squeeze(std::span<uint8_t>(encryptionContext.iv, AES_BLOCK_SIZE));
+    if (!initAES())
+    {
+        return false;
+    }
 
-    //obtain shared key
-    skdf.squeeze(_shrd_key);
-    
-    //generate iv (initialization vector)
-    assert (RAND_bytes(encryptionContext.iv, AES_BLOCK_SIZE) == 1);
+    sendBuffer.insert(sendBuffer.begin() + sendStart, hello.begin(), hello.end());
+    handshake.reset();
+    return true;
+}
+
+//server: the first step, also taken again after rejecting a ticket
+inline void Socket::receiveHello()
+{
+    handshake->step = Handshake::RECEIVE_HELLO;
+    handshake->message.assign(HELLO_LEN, 0);
+    handshake->transferred = 0;
+}
 
-    // Send IV to the other socket
-    assert(sendKeyData(encryptionContext.iv, AES_BLOCK_SIZE));
+//the Kyber part of a step whose message has been received. It only uses state, which is what
+//lets it run on a worker thread (see Socket::getHandshakeComputation())
+inline void Socket::computeHandshakeStep(Handshake &state)
+{
+    // shared key variable
+    state.sharedKey.assign(KEY_LEN, 0);
+    auto _shrd_key = std::span<uint8_t, KEY_LEN>(state.sharedKey);
 
-    #if VERBOSE
+    if (state.step == Handshake::RECEIVE_PUBLIC_KEY)
     {
-        using namespace kyber_utils;
+        auto _cp_pkey = std::span<uint8_t, kyber1024_kem::PKEY_LEN>(state.message.data(), kyber1024_kem::PKEY_LEN);
+
+        // fill up seed required for key encapsulation, using PRNG
+        std::vector<uint8_t> m(SEED_LEN, 0);
+        auto _m = std::span<uint8_t, SEED_LEN>(m);
+        prng::prng_t prng;
+        prng.read(_m);
+
+        // encapsulate cipher using communicating parties public key, compute cipher text and obtain KDF
+        state.reply.assign(kyber1024_kem::CIPHER_LEN + AES_BLOCK_SIZE, 0);
+        auto _cipher = std::span<uint8_t, kyber1024_kem::CIPHER_LEN>(state.reply.data(), kyber1024_kem::CIPHER_LEN);
+        auto skdf = kyber1024_kem::encapsulate(_m, _cp_pkey, _cipher);
+
+        //obtain shared key, then the secret a ticket carries (see finishHandshakeStep())
+        skdf.squeeze(_shrd_key);
+        if (state.ticketRequested)
+        {
+            state.resumptionSecret.assign(RESUMPTION_SECRET_LEN, 0);
+            skdf.squeeze(state.resumptionSecret);
+            state.reply.resize(state.reply.size() + TICKET_LEN, 0);
+        }
+
+        //generate iv (initialization vector), it follows the cipher so both go out in one write
+        state.computeFailed = RAND_bytes(state.iv, AES_BLOCK_SIZE) != 1;
+        memcpy(state.reply.data() + kyber1024_kem::CIPHER_LEN, state.iv, AES_BLOCK_SIZE);
 
-        std::cout << "kyber1024 KEM Results from setupEncryption(): \n";
-        std::cout << "\ninitiator       : true";
-        std::cout << "\npartner's pubkey: " << to_hex(_cp_pkey);
-        std::cout << "\ncipher          : " << to_hex(_cipher);
-        std::cout << "\nshared secret   : " << to_hex(_shrd_key);
-        std::cout << "\niv              : " << to_hex(encryptionContext.iv) << "\n";
+        #if VERBOSE
+        {
+            using namespace kyber_utils;
+
+            std::cout << "kyber1024 KEM Results from setupEncryption(): \n";
+            std::cout << "\ninitiator       : true";
+            std::cout << "\npartner's pubkey: " << to_hex(_cp_pkey);
+            std::cout << "\ncipher          : " << to_hex(_cipher);
+            std::cout << "\nshared secret   : " << to_hex(_shrd_key);
+            std::cout << "\niv              : " << to_hex(state.iv) << "\n";
+        }
+        #endif
     }
-    #endif
-  }
-  else
-  {  
-    //assert(getKeyData(_cp_pkey.data(), _cp_pkey.size()));
-    assert(sendKeyData(pkey.data(), _pkey.size()));
-    
-    //get encapsulated cipher
-    assert(getKeyData(_cipher.data(), _cipher.size()));
+    else if (state.step == Handshake::RECEIVE_EARLY_CIPHER)
+    {
+        auto _cipher = std::span<const uint8_t, kyber1024_kem::CIPHER_LEN>(state.message.data(), kyber1024_kem::CIPHER_LEN);
 
-    // decapsulate cipher text and obtain KDF
-    auto rkdf = kyber1024_kem::decapsulate(_skey, _cipher);
-    
-    //obtain shared key
-    rkdf.squeeze(_shrd_key);
+        // decapsulate with our long-term key, the IV follows the shared key in the KDF's output
+        auto rkdf = state.serverKeypair->decapsulate(_cipher);
+        rkdf.squeeze(_shrd_key);
+        rkdf.squeeze(std::span<uint8_t>(state.iv, AES_BLOCK_SIZE));
+    }
+    else
+    {
+        auto _cipher = std::span<uint8_t, kyber1024_kem::CIPHER_LEN>(state.message.data(), kyber1024_kem::CIPHER_LEN);
+        auto _skey = std::span<uint8_t, kyber1024_kem::SKEY_LEN>(state.secretKey);
 
-    //get iv
-    assert( getKeyData(encryptionContext.iv, AES_BLOCK_SIZE) );
+        // decapsulate cipher text and obtain KDF
+        auto rkdf = kyber1024_kem::decapsulate(_skey, _cipher);
 
-    #if VERBOSE
+        //obtain shared key, then the secret the ticket carries
+        rkdf.squeeze(_shrd_key);
+        if (state.ticketRequested)
+        {
+            state.resumptionSecret.assign(RESUMPTION_SECRET_LEN, 0);
+            rkdf.squeeze(state.resumptionSecret);
+        }
+
+        //get iv
+        memcpy(state.iv, state.message.data() + kyber1024_kem::CIPHER_LEN, AES_BLOCK_SIZE);
+
+        #if VERBOSE
+        {
+            using namespace kyber_utils;
+
+            std::cout << "kyber1024 KEM Results from setupEncryption(): \n";
+            std::cout << "\ninitiator     : false";
+            std::cout << "\nseckey        : " << to_hex(_skey);
+            std::cout << "\ncipher        : " << to_hex(_cipher);
+            std::cout << "\nshared secret : " << to_hex(_shrd_key);
+            std::cout << "\niv            : " << to_hex(state.iv) << "\n";
+        }
+        #endif
+    }
+
+    state.computed = true;
+}
+
+//called once the current message has been sent or received completely (and computed on), moves
+//on to the next step. Returns false if the key exchange failed
+inline bool Socket::finishHandshakeStep()
+{
+    Handshake &state = *handshake;
+
+    switch (state.step)
+    {
+        case Handshake::SEND_PUBLIC_KEY:
+        {
+            //the cipher and the IV arrive together, with the ticket if we asked for one
+            state.step = Handshake::RECEIVE_CIPHER;
+            state.message.assign(kyber1024_kem::CIPHER_LEN + AES_BLOCK_SIZE + (state.ticketRequested ? TICKET_LEN : 0), 0);
+            state.transferred = 0;
+            return true;
+        }
+        case Handshake::RECEIVE_HELLO:
+        {
+            if (state.message[0] == HELLO_MARKER && state.message[1] == HELLO_RESUME)
+            {
+                state.step = Handshake::RECEIVE_TICKET;
+                state.message.assign(TICKET_LEN + RESUMPTION_NONCE_LEN, 0);
+                state.transferred = 0;
+                return true;
+            }
+
+            //a 0-RTT client, its first message follows the cipher
+            if (state.message[0] == HELLO_MARKER && state.message[1] == HELLO_EARLY_CIPHER)
+            {
+                if (!state.serverKeypair)
+                {
+                    return false;
+                }
+                state.step = Handshake::RECEIVE_EARLY_CIPHER;
+                state.message.assign(kyber1024_kem::CIPHER_LEN, 0);
+                state.transferred = 0;
+                return true;
+            }
+
+            if (state.message[0] == HELLO_MARKER && state.message[1] == HELLO_REQUEST_TICKET)
+            {
+                state.ticketRequested = true;
+                state.message.assign(kyber1024_kem::PKEY_LEN, 0);
+                state.transferred = 0;
+            }
+            else
+            {
+                //a client without a session cache, the two bytes were the start of its public key
+                state.message.resize(kyber1024_kem::PKEY_LEN);
+            }
+            state.step = Handshake::RECEIVE_PUBLIC_KEY;
+            return true;
+        }
+        case Handshake::RECEIVE_PUBLIC_KEY:
+        {
+            if (state.computeFailed)
+            {
+                return false;
+            }
+
+            //the key is ready before the client has it, messages can only follow the cipher anyway
+            encryptionContext.sharedKey = std::move(state.sharedKey);
+            memcpy(encryptionContext.iv, state.iv, AES_BLOCK_SIZE);
+            if (!initAES())
+            {
+                return false;
+            }
+
+            //the ticket follows the IV. Without ticket keys it stays all zero, which the client
+            //does not keep
+            if (state.ticketRequested)
+            {
+                auto ticket = std::span<uint8_t>(state.reply.data() + kyber1024_kem::CIPHER_LEN + AES_BLOCK_SIZE, TICKET_LEN);
+                if (!state.ticketKeys || !state.ticketKeys->seal(state.resumptionSecret, ticket))
+                {
+                    std::fill(ticket.begin(), ticket.end(), 0);
+                }
+                OPENSSL_cleanse(state.resumptionSecret.data(), state.resumptionSecret.size());
+            }
+
+            state.step = Handshake::SEND_CIPHER;
+            state.message = std::move(state.reply);
+            state.transferred = 0;
+            return true;
+        }
+        case Handshake::RECEIVE_TICKET:
+        {
+            return acceptTicket();
+        }
+        case Handshake::RECEIVE_EARLY_CIPHER:
+        {
+            encryptionContext.sharedKey = std::move(state.sharedKey);
+            memcpy(encryptionContext.iv, state.iv, AES_BLOCK_SIZE);
+            handshake.reset();
+            return initAES();
+        }
+        case Handshake::SEND_CIPHER:
+        {
+            handshake.reset();
+            return true;
+        }
+        case Handshake::SEND_RESUMPTION:
+        {
+            //after a rejected ticket the client starts over with a full handshake
+            if (!state.resumed)
+            {
+                receiveHello();
+                return true;
+            }
+            handshake.reset();
+            return true;
+        }
+        case Handshake::RECEIVE_CIPHER:
+        {
+            //keep the ticket for the next connection, unless the server had none to give
+            if (state.ticketRequested)
+            {
+                auto ticket = std::span<const uint8_t>(state.message.data() + kyber1024_kem::CIPHER_LEN + AES_BLOCK_SIZE, TICKET_LEN);
+                if (sessionCache && std::any_of(ticket.begin(), ticket.begin() + 4, [](uint8_t b) { return b != 0; }))
+                {
+                    sessionCache->store(sessionName, ticket, state.resumptionSecret);
+                }
+                OPENSSL_cleanse(state.resumptionSecret.data(), state.resumptionSecret.size());
+            }
+
+            //store the key in class variable for later use
+            encryptionContext.sharedKey = std::move(state.sharedKey);
+            memcpy(encryptionContext.iv, state.iv, AES_BLOCK_SIZE);
+            OPENSSL_cleanse(state.secretKey.data(), state.secretKey.size());
+            handshake.reset();
+            return initAES();
+        }
+        case Handshake::SEND_TICKET:
+        {
+            //status, the server's nonce and the next ticket arrive together
+            state.step = Handshake::RECEIVE_RESUMPTION;
+            state.message.assign(1 + RESUMPTION_NONCE_LEN + TICKET_LEN, 0);
+            state.transferred = 0;
+            return true;
+        }
+        case Handshake::RECEIVE_RESUMPTION:
+        {
+            //the ticket was rejected (too old, its key rotated out or the server has no keys), the
+            //server now waits for a full handshake on this connection
+            if (state.message[0] != 1)
+            {
+                OPENSSL_cleanse(state.resumptionSecret.data(), state.resumptionSecret.size());
+                sendPublicKey();
+                return true;
+            }
+
+            deriveResumedKeys(state, std::span<const uint8_t>(state.message.data() + 1, RESUMPTION_NONCE_LEN));
+            auto ticket = std::span<const uint8_t>(state.message.data() + 1 + RESUMPTION_NONCE_LEN, TICKET_LEN);
+            if (sessionCache && std::any_of(ticket.begin(), ticket.begin() + 4, [](uint8_t b) { return b != 0; }))
+            {
+                sessionCache->store(sessionName, ticket, state.resumptionSecret);
+            }
+            OPENSSL_cleanse(state.resumptionSecret.data(), state.resumptionSecret.size());
+
+            encryptionContext.sharedKey = std::move(state.sharedKey);
+            memcpy(encryptionContext.iv, state.iv, AES_BLOCK_SIZE);
+            handshake.reset();
+            return initAES();
+        }
+    }
+    return false;
+}
+
+//server: answers the client's ticket with status (1 accepted, 0 rejected), our nonce and the next
+//ticket, the same size either way. An accepted ticket sets up the encryption right away
+inline bool Socket::acceptTicket()
+{
+    Handshake &state = *handshake;
+    auto ticket = std::span<const uint8_t>(state.message.data(), TICKET_LEN);
+
+    state.reply.assign(1 + RESUMPTION_NONCE_LEN + TICKET_LEN, 0);
+    uint8_t *serverNonce = state.reply.data() + 1;
+    state.resumed = state.ticketKeys && state.ticketKeys->open(ticket, state.resumptionSecret) &&
+                    RAND_bytes(serverNonce, RESUMPTION_NONCE_LEN) == 1;
+
+    if (state.resumed)
     {
-        using namespace kyber_utils;
+        state.clientNonce.assign(state.message.begin() + TICKET_LEN, state.message.end());
+        deriveResumedKeys(state, std::span<const uint8_t>(serverNonce, RESUMPTION_NONCE_LEN));
+
+        //the next ticket carries the next secret, so no secret is used twice
+        auto nextTicket = std::span<uint8_t>(state.reply.data() + 1 + RESUMPTION_NONCE_LEN, TICKET_LEN);
+        if (!state.ticketKeys->seal(state.resumptionSecret, nextTicket))
+        {
+            std::fill(nextTicket.begin(), nextTicket.end(), 0);
+        }
+        OPENSSL_cleanse(state.resumptionSecret.data(), state.resumptionSecret.size());
 
-        std::cout << "kyber1024 KEM Results from setupEncryption(): \n";
-        std::cout << "\ninitiator     : false";
-        std::cout << "\npubkey        : " << to_hex(_pkey);
-        std::cout << "\nseckey        : " << to_hex(_skey);
-        std::cout << "\ncipher        : " << to_hex(_cipher);
-        std::cout << "\nshared secret : " << to_hex(_shrd_key);
-        std::cout << "\niv            : " << to_hex(encryptionContext.iv) << "\n";
+        encryptionContext.sharedKey = std::move(state.sharedKey);
+        memcpy(encryptionContext.iv, state.iv, AES_BLOCK_SIZE);
+        if (!initAES())
+        {
+            return false;
+        }
+        state.reply[0] = 1;
     }
-    #endif
-  }
-  
-  //store the key in class variable for later use
-  encryptionContext.sharedKey.assign(shrd_key.begin(), shrd_key.end());
 
-     assert(initAES());    
+    state.step = Handshake::SEND_RESUMPTION;
+    state.message = std::move(state.reply);
+    state.transferred = 0;
+    return true;
+}
+
+//both sides of a resumption: SHAKE256 over the ticket's secret and both nonces gives the session
+//key, the IV and the secret of the next ticket, which replaces the current one in state
+inline void Socket::deriveResumedKeys(Handshake &state, std::span<const uint8_t> serverNonce)
+{
+    static constexpr char label[] = "Socket.h session resumption";
+
+    shake256::shake256_t xof;
+    xof.absorb(std::span<const uint8_t>(reinterpret_cast<const uint8_t*>(label), sizeof(label) - 1));
+    xof.absorb(state.resumptionSecret);
+    xof.absorb(state.clientNonce);
+    xof.absorb(serverNonce);
+    xof.finalize();
+
+    state.sharedKey.assign(KEY_LEN, 0);
+    xof.squeeze(state.sharedKey);
+    xof.squeeze(std::span<uint8_t>(state.iv, AES_BLOCK_SIZE));
+    xof.squeeze(state.resumptionSecret);
+    xof.reset();
+}
+
+inline void Socket::setKeypairPool(std::shared_ptr<KeypairPool> pool)
+{
+    keypairPool = std::move(pool);
+}
+
+inline void Socket::setTicketKeys(std::shared_ptr<TicketKeys> keys)
+{
+    ticketKeys = std::move(keys);
+}
+
+inline void Socket::setSessionCache(std::shared_ptr<SessionCache> cache)
+{
+    sessionCache = std::move(cache);
+}
+
+inline void Socket::setServerKeypair(std::shared_ptr<ServerKeypair> keypair)
+{
+    serverKeypair = std::move(keypair);
 }
 
 //turns encryption on / off at runtime
-void Socket::setCryptography(bool cryptography)
+inline void Socket::setCryptography(bool cryptography)
 {
     //enable/disable encryption/decryption fucntions
     applyCryptography = cryptography;
 }
 
 //frees memory used by encryption context
-void Socket::freeEncryptionContext() 
+inline void Socket::freeEncryptionContext() 
 {
     if (encryptionContext.encrypt_ctx != nullptr) 
     {